@@ -2,6 +2,7 @@
 #include "dummy.h"
 #include "file.h"
 #include "kafka.h"
+#include "postgres.h"
 #include "redis.h"
 
 
@@ -24,6 +25,9 @@ consumer_init(char kind, config_setting_t *config)
         case 'k':
             c = kafka_consumer_init(config);
             break;
+        case 'p':
+            c = postgres_consumer_init(config);
+            break;
         default:
             return NULL;
     }
@@ -10,7 +10,9 @@
 #include "exports.h"
 #include "utils/config.h"
 #include "utils/helper.h"
+#include "utils/jpointer.h"
 #include "utils/logger.h"
+#include "utils/pgtime.h"
 #include "utils/postgres.h"
 #include "utils/scalloc.h"
 #include "utils/endian.h"
@@ -18,55 +20,58 @@
 typedef struct Needles *Needles;
 typedef struct Needles {
     char           *jpointer;
-    bool          (*format) (json_object *, Needles);
+    bool          (*format) (JValue *, Needles);
     void          (*free) (void **);
-    uint32_t       *leapyears;
     uint32_t        length;
     void           *result; // output
-    bool          (*action) (bool, json_object *, Needles);
-    bool          (*filter) (bool, json_object *, Needles);
+    bool          (*action) (bool, JValue *, Needles);
+    bool          (*filter) (bool, JValue *, Needles);
     bool            store;
     const char     *filter_data;
 } *Needles;
 
 typedef struct Internal {
     Needles        *needles;
-    uint32_t       *leapyears;  // leapyears are globally shared
     uint16_t        ncount; // count of needles
+    JPointers       jpointers;
+    JValue         *values; // found by the needles
     uint16_t        rows; // number of rows inserted into postgres
 } *Internal;
 
-static bool _json_to_pqtext (json_object *needle, Needles current);
-static bool _json_to_pqtimestamp (json_object *needle, Needles current);
+static bool _json_to_pqtext (JValue *needle, Needles current);
+static bool _json_to_pqtimestamp (JValue *needle, Needles current);
+static bool _json_to_pqdate (JValue *needle, Needles current);
 static void _obj_noop(UNUSED void **obj);
 static void _obj_free(void **obj);
 
-static bool _filter_match (bool jpointer, json_object *found, Needles current);
-static bool _filter_noop (bool jpointer, json_object *found, Needles current);
-static bool _filter_substr (bool jpointer, json_object *found, Needles current);
-static bool _filter_exists (bool jpointer, json_object *found, Needles current);
+static bool _filter_match (bool jpointer, JValue *found, Needles current);
+static bool _filter_noop (bool jpointer, JValue *found, Needles current);
+static bool _filter_substr (bool jpointer, JValue *found, Needles current);
+static bool _filter_exists (bool jpointer, JValue *found, Needles current);
 
-static bool _action_store (bool filter_ret, json_object *found, Needles current);
-static bool _action_store_true (bool filter_ret, json_object *found, Needles current);
-static bool _action_discard_false (bool filter_ret, json_object *found, Needles current);
-static bool _action_discard_true (bool filter_ret, json_object *found, Needles current);
+static bool _action_store (bool filter_ret, JValue *found, Needles current);
+static bool _action_store_true (bool filter_ret, JValue *found, Needles current);
+static bool _action_discard_false (bool filter_ret, JValue *found, Needles current);
+static bool _action_discard_true (bool filter_ret, JValue *found, Needles current);
 
 // Types of postgres fields
 typedef enum {  // todo: add jsonb, int.
     pqtype_undef,
     pqtype_text,
     pqtype_timestamp,
+    pqtype_date,
 } PqTypes;
 
 static const struct {
     PqTypes type;
     const char *pq_type;
-    bool  (*format) (json_object *, Needles);
+    bool  (*format) (JValue *, Needles);
     void  (*free) (void **obj);
 }  pq_types [] = {
         {pqtype_undef, "undef", NULL, NULL},
         {pqtype_text, "text", &_json_to_pqtext, &_obj_noop},
         {pqtype_timestamp, "timestamp", &_json_to_pqtimestamp, &_obj_free},
+        {pqtype_date, "date", &_json_to_pqdate, &_obj_free},
 };
 
 
@@ -82,7 +87,7 @@ typedef enum {
 static const struct {
     ActionTypes type;
     const char *action_type;
-    bool  (*action) (bool, json_object *, Needles);
+    bool  (*action) (bool, JValue *, Needles);
     bool store;
 }  action_types [] = {
         {action_undef, "undef", NULL, false},
@@ -105,7 +110,7 @@ typedef enum {
 static const struct {
     FilterTypes type;
     const char *filter_type;
-    bool (*filter) (bool, json_object *, Needles);
+    bool (*filter) (bool, JValue *, Needles);
     bool needs_data;
 }  filter_types [] = {
         {filter_undef, "undef", NULL, false},
@@ -171,25 +176,6 @@ _pqtype_enum(const char *pqtype)
     return pqtype_undef;
 }
 
-static uint32_t *
-_leapyear()
-{
-    // 2048 years ought to be enough
-    uint32_t *l = SCALLOC(2048,sizeof(uint32_t));
-    uint32_t a = 0;
-
-    for (uint32_t i = 0; i < 2047; i++) {
-        if ((i % 4 == 0 && i % 100 != 0) || (i % 400 == 0)) {
-            a += 1;
-        }
-        //The array starts with 0 accumulated days
-        *(l+i+1) = a;
-    }
-
-    return l;
-}
-
-
 static void _obj_noop(UNUSED void **obj)
 {
     //noop; object is managed by json-c
@@ -208,205 +194,116 @@ static void _obj_free(void **obj)
 }
 
 static bool
-_action_store(UNUSED bool filter_ret, UNUSED json_object *found,
+_action_store(UNUSED bool filter_ret, UNUSED JValue *found,
     UNUSED Needles current)
 {
     return true;
 }
 
 static bool
-_action_store_true(bool filter_ret, UNUSED json_object *found,
+_action_store_true(bool filter_ret, UNUSED JValue *found,
     UNUSED Needles current)
 {
     return filter_ret;
 }
 
 static bool
-_action_discard_false(bool filter_ret, UNUSED json_object *found,
+_action_discard_false(bool filter_ret, UNUSED JValue *found,
     UNUSED Needles current)
 {
     return filter_ret;
 }
 
 static bool
-_action_discard_true(bool filter_ret, UNUSED json_object *found,
+_action_discard_true(bool filter_ret, UNUSED JValue *found,
     UNUSED Needles current)
 {
     return !filter_ret;
 }
 
 static bool
-_filter_match(bool jpointer, json_object *found,
+_filter_match(bool jpointer, JValue *found,
     UNUSED Needles current)
 {
-    if(jpointer == false || !found) // no data to match against
+    if(jpointer == false || !found->data) // no data to match against
         return false;
-    if(strcmp(json_object_get_string(found), current->filter_data) == 0)
+    if(found->len == strlen(current->filter_data)
+        && memcmp(found->data, current->filter_data, found->len) == 0)
         return true;
     return false;
 }
 
 static bool
-_filter_substr(bool jpointer, json_object *found,
+_filter_substr(bool jpointer, JValue *found,
     UNUSED Needles current)
 {
-    if(jpointer == false || !found) // no data to match against
+    if(jpointer == false || !found->data) // no data to match against
         return false;
-    if(strstr(json_object_get_string(found), current->filter_data))
+    if(memmem(found->data, found->len, current->filter_data,
+        strlen(current->filter_data)))
         return true;
     return false;
 }
 
 static bool
-_filter_noop(UNUSED bool jpointer, UNUSED json_object *found,
+_filter_noop(UNUSED bool jpointer, UNUSED JValue *found,
     UNUSED Needles current)
 {
     return true;
 }
 
 static bool
-_filter_exists(bool jpointer, UNUSED json_object *found,
+_filter_exists(bool jpointer, UNUSED JValue *found,
     UNUSED Needles current)
 {
     return jpointer;
 }
 
 static bool
-_json_to_pqtext(json_object *found, Needles current)
+_json_to_pqtext(JValue *found, Needles current)
 {
     // Any json type can be cast to string
-    current->result = (char *)json_object_get_string(found);
-    current->length = strlen(current->result);
+    current->result = (char *)found->data;
+    current->length = found->len;
     return true;
 }
 
 static bool
-_json_to_pqtimestamp(json_object *found, Needles current)
-{
-    const char *ts = json_object_get_string(found);
-    uint64_t epoch;
-    size_t len = strlen(ts);
-
-    struct {
-        uint32_t year;
-        uint32_t month;
-        uint32_t day;
-        uint32_t yday;
-        uint32_t hour;
-        uint32_t minute;
-        uint32_t second;
-        uint64_t micro;
-    } tm;
-
-    memset(&tm,0,sizeof(tm));
-
-    // todo: static memory allocation in internal?
-    current->result = malloc(sizeof(uint64_t));
-    if(!current->result)
-        goto error;
-
-    //2019-11-05T11:31:34Z
-    #define T_MONTH 5
-    #define T_DAY 8
-    #define T_HOUR 11
-    #define T_MINUTE 14
-    #define T_SECOND 17
-    #define T_FRACTION 20
-    #define T_MIN 20
-    #define T_MAX 31
-
-    // postgres only stores 6 digits after .
-    #define PG_FRACTION 6
-
-    if (len < T_MIN || len > T_MAX) {
-        logger_log("%s %d: Datestring %s not supported",
-            __FILE__, __LINE__, ts);
-        goto error;
-    }
-
-    // If a timestamp is not like 2000-01-01T00:00:01.000000Z
-    // or 2000-01-01T:00:00:01Z it's considered invalid
-    // Z stands for Zulu/UTC
-    if (ts[T_MONTH-1] != '-' || ts[T_DAY-1] != '-' || ts[T_HOUR-1] != 'T'
-            || ts[T_MINUTE-1] != ':' || ts[T_SECOND-1] != ':'
-            || !(ts[T_FRACTION-1] == '.' || ts[T_FRACTION-1] == 'Z')
-            || ts[len-1] != 'Z') {
-        logger_log("%s %d: Datestring %s not supported",
-            __FILE__, __LINE__, ts);
-        goto error;
-    }
-
-    errno = 0;
-    tm.year = strtoul(ts,NULL,10);
-    tm.month = strtoul(ts+T_MONTH,NULL,10);
-    tm.day = strtoul(ts+T_DAY,NULL,10);
-    tm.hour = strtoul(ts+T_HOUR,NULL,10);
-    tm.minute = strtoul(ts+T_MINUTE,NULL,10);
-    tm.second = strtoul(ts+T_SECOND,NULL,10);
-    if(ts[T_FRACTION] != 'Z' && ts[T_FRACTION-1] != 'Z') { // fractionless timestamps
-        char micro[PG_FRACTION+1] = "000000";
-        size_t bytes = (len-1) - T_MIN > PG_FRACTION ?
-            PG_FRACTION : (len-1) - T_MIN;
-        memcpy(micro, ts+T_MIN,bytes);
-        tm.micro = strtoull(micro,NULL,10);
-    }
+_json_to_pqtimestamp(JValue *found, Needles current)
+{
+    int64_t usec;
 
-    if(errno) {
-        logger_log("%s %d: Error %s in date conversion",
-            __FILE__, __LINE__, strerror(errno));
-        goto error;
+    if(!pgtime_timestamp(found->data, found->len, &usec)) {
+        logger_log("%s %d: Datestring %.*s not supported",
+            __FILE__, __LINE__, (int) found->len, found->data);
+        return false;
     }
 
-    if(tm.year < 2000 || tm.year > 4027) {
-        logger_log("%s %d: Date %s out of range",
-            __FILE__, __LINE__, ts);
-        goto error;
-    }
-    if(tm.month < 1 || tm.month > 12 || tm.day >31
-        || tm.hour > 23 || tm.minute > 59 || tm.second > 59) {
-        logger_log("%s %d: Datestring %s not a date",
-            __FILE__, __LINE__, ts);
-        goto error;
-    }
-    if(tm.month == 2 && tm.day > 29) {
-        logger_log("%s %d: Datestring %s not a date",
-            __FILE__, __LINE__, ts);
-        goto error;
-    }
+    current->result = malloc(sizeof(uint64_t));
+    if(!current->result)
+        return false;
+    *((uint64_t *) current->result) = htobe64((uint64_t) usec);
+    current->length = sizeof(uint64_t);
+    return true;
+}
 
-    // postgres starts at 2000-01-01
-    tm.year -= 2000;
-
-    // day of year
-    for (uint8_t i = 1; i < tm.month; i++) {
-        if(i == 2) {
-            if ((tm.year % 4 == 0 && tm.year % 100 != 0) || (tm.year % 400 == 0))
-                tm.yday += 29;
-            else
-                tm.yday += 28;
-        } else if (i < 8) {
-            tm.yday += 30 + (i%2);
-        } else {
-            // 31sts occure on even months from august on. I curse you pope gregory XIII.
-            tm.yday += 30 + ((i+1)%2);
-        }
+static bool
+_json_to_pqdate(JValue *found, Needles current)
+{
+    int32_t days;
 
+    if(!pgtime_date(found->data, found->len, &days)) {
+        logger_log("%s %d: Datestring %.*s not supported",
+            __FILE__, __LINE__, (int) found->len, found->data);
+        return false;
     }
 
-    tm.yday += tm.day;
-
-    epoch = tm.second + tm.minute*60 + tm.hour*3600 + (tm.yday-1)*86400
-    + *(current->leapyears+(tm.year))*86400 + tm.year*31536000;
-
-    epoch *= 1000000;
-    epoch += tm.micro;
-
-    *((uint64_t *) current->result) = htobe64(epoch);
-    current->length = sizeof(uint64_t);
-
+    current->result = malloc(sizeof(uint32_t));
+    if(!current->result)
+        return false;
+    *((uint32_t *) current->result) = htobe32((uint32_t) days);
+    current->length = sizeof(uint32_t);
     return true;
-    error:
-    return false;
 }
 
 static Needles *
@@ -417,15 +314,13 @@ _needles(config_setting_t *needlestack, Internal internal)
     list = config_setting_length(needlestack);
 
     Needles *needles = SCALLOC(list,sizeof(*needles));
-    internal->leapyears = _leapyear();
+    char **jpointers = SCALLOC(list,sizeof(*jpointers));
 
     internal->rows = 0;
 
     for(int i = 0; i < list; i++) {
         Needles current = SCALLOC(list,sizeof(*current));
         needles[i] = current;
-        // Alias should a needle need leapyear data
-        needles[i]->leapyears = internal->leapyears;
 
         setting = config_setting_get_elem(needlestack, i);
         if (config_setting_type(setting) != CONFIG_TYPE_ARRAY) {
@@ -439,6 +334,7 @@ _needles(config_setting_t *needlestack, Internal internal)
             logger_log("%s %d: Failed to strdup", __FILE__, __LINE__);
             abort();
         }
+        jpointers[i] = current->jpointer;
 
         member = config_setting_get_elem(setting, 1);
         pqtype = _pqtype_enum(config_setting_get_string(member));
@@ -461,6 +357,8 @@ _needles(config_setting_t *needlestack, Internal internal)
 
     }
 
+    internal->jpointers = jpointers_init(jpointers, list);
+    free(jpointers);
     return needles;
 }
 
@@ -500,13 +398,9 @@ exports_meta_init(const char *host, const char *topic, config_setting_t *needles
     m->internal = i;
     m->internal->needles = _needles(needlestack, i);
     m->internal->ncount = config_setting_length(needlestack);
+    m->internal->values = SCALLOC(m->internal->ncount, sizeof(JValue));
 
-    m->conn_master = PQconnectdb(m->conninfo);
-    if (PQstatus(m->conn_master) != CONNECTION_OK)
-    {
-        logger_log("%s %d: %s", __FILE__, __LINE__, PQerrorMessage(m->conn_master));
-        abort();
-    }
+    m->conn_master = pg_connect(m->conninfo);
 
     if (pthread_mutex_init(&m->commit_mutex, NULL) != 0) {
         logger_log("%s %d: unable to create mutex", __FILE__, __LINE__ );
@@ -524,6 +418,8 @@ exports_meta_free(Meta *m)
 
     free((*m)->conninfo);
     free((*m)->cpycmd);
+    pgcopy_buf_free(&(*m)->cpybuf);
+    free((*m)->rows);
     PQfinish((*m)->conn_master);
 
     for (int i = 0; i < internal->ncount; i++ ) {
@@ -533,7 +429,8 @@ exports_meta_free(Meta *m)
         free(internal->needles[i]);
     }
     free(internal->needles);
-    free(internal->leapyears);
+    free(internal->values);
+    jpointers_free(&internal->jpointers);
     free(internal);
 
     free(*m);
@@ -565,25 +462,47 @@ exports_producer_init(config_setting_t *config)
     return exports;
 }
 
-int
-_deref(json_object *haystack, Internal internal)
+/*
+ * _extract
+ *      Finds the values of all needles in a single pass over the json,
+ *      json-c only parses documents the pass leaves to it. The values
+ *      point into data or into the haystack.
+ */
+static bool
+_extract(Internal internal, const char *data, size_t len,
+    json_object **haystack)
 {
-    json_object *found;
+    if (jpointers_extract(internal->jpointers, data, len, internal->values))
+        return true;
 
+    *haystack = json_tokener_parse(data);
+    if(!*haystack) {
+        logger_log("%s %d: Failed to tokenize json!", __FILE__, __LINE__);
+        return false;
+    }
+    jpointers_resolve(internal->jpointers, *haystack, internal->values);
+    return true;
+}
+
+/*
+ * _deref
+ *      calls every needle on the values found in the json
+ *      stores results according to the configuration of the needle
+ */
+int
+_deref(Internal internal)
+{
     Needles *needles = internal->needles;
     for (int i = 0; i < internal->ncount; i++) {
-        found = NULL;
-        /* json_pointer_get returns negative if an error (or not found)
-         * returns 0 if it succeeds */
-        int ret = json_pointer_get(haystack, needles[i]->jpointer, &found);
+        JValue *found = &internal->values[i];
 
         if(!needles[i]->action(
-                needles[i]->filter(ret == 0, found, needles[i]),
+                needles[i]->filter(found->found, found, needles[i]),
                 found, needles[i]))
             return 1;
 
-        if(ret) {
-            // if json_pointer returned null
+        if(!found->data) {
+            // if json_pointer found nothing (or null)
             needles[i]->result = NULL;
             // complement of 0 is uint32_t max
             // int max is postgres NULL;
@@ -600,6 +519,14 @@ _deref(json_object *haystack, Internal internal)
     return 0;
 }
 
+// rows are kept in the COPY buffer until committed
+static inline void
+_put(Meta m, const void *data, size_t len)
+{
+    memcpy(pgcopy_buf_reserve(&m->cpybuf, len), data, len);
+    m->cpybuf.len += len;
+}
+
 void
 exports_producer_produce(Producer p, Message msg)
 {
@@ -624,31 +551,13 @@ exports_producer_produce(Producer p, Message msg)
 
     pthread_mutex_lock(&m->commit_mutex);
     if (m->copy == 0)
-    {
-        m->res = PQexec(m->conn_master, m->cpycmd);
-        if (PQresultStatus(m->res) != PGRES_COPY_IN)
-        {
-            logger_log("%s %d: %s", __FILE__, __LINE__,
-                PQerrorMessage(m->conn_master));
-            abort();
-        }
-        PQclear(m->res);
-        PQputCopyData(m->conn_master,
-            "PGCOPY\n\377\r\n\0" //postgres magic
-            "\0\0\0\0"  // flags field (only bit 16 relevant)
-            "\0\0\0\0"  // Header extension area
-            , 19);
-        m->copy = 1;
-    }
+        copy_begin(&m);
 
-    haystack = json_tokener_parse(data);
-    if(!haystack) {
-        logger_log("%s %d: Failed to tokenize json!", __FILE__, __LINE__);
+    if(!_extract(internal, data, len, &haystack))
         goto error;
-    }
 
     // get value from json, apply transformation
-    if((ret = _deref(haystack, internal) != 0)) {
+    if((ret = _deref(internal) != 0)) {
         if(ret == -1)
             logger_log("%s %d: Failed to dereference json!\n %s",
                 __FILE__, __LINE__, data);
@@ -658,19 +567,22 @@ exports_producer_produce(Producer p, Message msg)
         goto fail;
     }
 
-    PQputCopyData(m->conn_master, (char *) &rows, 2);
+    copy_row(&m);
+    _put(m, (char *) &rows, 2);
 
     for (int i = 0; i < internal->ncount; i++) {
         if(!needles[i]->store)
             continue;
         uint32_t length =  htobe32(needles[i]->length);
-        PQputCopyData(m->conn_master, (void *) &length, 4);
+        _put(m, (void *) &length, 4);
 
         if(needles[i]->result) {
-            PQputCopyData(m->conn_master, needles[i]->result, needles[i]->length);
+            _put(m, needles[i]->result, needles[i]->length);
             needles[i]->free(&needles[i]->result);
         }
     }
+    if (m->cpybuf.len - m->flushed >= PGCOPY_FLUSH)
+        copy_flush(&m);
 
     m->count = m->count + 1;
     if (m->count == 2000)
@@ -1,10 +1,27 @@
 #include "schaufel.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "file.h"
+#include "utils/compress.h"
+#include "utils/decompress.h"
+#include "utils/fnv.h"
+#include "utils/frame.h"
 #include "utils/logger.h"
+#include "utils/metadata.h"
+#include "utils/pgcopy.h"
 #include "utils/scalloc.h"
 
 
@@ -12,10 +29,160 @@
  * lots of error handling
  */
 
+// size of the blocks the consumer reads
+#define FILE_BLOCK (1 << 20)
+// size of the ranges a split file is read in
+#define FILE_CHUNK (16 << 20)
+// milliseconds a following consumer waits for the file to change
+#define FILE_WAIT_MS 1000
+
+typedef enum {
+    FILE_RAW,       // messages as they are
+    FILE_TEXT,      // COPY text, like the postgres json format
+    FILE_CSV,
+    FILE_BINARY,    // binary COPY rows, framed by header and trailer
+} file_format;
+
+// segment file of a producer (shard)
+typedef struct Segment {
+    char        *prefix;        // <file>[.<shard>][.<thread>]
+    char        *part;          // segment being written
+    int          fd;
+    time_t       opened;
+    long long    written;
+    unsigned     seq;
+    PgCopyBuf    buf;           // rows not yet written
+    bool         dirty;         // written since the last fsync
+} Segment;
+
 typedef struct Meta {
     FILE *fp;
+    frame_type   framing;       // records of producer and consumer
+    bool         crc;
+    // producer segments
+    const char  *fname;
+    file_format  fmt;
+    long long    rotate_size;   // bytes
+    int          rotate_time;   // seconds
+    size_t       flush;         // size of buf to write at
+    Compressor   compress;
+    PgCopyBuf    frame;
+    int          sync;          // seconds between fsyncs, 0 for none
+    int          sync_iter;
+    bool         sync_stop;
+    pthread_t    sync_worker;
+    pthread_cond_t  sync_cond;  // wakes the sync worker to stop
+    pthread_mutex_t mutex;
+    Segment     *segs;          // one per shard
+    int          nsegs;
+    const char  *shard_key;
+    struct FileShare *threads;  // numbers the producer threads
+    // consumer block, lines are split off [start, end)
+    char        *block;
+    size_t       start;
+    size_t       end;
+    size_t       size;
+    bool         eof;
+    off_t        base;          // file offset of block[0]
+    Decompressor codec;         // compressed file
+    // consumer chunk of a split file
+    struct FileShare *split;
+    uint64_t     chunk;         // chunk number + 1, 0 if none
+    off_t        chunk_end;
+    // consumer following the file
+    bool         follow;
+    bool         idle;          // unchanged during the last wait
+    int          inotify;
+    int          wd;            // watch of the file (and its directory)
+    char        *watch;         // name of the file in its directory
+    ino_t        ino;
+    struct FileAck *ack;
+    // consumer of a glob, reading one file after the other
+    struct FileShare *glob;
+    struct FileDone  *done;
 } *Meta;
 
+/* Checkpoint of a consumer: the inode of the file and the offset up to
+ * which every line was handled. Producers may handle lines out of order,
+ * those are kept as ranges until the lines before them are handled as
+ * well. The checkpoint is shared with the metadata of every message in
+ * flight, which is why it is refcounted: producers may still run
+ * callbacks once the consumer has been freed. It is written by the
+ * callbacks (once a second at most) and by whoever releases it last.
+ * Truncating or rotating the file starts a new generation, the lines of
+ * older ones are no longer checkpointed. */
+typedef struct FileRange {
+    uint64_t start;
+    uint64_t end;
+} FileRange;
+
+typedef struct FileAck {
+    char            *path;
+    pthread_mutex_t  mutex;
+    uint64_t         ino;
+    uint64_t         gen;
+    uint64_t         flushed;
+    FileRange       *ranges;    // handled behind flushed, sorted
+    size_t           nranges;
+    size_t           alloc;
+    time_t           written;
+    atomic_long      refcount;
+} *FileAck;
+
+/* A file of a glob, referenced by its consumer while reading and by
+ * every message in flight. Once the last reference is gone, the file is
+ * done and added to the manifest. */
+typedef struct FileDone {
+    struct FileShare *share;
+    const char       *name;
+    bool              partial;  // not read to its end
+    atomic_long       refcount;
+} *FileDone;
+
+// message metadata "file_pos", the line of a message
+typedef struct FilePos {
+    FileAck  ack;
+    FileDone done;
+    uint64_t gen;
+    uint64_t start;
+    uint64_t end;
+} *FilePos;
+
+/*
+ * Shared work
+ *
+ * The threads of a consumer reading a split file or a glob share one
+ * FileShare, registered by their config setting. (Producer threads
+ * number themselves by it.)
+ *
+ * A split file is cut into chunks of FILE_CHUNK bytes, which the threads
+ * take in turn. A line belongs to the chunk it starts in. If the split is
+ * ordered, a thread reads its chunk in advance, but queues it only once
+ * all lines of the chunk before are queued.
+ *
+ * The files of a glob are taken in turn as well, skipping those listed
+ * in the manifest.
+ */
+typedef struct FileShare {
+    const config_setting_t *config;
+    off_t            size;
+    bool             ordered;
+    uint64_t         next;      // next chunk or file to take
+    uint64_t         turn;      // chunk to be queued (ordered)
+    bool             stop;
+    glob_t           files;
+    char           **skip;      // files done, sorted
+    size_t           nskip;
+    FILE            *manifest;
+    int              refs;
+    pthread_mutex_t  mutex;
+    pthread_cond_t   cond;
+    struct FileShare *link;
+} *FileShare;
+
+static FileShare _shares = NULL;
+static pthread_mutex_t _shares_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 Meta
 file_meta_init(const char *fname, char *options)
 {
@@ -33,20 +200,493 @@ file_meta_init(const char *fname, char *options)
 void
 file_meta_free(Meta *m)
 {
-    if ( fclose((*m)->fp) != 0)
+    if ((*m)->fp && fclose((*m)->fp) != 0)
         logger_log("%s %d: %s", __FILE__, __LINE__, strerror(errno));
+    free((*m)->block);
     free(*m);
     *m = NULL;
 }
 
+static file_format
+_file_format(const char *format)
+{
+    if (format == NULL || !strcmp(format, "raw"))
+        return FILE_RAW;
+    if (!strcmp(format, "text"))
+        return FILE_TEXT;
+    if (!strcmp(format, "csv"))
+        return FILE_CSV;
+    if (!strcmp(format, "binary"))
+        return FILE_BINARY;
+    return -1;
+}
+
+static void
+_file_write(Meta m, const void *data, size_t len)
+{
+    if (len && fwrite(data, len, 1, m->fp) != 1)
+    {
+        logger_log("%s %d: %s %s", __FILE__, __LINE__, m->fname,
+            strerror(errno));
+        abort();
+    }
+}
+
+static int
+_strcmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * _share_glob
+ *      Expand the glob (a directory stands for all files in it) and
+ *      read the files already done from the manifest.
+ */
+static void
+_share_glob(FileShare s, const char *pattern, const char *manifest,
+    bool sorted)
+{
+    char *line = NULL, *dir = NULL;
+    size_t size = 0, alloc = 0;
+    ssize_t len;
+    struct stat st;
+    FILE *fp;
+
+    if (stat(pattern, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        size = strlen(pattern) + sizeof("/*");
+        dir = SCALLOC(size, 1);
+        snprintf(dir, size, "%s/*", pattern);
+        pattern = dir;
+    }
+    switch (glob(pattern, sorted ? 0 : GLOB_NOSORT, NULL, &s->files))
+    {
+        case 0:
+        case GLOB_NOMATCH:
+            break;
+        default:
+            logger_log("%s %d: glob %s failed", __FILE__, __LINE__, pattern);
+            abort();
+    }
+    free(dir);
+
+    if (manifest == NULL)
+        return;
+
+    if ((fp = fopen(manifest, "r")) != NULL)
+    {
+        while ((len = getline(&line, &size, fp)) > 0)
+        {
+            if (line[len - 1] == '\n')
+                line[len - 1] = '\0';
+            if (s->nskip == alloc)
+            {
+                alloc = alloc ? alloc * 2 : 64;
+                s->skip = realloc(s->skip, alloc * sizeof(*s->skip));
+                if (s->skip == NULL)
+                {
+                    logger_log("%s %d: %s", __FILE__, __LINE__,
+                        strerror(errno));
+                    abort();
+                }
+            }
+            s->skip[s->nskip++] = strdup(line);
+        }
+        free(line);
+        fclose(fp);
+        qsort(s->skip, s->nskip, sizeof(*s->skip), _strcmp);
+    }
+
+    s->manifest = fopen(manifest, "a");
+    if (s->manifest == NULL)
+    {
+        logger_log("%s %d: %s %s", __FILE__, __LINE__, manifest,
+            strerror(errno));
+        abort();
+    }
+}
+
+static FileShare
+_share_get(const config_setting_t *config, Meta m)
+{
+    const char *split = NULL, *pattern = NULL, *manifest = NULL;
+    int sorted = 1;
+    FileShare s;
+    struct stat st;
+
+    pthread_mutex_lock(&_shares_mutex);
+    for (s = _shares; s && s->config != config; s = s->link);
+    if (s == NULL)
+    {
+        s = SCALLOC(1, sizeof(*s));
+        s->config = config;
+        if (config_setting_lookup_string(config, "split", &split)
+            == CONFIG_TRUE)
+        {
+            if (fstat(fileno(m->fp), &st) != 0)
+            {
+                logger_log("%s %d: %s", __FILE__, __LINE__,
+                    strerror(errno));
+                abort();
+            }
+            s->size = st.st_size;
+            s->ordered = !strcmp(split, "ordered");
+        }
+        if (config_setting_lookup_string(config, "glob", &pattern)
+            == CONFIG_TRUE)
+        {
+            config_setting_lookup_string(config, "manifest", &manifest);
+            config_setting_lookup_bool(config, "sorted", &sorted);
+            _share_glob(s, pattern, manifest, sorted);
+        }
+        pthread_mutex_init(&s->mutex, NULL);
+        pthread_cond_init(&s->cond, NULL);
+        s->link = _shares;
+        _shares = s;
+    }
+    s->refs++;
+    pthread_mutex_unlock(&_shares_mutex);
+    return s;
+}
+
+static void
+_share_put(FileShare s, bool stop)
+{
+    FileShare *p;
+
+    // a thread leaving mid chunk must not block the others
+    pthread_mutex_lock(&s->mutex);
+    s->stop |= stop;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+
+    pthread_mutex_lock(&_shares_mutex);
+    if (--s->refs == 0)
+    {
+        for (p = &_shares; *p != s; p = &(*p)->link);
+        *p = s->link;
+        if (s->manifest)
+            fclose(s->manifest);
+        for (size_t i = 0; i < s->nskip; i++)
+            free(s->skip[i]);
+        free(s->skip);
+        globfree(&s->files);
+        pthread_mutex_destroy(&s->mutex);
+        pthread_cond_destroy(&s->cond);
+        free(s);
+    }
+    pthread_mutex_unlock(&_shares_mutex);
+}
+
+/*
+ * Segments
+ *
+ * With a COPY format, compression, rotation or more than one thread, the
+ * producer writes segments named <file>.<UTC time>.<seq>[.gz|.zst|.lz4].
+ * A segment is written as <segment>.part and renamed once it is complete
+ * and synced, so a loader never sees a partial file.
+ *
+ * Every thread writes segments of its own, named <file>.<thread>. With
+ * shards, a thread writes a segment per shard, <file>.<shard>[.<thread>],
+ * picked by the jump hash of the shard_key metadata.
+ *
+ * Rows are collected in a buffer, which is written (as one compressed
+ * frame) once it holds flush bytes. Given sync, a worker writes the
+ * buffers and fsyncs the segments every sync seconds (group commit).
+ */
+static void
+_segment_writev(Segment *g, struct iovec *iov, int n)
+{
+    ssize_t r;
+
+    while (n > 0)
+    {
+        if ((r = writev(g->fd, iov, n)) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            logger_log("%s %d: %s %s", __FILE__, __LINE__, g->part,
+                strerror(errno));
+            abort();
+        }
+        g->written += r;
+        for (; n > 0 && (size_t) r >= iov->iov_len; iov++, n--)
+            r -= iov->iov_len;
+        if (n > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+    g->dirty = true;
+}
+
+/*
+ * _segment_flush
+ *      write the buffer and, uncompressed, a row too large for it
+ */
+static void
+_segment_flush(Meta m, Segment *g, const char *row, size_t len)
+{
+    struct iovec iov[2] = {
+        {g->buf.data, g->buf.len},
+        {(char *) row, len},
+    };
+
+    if (m->compress && g->buf.len)
+    {
+        m->frame.len = 0;
+        if (compress_frame(m->compress, g->buf.data, g->buf.len,
+                &m->frame) < 0)
+            abort();
+        iov[0].iov_base = m->frame.data;
+        iov[0].iov_len = m->frame.len;
+    }
+    _segment_writev(g, iov, row ? 2 : 1);
+    g->buf.len = 0;
+}
+
+static void
+_segment_sync(Segment *g)
+{
+    if (fdatasync(g->fd) != 0)
+    {
+        logger_log("%s %d: %s %s", __FILE__, __LINE__, g->part,
+            strerror(errno));
+        abort();
+    }
+    g->dirty = false;
+}
+
+static void
+_segment_open(Meta m, Segment *g)
+{
+    char stamp[32];
+    struct tm tm;
+    size_t len = strlen(g->prefix) + sizeof(stamp) + 24;
+
+    g->opened = time(NULL);
+    gmtime_r(&g->opened, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+
+    g->part = SCALLOC(len, 1);
+    snprintf(g->part, len, "%s.%s.%u%s.part", g->prefix, stamp, g->seq++,
+        m->compress ? compress_suffix(m->compress) : "");
+
+    g->fd = open(g->part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (g->fd == -1)
+    {
+        logger_log("%s %d: %s %s", __FILE__, __LINE__, g->part,
+            strerror(errno));
+        abort();
+    }
+
+    g->written = 0;
+    if (m->fmt == FILE_BINARY)
+    {
+        memcpy(pgcopy_buf_reserve(&g->buf, PGCOPY_HEADER_LEN),
+            PGCOPY_HEADER, PGCOPY_HEADER_LEN);
+        g->buf.len += PGCOPY_HEADER_LEN;
+    }
+}
+
+static void
+_segment_close(Meta m, Segment *g)
+{
+    char *name = strndup(g->part, strlen(g->part) - strlen(".part"));
+    char *dir = strdup(g->part);
+    int dfd;
+
+    if (m->fmt == FILE_BINARY)
+    {
+        memcpy(pgcopy_buf_reserve(&g->buf, PGCOPY_TRAILER_LEN),
+            PGCOPY_TRAILER, PGCOPY_TRAILER_LEN);
+        g->buf.len += PGCOPY_TRAILER_LEN;
+    }
+    _segment_flush(m, g, NULL, 0);
+    _segment_sync(g);
+
+    if (close(g->fd) != 0 || rename(g->part, name) != 0)
+    {
+        logger_log("%s %d: %s %s", __FILE__, __LINE__, g->part,
+            strerror(errno));
+        abort();
+    }
+    // make the rename durable as well
+    if ((dfd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) != -1)
+    {
+        fsync(dfd);
+        close(dfd);
+    }
+
+    g->fd = -1;
+    free(g->part);
+    g->part = NULL;
+    free(name);
+    free(dir);
+}
+
+/*
+ * _sync_worker
+ *      Wakes up every second to write and fsync the segments, holding
+ *      the mutex except while it waits. It is stopped by sync_stop, not
+ *      cancelled: a cancel could hit it in the middle of closing a
+ *      segment.
+ */
+static void *
+_sync_worker(void *meta)
+{
+    Meta m = (Meta) meta;
+    Segment *g;
+    struct timespec ts;
+
+    pthread_mutex_lock(&m->mutex);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    while (!m->sync_stop)
+    {
+        ts.tv_sec++;
+        while (!m->sync_stop && pthread_cond_timedwait(&m->sync_cond,
+                &m->mutex, &ts) != ETIMEDOUT);
+        if (m->sync_stop)
+            break;
+
+        if (++m->sync_iter >= m->sync)
+        {
+            for (g = m->segs; g < m->segs + m->nsegs; g++)
+            {
+                if (g->fd == -1)
+                    continue;
+                // an idle segment is rotated here, too
+                if (m->rotate_time
+                    && time(NULL) - g->opened >= m->rotate_time)
+                    _segment_close(m, g);
+                else if (g->buf.len || g->dirty)
+                {
+                    _segment_flush(m, g, NULL, 0);
+                    _segment_sync(g);
+                }
+            }
+            m->sync_iter = 0;
+        }
+    }
+    pthread_mutex_unlock(&m->mutex);
+    return NULL;
+}
+
+/*
+ * _segment_shard
+ *      the segment of the shard_key of a message, shard 0 without one
+ */
+static Segment *
+_segment_shard(Meta m, Message msg)
+{
+    MDatum datum;
+    Fnv32_t hash;
+
+    if (m->nsegs == 1)
+        return m->segs;
+
+    datum = metadata_find(message_get_metadata(msg), (char *) m->shard_key);
+    if (datum && datum->type == MTYPE_STRING)
+        hash = fnv32a_str(datum->value.string, strlen(datum->value.string));
+    else if (datum && (datum->type == MTYPE_INT
+        || datum->type == MTYPE_BIGINT))
+        hash = fnv32a_str(datum->value.value, datum->len);
+    else
+        return m->segs;
+
+    return m->segs + jump_hash(hash, m->nsegs);
+}
+
+static void
+_segment_prefixes(Meta m, config_setting_t *config)
+{
+    int threads = 1, thread;
+    size_t len = strlen(m->fname) + 24;
+
+    config_setting_lookup_int(config, "threads", &threads);
+    config_setting_lookup_int(config, "shards", &m->nsegs);
+    if (m->nsegs < 1)
+        m->nsegs = 1;
+
+    m->threads = _share_get(config, m);
+    pthread_mutex_lock(&m->threads->mutex);
+    thread = m->threads->next++;
+    pthread_mutex_unlock(&m->threads->mutex);
+
+    m->segs = SCALLOC(m->nsegs, sizeof(*m->segs));
+    for (int i = 0; i < m->nsegs; i++)
+    {
+        Segment *g = m->segs + i;
+        int n = 0;
+
+        g->fd = -1;
+        g->prefix = SCALLOC(len, 1);
+        n = snprintf(g->prefix, len, "%s", m->fname);
+        if (m->nsegs > 1)
+            n += snprintf(g->prefix + n, len - n, ".%d", i);
+        if (threads > 1)
+            snprintf(g->prefix + n, len - n, ".%d", thread);
+    }
+}
+
 Producer
 file_producer_init(config_setting_t *config)
 {
     Producer file = SCALLOC(1, sizeof(*file));
-    const char *fname = NULL;
+    const char *fname = NULL, *format = NULL, *compress = NULL,
+        *framing = NULL;
+    int level = 0, threads = 1, crc = 0;
+    Meta m;
+
     config_setting_lookup_string(config, "file", &fname);
+    config_setting_lookup_string(config, "format", &format);
+    config_setting_lookup_string(config, "compress", &compress);
+    config_setting_lookup_string(config, "framing", &framing);
+    config_setting_lookup_bool(config, "crc", &crc);
+    config_setting_lookup_int(config, "threads", &threads);
+
+    if (_file_format(format) == FILE_RAW && compress == NULL
+        && threads == 1
+        && !config_setting_get_member(config, "shards")
+        && !config_setting_get_member(config, "rotate_size")
+        && !config_setting_get_member(config, "rotate_time")
+        && !config_setting_get_member(config, "fsync"))
+        m = file_meta_init(fname, "a");
+    else
+    {
+        long long flush = FILE_BLOCK;
+
+        // segments are opened with their first message
+        m = SCALLOC(1, sizeof(*m));
+        m->fname = fname;
+        m->fmt = _file_format(format);
+        config_setting_lookup_int64(config, "rotate_size", &m->rotate_size);
+        config_setting_lookup_int(config, "rotate_time", &m->rotate_time);
+        config_setting_lookup_int64(config, "buffer", &flush);
+        config_setting_lookup_int(config, "fsync", &m->sync);
+        config_setting_lookup_int(config, "compress_level", &level);
+        config_setting_lookup_string(config, "shard_key", &m->shard_key);
+        m->flush = flush;
+        if (compress)
+            m->compress = compress_init(compress, level);
+        _segment_prefixes(m, config);
+        pthread_mutex_init(&m->mutex, NULL);
+        pthread_cond_init(&m->sync_cond, NULL);
+
+        if (m->sync && pthread_create(&m->sync_worker, NULL, _sync_worker,
+                m))
+        {
+            logger_log("%s %d: Failed to create sync worker!",
+                __FILE__, __LINE__);
+            abort();
+        }
+    }
+    m->framing = frame_type_init(framing);
+    m->crc = crc;
 
-    file->meta          = file_meta_init(fname, "a");
+    file->meta          = m;
     file->producer_free = file_producer_free;
     file->produce       = file_producer_produce;
 
@@ -56,66 +696,883 @@ file_producer_init(config_setting_t *config)
 void
 file_producer_produce(Producer p, Message msg)
 {
+    Meta m = (Meta) p->meta;
     char *line = message_get_data(msg);
     size_t len = message_get_len(msg);
-    size_t nmemb = sizeof(*line);
-    size_t ret;
+    ssize_t row = len;
+    uint8_t hdr[FRAME_HEADER_MAXLEN];
+    Segment *g;
 
-    ret = fwrite(line, len, nmemb, ((Meta) p->meta)->fp);
-    if (ret < nmemb) {
-        logger_log("%s %d: %s", __FILE__, __LINE__, strerror(errno));
-        abort();
+    if (m->fname == NULL)
+    {
+        if (m->framing)
+            _file_write(m, hdr, frame_header(m->framing, len, hdr));
+        _file_write(m, line, len);
+        if (m->crc)
+        {
+            frame_crc(line, len, hdr);
+            _file_write(m, hdr, FRAME_CRC_LEN);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&m->mutex);
+    g = _segment_shard(m, msg);
+    if (g->fd != -1 && ((m->rotate_size
+            && g->written + (long long) g->buf.len >= m->rotate_size)
+        || (m->rotate_time && time(NULL) - g->opened >= m->rotate_time)))
+        _segment_close(m, g);
+    if (g->fd == -1)
+        _segment_open(m, g);
+
+    // rows are encoded straight into the buffer
+    switch (m->fmt)
+    {
+        case FILE_TEXT:
+            row = pgcopy_text(pgcopy_buf_reserve(&g->buf,
+                PGCOPY_TEXT_MAXLEN(len)), line, len);
+            break;
+        case FILE_CSV:
+            row = pgcopy_csv(pgcopy_buf_reserve(&g->buf,
+                PGCOPY_TEXT_MAXLEN(len)), line, len);
+            break;
+        default:
+            if (m->framing)
+                g->buf.len += frame_header(m->framing, len,
+                    (uint8_t *) pgcopy_buf_reserve(&g->buf,
+                        FRAME_HEADER_MAXLEN));
+            // too large to be copied, written along with the buffer
+            if (len >= m->flush && !m->compress)
+            {
+                _segment_flush(m, g, line, len);
+                row = 0;
+            }
+            else
+                memcpy(pgcopy_buf_reserve(&g->buf, len), line, len);
+            if (m->crc)
+            {
+                frame_crc(line, len, (uint8_t *)
+                    pgcopy_buf_reserve(&g->buf, row + FRAME_CRC_LEN) + row);
+                row += FRAME_CRC_LEN;
+            }
+            break;
     }
+    if (row < 0)
+    {
+        logger_log("%s %d: found invalid unicode byte sequence: %.*s",
+            __FILE__, __LINE__, (int) len, line);
+        goto unlock;
+    }
+    g->buf.len += row;
+
+    if (g->buf.len >= m->flush)
+        _segment_flush(m, g, NULL, 0);
+
+    unlock:
+    pthread_mutex_unlock(&m->mutex);
 }
 
 void
 file_producer_free(Producer *p)
 {
     Meta m = (Meta) ((*p)->meta);
-    file_meta_free(&m);
+
+    if (m->fname)
+    {
+        if (m->sync)
+        {
+            pthread_mutex_lock(&m->mutex);
+            m->sync_stop = true;
+            pthread_cond_signal(&m->sync_cond);
+            pthread_mutex_unlock(&m->mutex);
+            pthread_join(m->sync_worker, NULL);
+        }
+        for (Segment *g = m->segs; g < m->segs + m->nsegs; g++)
+        {
+            if (g->fd != -1)
+                _segment_close(m, g);
+            pgcopy_buf_free(&g->buf);
+            free(g->prefix);
+        }
+        free(m->segs);
+        _share_put(m->threads, false);
+        if (m->compress)
+            compress_free(&m->compress);
+        pgcopy_buf_free(&m->frame);
+        pthread_cond_destroy(&m->sync_cond);
+        pthread_mutex_destroy(&m->mutex);
+        free(m);
+    }
+    else
+        file_meta_free(&m);
     free(*p);
     *p = NULL;
 }
 
+static void
+_file_done_release(FileDone done)
+{
+    FileShare s = done->share;
+
+    if (atomic_fetch_sub(&done->refcount, 1) != 1)
+        return;
+
+    pthread_mutex_lock(&s->mutex);
+    if (s->manifest && !done->partial && (fprintf(s->manifest, "%s\n", done->name) < 0
+        || fflush(s->manifest) != 0 || fsync(fileno(s->manifest)) != 0))
+        logger_log("%s %d: manifest: %s", __FILE__, __LINE__,
+            strerror(errno));
+    pthread_mutex_unlock(&s->mutex);
+
+    _share_put(s, false);
+    free(done);
+}
+
+/*
+ * _file_next
+ *      Finish the file of a glob and open the next one.
+ *      Returns false once all files are done.
+ */
+static bool
+_file_next(Meta m)
+{
+    FileShare s = m->glob;
+    const char *name;
+
+    if (m->fp)
+    {
+        if (m->codec)
+            decompress_free(&m->codec);
+        fclose(m->fp);
+        m->fp = NULL;
+        _file_done_release(m->done);
+        m->done = NULL;
+    }
+
+    while (42)
+    {
+        pthread_mutex_lock(&s->mutex);
+        do
+            name = s->next < s->files.gl_pathc
+                ? s->files.gl_pathv[s->next++] : NULL;
+        while (name && s->nskip && bsearch(&name, s->skip, s->nskip,
+            sizeof(*s->skip), _strcmp));
+        pthread_mutex_unlock(&s->mutex);
+
+        if (name == NULL)
+            return false;
+        if ((m->fp = fopen(name, "r")) != NULL)
+            break;
+        logger_log("%s %d: %s %s", __FILE__, __LINE__, name,
+            strerror(errno));
+    }
+    posix_fadvise(fileno(m->fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+    m->codec = decompress_init(fileno(m->fp));
+
+    m->fname = name;
+    m->base = 0;
+    m->start = m->end = 0;
+    m->eof = false;
+
+    // the file holds a reference on the share
+    m->done = SCALLOC(1, sizeof(*m->done));
+    m->done->share = _share_get(s->config, m);
+    m->done->name = name;
+    atomic_init(&m->done->refcount, 1);
+    return true;
+}
+
+static void
+_file_checkpoint(FileAck ack, bool force)
+{
+    size_t len = strlen(ack->path) + sizeof(".tmp");
+    char *tmp;
+    FILE *fp;
+    time_t now = time(NULL);
+
+    if (!force && now == ack->written)
+        return;
+    ack->written = now;
+
+    tmp = SCALLOC(len, 1);
+    snprintf(tmp, len, "%s.tmp", ack->path);
+    fp = fopen(tmp, "w");
+    if (fp == NULL
+        || fprintf(fp, "%lu %lu\n", ack->ino, ack->flushed) < 0
+        || fflush(fp) != 0 || fsync(fileno(fp)) != 0
+        || fclose(fp) != 0 || rename(tmp, ack->path) != 0)
+        logger_log("%s %d: checkpoint %s: %s", __FILE__, __LINE__,
+            ack->path, strerror(errno));
+    free(tmp);
+}
+
+static void
+_file_ack_release(FileAck ack)
+{
+    if (atomic_fetch_sub(&ack->refcount, 1) == 1)
+    {
+        _file_checkpoint(ack, true);
+        pthread_mutex_destroy(&ack->mutex);
+        free(ack->ranges);
+        free(ack->path);
+        free(ack);
+    }
+}
+
+/*
+ * _file_ack_range
+ *      Mark [start, end) of generation gen as handled and move the
+ *      checkpoint behind all lines handled in a row.
+ */
+static void
+_file_ack_range(FileAck ack, uint64_t gen, uint64_t start, uint64_t end)
+{
+    FileRange *r;
+    size_t i;
+
+    pthread_mutex_lock(&ack->mutex);
+    if (gen != ack->gen || end <= ack->flushed)
+        goto unlock;
+
+    if (start > ack->flushed)
+    {
+        // lines are mostly handled in order, search from the back
+        for (i = ack->nranges; i > 0 && ack->ranges[i - 1].start > start;
+            i--);
+        if (i > 0 && ack->ranges[i - 1].end >= start)
+        {
+            r = ack->ranges + --i;
+            if (end > r->end)
+                r->end = end;
+        }
+        else
+        {
+            if (ack->nranges == ack->alloc)
+            {
+                ack->alloc = ack->alloc ? ack->alloc * 2 : 16;
+                ack->ranges = realloc(ack->ranges,
+                    ack->alloc * sizeof(*ack->ranges));
+                if (ack->ranges == NULL)
+                {
+                    logger_log("%s %d: %s", __FILE__, __LINE__,
+                        strerror(errno));
+                    abort();
+                }
+            }
+            r = ack->ranges + i;
+            memmove(r + 1, r, (ack->nranges++ - i) * sizeof(*r));
+            r->start = start;
+            r->end = end;
+        }
+        // swallow the ranges it reaches into
+        while (i + 1 < ack->nranges && r[1].start <= r->end)
+        {
+            if (r[1].end > r->end)
+                r->end = r[1].end;
+            memmove(r + 1, r + 2, (ack->nranges-- - i - 2) * sizeof(*r));
+        }
+        goto unlock;
+    }
+
+    ack->flushed = end;
+    for (i = 0; i < ack->nranges && ack->ranges[i].start <= ack->flushed;
+        i++)
+        if (ack->ranges[i].end > ack->flushed)
+            ack->flushed = ack->ranges[i].end;
+    if (i)
+    {
+        memmove(ack->ranges, ack->ranges + i,
+            (ack->nranges - i) * sizeof(*ack->ranges));
+        ack->nranges -= i;
+    }
+    _file_checkpoint(ack, false);
+
+    unlock:
+    pthread_mutex_unlock(&ack->mutex);
+}
+
+/*
+ * _file_ack_reset
+ *      the file was truncated or replaced, start over at its beginning
+ */
+static void
+_file_ack_reset(FileAck ack, uint64_t ino)
+{
+    pthread_mutex_lock(&ack->mutex);
+    ack->ino = ino;
+    ack->gen++;
+    ack->flushed = 0;
+    ack->nranges = 0;
+    _file_checkpoint(ack, true);
+    pthread_mutex_unlock(&ack->mutex);
+}
+
+/*
+ * _file_pos_ack
+ *      metadata callback of checkpointed messages, marks the line of
+ *      the message as handled
+ */
+static bool
+_file_pos_ack(Message msg)
+{
+    Metadata *md = message_get_metadata(msg);
+    MDatum datum = metadata_find(md, "file_pos");
+
+    if (datum == NULL || datum->type != MTYPE_OPAQUE
+        || datum->value.ptr == NULL)
+        return false;
+
+    FilePos p = (FilePos) datum->value.ptr;
+    if (p->done)
+    {
+        _file_done_release(p->done);
+        p->done = NULL;
+    }
+    if (p->ack == NULL)
+        return true;
+
+    _file_ack_range(p->ack, p->gen, p->start, p->end);
+    _file_ack_release(p->ack);
+    p->ack = NULL;
+    return true;
+}
+
+/*
+ * _file_pos_free
+ *      Release of the metadata. A message dropped by a hook never sees
+ *      its callback, it is handled all the same.
+ */
+static void
+_file_pos_free(void *pos)
+{
+    FilePos p = (FilePos) pos;
+
+    if (p->done)
+        _file_done_release(p->done);
+    if (p->ack)
+    {
+        _file_ack_range(p->ack, p->gen, p->start, p->end);
+        _file_ack_release(p->ack);
+    }
+    free(p);
+}
+
+/*
+ * _file_resume
+ *      Read the checkpoint and continue behind it, if it refers to
+ *      the file. A file rotated in the meantime is read from its start.
+ */
+static void
+_file_resume(Meta m, const char *checkpoint)
+{
+    FileAck ack = SCALLOC(1, sizeof(*ack));
+    unsigned long ino = 0, offset = 0;
+    struct stat st;
+    FILE *fp;
+
+    ack->path = strdup(checkpoint);
+    pthread_mutex_init(&ack->mutex, NULL);
+    atomic_init(&ack->refcount, 1);
+    m->ack = ack;
+
+    if (fstat(fileno(m->fp), &st) != 0)
+    {
+        logger_log("%s %d: %s", __FILE__, __LINE__, strerror(errno));
+        abort();
+    }
+    m->ino = ack->ino = st.st_ino;
+
+    if ((fp = fopen(checkpoint, "r")) == NULL)
+        return;
+    if (fscanf(fp, "%lu %lu", &ino, &offset) == 2 && ino == st.st_ino
+        && (off_t) offset <= st.st_size)
+    {
+        if (lseek(fileno(m->fp), offset, SEEK_SET) == -1)
+        {
+            logger_log("%s %d: %s", __FILE__, __LINE__, strerror(errno));
+            abort();
+        }
+        m->base = ack->flushed = offset;
+        logger_log("%s %d: resuming %s at %lu", __FILE__, __LINE__,
+            m->fname, offset);
+    }
+    fclose(fp);
+}
+
+/*
+ * _file_watch
+ *      Watch the file for writes and its directory for files renamed or
+ *      created in its place (or renamed away), so those wake us up.
+ */
+static void
+_file_watch(Meta m)
+{
+    char *dir = strdup(m->fname), *name = strdup(m->fname);
+    struct stat st;
+
+    m->follow = true;
+    m->watch = strdup(basename(name));
+    m->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m->inotify == -1 || inotify_add_watch(m->inotify, dirname(dir),
+            IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) == -1
+        || (m->wd = inotify_add_watch(m->inotify, m->fname, IN_MODIFY))
+            == -1
+        || fstat(fileno(m->fp), &st) != 0)
+    {
+        logger_log("%s %d: %s %s", __FILE__, __LINE__, m->fname,
+            strerror(errno));
+        abort();
+    }
+    m->ino = st.st_ino;
+    free(name);
+    free(dir);
+}
+
+/*
+ * _file_wait
+ *      Wait (FILE_WAIT_MS at most) for the file to be written, or a file
+ *      to take its name. Until then, the consumer is idle and does not
+ *      look at the file at all.
+ *      Returns true if it changed.
+ */
+static bool
+_file_wait(Meta m)
+{
+    char events[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = {.fd = m->inotify, .events = POLLIN};
+    struct inotify_event *ev;
+    ssize_t r;
+    bool changed = false;
+
+    if (poll(&pfd, 1, FILE_WAIT_MS) > 0)
+        while ((r = read(m->inotify, events, sizeof(events))) > 0)
+            for (char *e = events; e < events + r;
+                e += sizeof(*ev) + ev->len)
+            {
+                ev = (struct inotify_event *) e;
+                // other files of the directory are none of our business
+                changed |= ev->wd == m->wd
+                    || (ev->len && !strcmp(ev->name, m->watch));
+            }
+    m->idle = !changed;
+    return changed;
+}
+
+/*
+ * _file_follow
+ *      At the end of the file: start over if it was truncated, tell
+ *      if it was rotated or wait for it to change.
+ *      Returns true if the file was rotated.
+ */
+static bool
+_file_follow(Meta m)
+{
+    struct stat st;
+
+    if (fstat(fileno(m->fp), &st) != 0)
+    {
+        logger_log("%s %d: %s", __FILE__, __LINE__, strerror(errno));
+        abort();
+    }
+    m->eof = false;
+
+    // copytruncate
+    if (st.st_size < m->base + (off_t) m->end)
+    {
+        logger_log("%s %d: %s truncated", __FILE__, __LINE__, m->fname);
+        lseek(fileno(m->fp), 0, SEEK_SET);
+        m->base = 0;
+        m->start = m->end = 0;
+        if (m->ack)
+            _file_ack_reset(m->ack, m->ino);
+        return false;
+    }
+    if (st.st_size > m->base + (off_t) m->end)
+        return false;
+
+    // renamed (or deleted) and created anew, the old file is done
+    if (stat(m->fname, &st) == 0 && st.st_ino != m->ino)
+        return true;
+
+    _file_wait(m);
+    return false;
+}
+
+static void
+_file_reopen(Meta m)
+{
+    FILE *fp = fopen(m->fname, "r");
+    struct stat st;
+
+    if (fp == NULL || fstat(fileno(fp), &st) != 0)
+    {
+        // not (yet) there, keep waiting on the old one
+        if (fp)
+            fclose(fp);
+        return;
+    }
+
+    logger_log("%s %d: %s rotated", __FILE__, __LINE__, m->fname);
+    fclose(m->fp);
+    m->fp = fp;
+    m->ino = st.st_ino;
+    m->base = 0;
+    m->start = m->end = 0;
+
+    // the watch of the old file is gone with it (or is of no use)
+    inotify_rm_watch(m->inotify, m->wd);
+    if ((m->wd = inotify_add_watch(m->inotify, m->fname, IN_MODIFY)) == -1)
+    {
+        logger_log("%s %d: %s %s", __FILE__, __LINE__, m->fname,
+            strerror(errno));
+        abort();
+    }
+
+    if (m->ack)
+        _file_ack_reset(m->ack, m->ino);
+}
+
+/*
+ * _file_pos
+ *      attach the position of the line of len bytes just read to the
+ *      message
+ */
+static void
+_file_pos(Meta m, Message msg, size_t len)
+{
+    Datum cb, pos, name;
+    FilePos p = SCALLOC(1, sizeof(*p));
+    Metadata *md = message_get_metadata(msg);
+    MDatum datum;
+
+    p->end = m->base + m->start;
+    p->start = p->end - len;
+    if ((p->ack = m->ack))
+    {
+        atomic_fetch_add(&m->ack->refcount, 1);
+        // only the consumer starts a new generation, no lock needed
+        p->gen = m->ack->gen;
+    }
+    if ((p->done = m->done))
+    {
+        atomic_fetch_add(&m->done->refcount, 1);
+        name.string = strdup(m->fname);
+        metadata_insert(md, "file_name", mdatum_init(MTYPE_STRING, name,
+            strlen(m->fname) + 1));
+    }
+
+    cb.func = &_file_pos_ack;
+    pos.ptr = p;
+    datum = mdatum_init(MTYPE_OPAQUE, pos, sizeof(*p));
+    datum->release = _file_pos_free;
+    metadata_insert(md, "callback", mdatum_init(MTYPE_FUNC, cb, sizeof(void *)));
+    metadata_insert(md, "file_pos", datum);
+}
+
 Consumer
 file_consumer_init(config_setting_t *config)
 {
     Consumer file = SCALLOC(1, sizeof(*file));
-    const char *fname = NULL;
+    const char *fname = NULL, *checkpoint = NULL, *framing = NULL;
+    int follow = 0, crc = 0;
+    Meta m;
     config_setting_lookup_string(config, "file", &fname);
+    config_setting_lookup_string(config, "checkpoint", &checkpoint);
+    config_setting_lookup_string(config, "framing", &framing);
+    config_setting_lookup_bool(config, "follow", &follow);
+    config_setting_lookup_bool(config, "crc", &crc);
+
+    if (config_setting_get_member(config, "glob"))
+    {
+        // files are opened as they are taken
+        m = SCALLOC(1, sizeof(*m));
+        m->glob = _share_get(config, m);
+    }
+    else
+    {
+        m = file_meta_init(fname, "r");
+        m->fname = fname;
+        posix_fadvise(fileno(m->fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+        m->codec = decompress_init(fileno(m->fp));
+    }
+    m->framing = frame_type_init(framing);
+    m->crc = crc;
+    m->size = FILE_BLOCK;
+    if (config_setting_get_member(config, "split"))
+    {
+        m->split = _share_get(config, m);
+        // a chunk and the line running over its end
+        m->size += FILE_CHUNK;
+    }
+    m->block = SCALLOC(m->size, 1);
 
-    file->meta          = file_meta_init(fname, "r");
+    // offsets of a compressed file are of no use
+    if (m->codec && (follow || checkpoint || m->split))
+    {
+        logger_log("%s %d: %s is %s compressed, it cannot be split, "
+            "followed or checkpointed", __FILE__, __LINE__, fname,
+            decompress_name(m->codec));
+        abort();
+    }
+    if (follow)
+        _file_watch(m);
+    if (checkpoint)
+        _file_resume(m, checkpoint);
+
+    file->meta          = m;
     file->consumer_free = file_consumer_free;
     file->consume       = file_consumer_consume;
     return file;
 }
 
-int
-file_consumer_consume(Consumer c, Message msg)
+/*
+ * _file_fill
+ *      Move the unconsumed tail of the block to its start and read
+ *      behind it. A block full of a single line is doubled.
+ *      Returns false on EOF or error.
+ */
+static bool
+_file_fill(Meta m)
 {
-    char   *line = NULL;
-    size_t  bufsize = 0;
-    ssize_t read;
-    int8_t err = errno;
-    errno = 0;
-    if ((read = getline(&line, &bufsize, ((Meta) c->meta)->fp)) == -1)
+    ssize_t r;
+
+    if (m->start)
     {
-        /* if a line buffer was allocated, it needs freeing.
-         * If it was not allocated, it is NULL and therefore save
-         * to free */
-        free(line);
+        memmove(m->block, m->block + m->start, m->end - m->start);
+        m->base += m->start;
+        m->end -= m->start;
+        m->start = 0;
+    }
+    if (m->end == m->size)
+    {
+        m->size *= 2;
+        m->block = realloc(m->block, m->size);
+        if (m->block == NULL)
+        {
+            logger_log("%s %d: %s", __FILE__, __LINE__, strerror(errno));
+            abort();
+        }
+    }
 
-        /* We have reached EOF */
-        if(!(errno == EINVAL || errno == ENOMEM))
-            logger_log("%s %d: reached EOF", __FILE__, __LINE__);
+    do
+        if (m->codec)
+            r = decompress_read(m->codec, m->block + m->end,
+                m->size - m->end);
+        else if (m->split)
+            r = pread(fileno(m->fp), m->block + m->end, m->size - m->end,
+                m->base + m->end);
         else
+            r = read(fileno(m->fp), m->block + m->end, m->size - m->end);
+    while (r == -1 && errno == EINTR);
+
+    if (r <= 0)
+    {
+        if (r < 0)
             logger_log("%s %d: %s", __FILE__, __LINE__, strerror(errno));
+        else if (!m->follow)
+            logger_log("%s %d: reached EOF", __FILE__, __LINE__);
+        m->eof = true;
+        return false;
+    }
+    m->end += r;
+    return true;
+}
+
+/*
+ * _file_chunk
+ *      Finish the current chunk and take the next one: skip the line
+ *      running into it, read it and wait for its turn.
+ *      Returns false once the file is done.
+ */
+static bool
+_file_chunk(Meta m)
+{
+    FileShare s = m->split;
+    char *nl = NULL;
+    uint64_t j;
+
+    pthread_mutex_lock(&s->mutex);
+    if (m->chunk && s->ordered)
+    {
+        s->turn = m->chunk;
+        pthread_cond_broadcast(&s->cond);
+    }
+    j = s->next++;
+    pthread_mutex_unlock(&s->mutex);
+
+    m->chunk = 0;
+    if ((off_t) (j * FILE_CHUNK) >= s->size)
+        return false;
+
+    m->chunk = j + 1;
+    m->chunk_end = (j + 1) * FILE_CHUNK;
+    m->base = j ? (off_t) (j * FILE_CHUNK - 1) : 0;
+    m->start = m->end = 0;
+    m->eof = false;
+
+    while (m->base + (off_t) m->end < m->chunk_end && _file_fill(m));
+    if (j)
+    {
+        while ((nl = memchr(m->block + m->start, '\n', m->end - m->start))
+                == NULL)
+        {
+            m->start = m->end;
+            if (m->eof || !_file_fill(m))
+                break;
+        }
+        m->start = nl ? (size_t) (nl - m->block) + 1 : m->end;
+    }
+
+    pthread_mutex_lock(&s->mutex);
+    while (s->ordered && s->turn != j && !s->stop)
+        pthread_cond_wait(&s->cond, &s->mutex);
+    pthread_mutex_unlock(&s->mutex);
+    return true;
+}
+
+/*
+ * _file_line
+ *      Lines are split with memchr (vectorized in any libc worth its
+ *      salt), reading blocks until one is complete.
+ *      Returns its size, 0 if the file ends first.
+ */
+static ssize_t
+_file_line(Meta m, size_t *off, size_t *len)
+{
+    size_t scanned = 0;
+    char *nl;
+
+    while ((nl = memchr(m->block + m->start + scanned, '\n',
+            m->end - m->start - scanned)) == NULL)
+    {
+        scanned = m->end - m->start;
+        if (m->eof || !_file_fill(m))
+            return 0;
+    }
+    *off = 0;
+    *len = nl - (m->block + m->start) + 1;
+    return *len;
+}
+
+/*
+ * _file_frame
+ *      Read blocks until a length prefixed record is complete, check
+ *      its CRC.
+ *      Returns its size, 0 if the file ends first, -1 if it is corrupt.
+ */
+static ssize_t
+_file_frame(Meta m, size_t *off, size_t *len)
+{
+    ssize_t hdr;
+    size_t need;
+
+    while ((hdr = frame_parse(m->framing, (uint8_t *) m->block + m->start,
+            m->end - m->start, len)) == 0)
+        if (m->eof || !_file_fill(m))
+            return 0;
+    if (hdr < 0)
+    {
+        logger_log("%s %d: %s: invalid record length at offset %lld",
+            __FILE__, __LINE__, m->fname, (long long) (m->base + m->start));
+        return -1;
+    }
+
+    need = hdr + *len + (m->crc ? FRAME_CRC_LEN : 0);
+    while (m->end - m->start < need)
+        if (m->eof || !_file_fill(m))
+            return 0;
 
+    if (m->crc && !frame_crc_check(m->block + m->start + hdr, *len,
+            (uint8_t *) m->block + m->start + hdr + *len))
+    {
+        logger_log("%s %d: %s: CRC mismatch of the record at offset %lld",
+            __FILE__, __LINE__, m->fname, (long long) (m->base + m->start));
         return -1;
     }
-    errno = err;
+    *off = hdr;
+    return need;
+}
+
+/*
+ * _file_tail
+ *      The file ends without newline: the rest is its last line. The
+ *      rest of a framed file is a truncated record, which is dropped.
+ */
+static size_t
+_file_tail(Meta m, size_t *off, size_t *len)
+{
+    *off = 0;
+    *len = m->end - m->start;
+    if (m->framing && *len)
+    {
+        logger_log("%s %d: %s: dropping truncated record at offset %lld",
+            __FILE__, __LINE__, m->fname, (long long) (m->base + m->start));
+        m->start = m->end;
+        *len = 0;
+    }
+    return *len;
+}
+
+int
+file_consumer_consume(Consumer c, Message msg)
+{
+    Meta m = (Meta) c->meta;
+    char *line;
+    ssize_t rec;
+    size_t off, len;
+
+    // nothing changed since the last look at the file
+    if (m->idle && !_file_wait(m))
+        return 0;
+
+    for (;;)
+    {
+        if (m->glob && m->fp == NULL && !_file_next(m))
+            return -1;
+
+        // the next line starts in another chunk
+        while (m->split && (m->chunk == 0
+            || m->base + (off_t) m->start >= m->chunk_end
+            || (m->eof && m->start == m->end)))
+            if (!_file_chunk(m))
+                return -1;
+
+        // records are copied once, into a buffer of their size
+        rec = m->framing ? _file_frame(m, &off, &len)
+                         : _file_line(m, &off, &len);
+        if (rec < 0)
+            return -1;
+        if (rec > 0)
+            break;
+
+        // a line is complete once the file is rotated
+        if (m->follow && !_file_follow(m))
+            return 0;
+        if ((rec = _file_tail(m, &off, &len)) > 0)
+            break;
+        if (m->follow)
+        {
+            _file_reopen(m);
+            return 0;
+        }
+        if (m->glob)
+        {
+            if (!_file_next(m))
+                return -1;
+        }
+        else if (!m->split)
+            return -1;
+    }
+
+    line = SCALLOC(len + 1, 1);
+    memcpy(line, m->block + m->start + off, len);
+    m->start += rec;
+
     message_set_data(msg, line);
-    message_set_len(msg, (size_t) read);
+    message_set_len(msg, len);
+    if (m->ack || m->done)
+        _file_pos(m, msg, rec);
     return 0;
 }
 
@@ -123,6 +1580,24 @@ void
 file_consumer_free(Consumer *c)
 {
     Meta m = (Meta) ((*c)->meta);
+    if (m->split)
+        _share_put(m->split, m->chunk != 0);
+    if (m->done)
+    {
+        m->done->partial = true;
+        _file_done_release(m->done);
+    }
+    if (m->glob)
+        _share_put(m->glob, false);
+    if (m->follow)
+    {
+        close(m->inotify);
+        free(m->watch);
+    }
+    if (m->ack)
+        _file_ack_release(m->ack);
+    if (m->codec)
+        decompress_free(&m->codec);
     file_meta_free(&m);
     free(*c);
     *c = NULL;
@@ -134,8 +1609,8 @@ file_validate(config_setting_t* config)
     int t = 0;
     config_setting_lookup_int(config, "threads", &t);
 
-    if(t > 1) {
-        fprintf(stderr, "file consumer/producer is not thread safe!\n");
+    if(t > 1 && !config_setting_get_member(config, "split")) {
+        fprintf(stderr, "file consumer needs a split to run threads!\n");
         return false;
     }
 
@@ -150,12 +1625,142 @@ file_validate(config_setting_t* config)
     return true;
 }
 
+static bool
+_framing_validate(config_setting_t* config, const char *what)
+{
+    const char *framing = NULL;
+    int crc = 0;
+
+    config_setting_lookup_string(config, "framing", &framing);
+    if (frame_type_init(framing) < 0) {
+        fprintf(stderr, "file %s: framing must be lines, u32 "
+            "or varint!\n", what);
+        return false;
+    }
+    if (config_setting_lookup_bool(config, "crc", &crc) == CONFIG_TRUE
+        && crc && frame_type_init(framing) == FRAME_LINES) {
+        fprintf(stderr, "file %s: crc requires a framing!\n", what);
+        return false;
+    }
+    return true;
+}
+
+bool
+file_producer_validate(config_setting_t* config)
+{
+    const char *format = NULL, *compress = NULL, *fname = NULL,
+        *framing = NULL;
+    long long size = 0;
+    int seconds = 0, shards = 0;
+
+    if (config_setting_get_member(config, "split")) {
+        fprintf(stderr, "file producer: split is for consumers only!\n");
+        return false;
+    }
+    config_setting_lookup_string(config, "format", &format);
+    if ((int) _file_format(format) < 0) {
+        fprintf(stderr, "file producer: unknown format %s!\n", format);
+        return false;
+    }
+    if (!_framing_validate(config, "producer"))
+        return false;
+    config_setting_lookup_string(config, "framing", &framing);
+    if (_file_format(format) != FILE_RAW
+        && frame_type_init(framing) != FRAME_LINES) {
+        fprintf(stderr, "file producer: framing is for the raw "
+            "format only!\n");
+        return false;
+    }
+    if ((config_setting_lookup_int64(config, "rotate_size", &size)
+            == CONFIG_TRUE && size < 1)
+        || (config_setting_lookup_int(config, "rotate_time", &seconds)
+            == CONFIG_TRUE && seconds < 1)
+        || (config_setting_lookup_int64(config, "buffer", &size)
+            == CONFIG_TRUE && size < 1)
+        || (config_setting_lookup_int(config, "fsync", &seconds)
+            == CONFIG_TRUE && seconds < 1)) {
+        fprintf(stderr, "file producer: rotate_size, rotate_time, buffer "
+            "and fsync must be positive!\n");
+        return false;
+    }
+    if (config_setting_lookup_string(config, "compress", &compress)
+        == CONFIG_TRUE && !compress_supported(compress)) {
+        fprintf(stderr, "file producer: compression %s is unknown or "
+            "not built in!\n", compress);
+        return false;
+    }
+    if (!config_setting_get_member(config, "shards")
+        != !config_setting_get_member(config, "shard_key")
+        || (config_setting_lookup_int(config, "shards", &shards)
+            == CONFIG_TRUE && shards < 1)) {
+        fprintf(stderr, "file producer: shards need a shard_key "
+            "(and vice versa)!\n");
+        return false;
+    }
+
+    // every thread writes segments of its own
+    config_setting_lookup_string(config, "file", &fname);
+    if (!fname || !*fname) {
+        fprintf(stderr, "file consumer/producer needs a valid filename!\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool
+file_consumer_validate(config_setting_t* config)
+{
+    const char *split = NULL, *pattern = NULL, *framing = NULL;
+
+    if (config_setting_lookup_string(config, "split", &split) == CONFIG_TRUE
+        && strcmp(split, "ordered") && strcmp(split, "unordered")) {
+        fprintf(stderr, "file consumer: split must be "
+            "ordered or unordered!\n");
+        return false;
+    }
+    if (split && (config_setting_get_member(config, "follow")
+        || config_setting_get_member(config, "checkpoint"))) {
+        fprintf(stderr, "file consumer: a split file cannot be followed "
+            "or checkpointed!\n");
+        return false;
+    }
+    if (!_framing_validate(config, "consumer"))
+        return false;
+    // records can't be told apart in the middle of a file
+    config_setting_lookup_string(config, "framing", &framing);
+    if (split && frame_type_init(framing) != FRAME_LINES) {
+        fprintf(stderr, "file consumer: a framed file cannot be split!\n");
+        return false;
+    }
+
+    if (config_setting_lookup_string(config, "glob", &pattern)
+        == CONFIG_TRUE) {
+        if (config_setting_get_member(config, "file") || split
+            || config_setting_get_member(config, "follow")
+            || config_setting_get_member(config, "checkpoint")) {
+            fprintf(stderr, "file consumer: glob cannot be combined with "
+                "file, split, follow or checkpoint!\n");
+            return false;
+        }
+        return true;
+    }
+    if (config_setting_get_member(config, "manifest")
+        || config_setting_get_member(config, "sorted")) {
+        fprintf(stderr, "file consumer: manifest and sorted "
+            "require a glob!\n");
+        return false;
+    }
+
+    return file_validate(config);
+}
+
 Validator
 file_validator_init()
 {
     Validator v = SCALLOC(1,sizeof(*v));
 
-    v->validate_producer = file_validate;
-    v->validate_consumer = file_validate;
+    v->validate_producer = file_producer_validate;
+    v->validate_consumer = file_consumer_validate;
     return v;
 }
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <libpq-fe.h>
 #include <librdkafka/rdkafka.h>
 #include <stdbool.h>
 #include <string.h>
@@ -55,6 +56,29 @@ static bool consumer_commit_offset(Message msg)
     return false;
 }
 
+/*
+ * kafka_message_offset
+ *      Topic, partition and offset of a message
+ *      of the transactional consumer
+ */
+bool
+kafka_message_offset(Message msg, const char **topic,
+    int32_t *partition, int64_t *offset)
+{
+    rd_kafka_message_t *rkm;
+    MDatum rk_message = metadata_find(message_get_metadata(msg), "rk_message");
+
+    if (rk_message == NULL || rk_message->type != MTYPE_OPAQUE
+        || rk_message->value.ptr == NULL)
+        return false;
+
+    rkm = (rd_kafka_message_t *) rk_message->value.ptr;
+    *topic = rd_kafka_topic_name(rkm->rkt);
+    *partition = rkm->partition;
+    *offset = rkm->offset;
+    return true;
+}
+
 typedef struct Meta {
     rd_kafka_t *rk;
     rd_kafka_topic_t *rkt;
@@ -62,6 +86,9 @@ typedef struct Meta {
     rd_kafka_topic_partition_list_t *topics;
     rd_kafka_queue_t *rkqu;
     int transactional;
+    const char *broker;
+    const char *offsets;            // table of offsets stored by a sink
+    const char *offsets_conninfo;
 } *Meta;
 
 static void
@@ -89,7 +116,7 @@ print_partition_list (const rd_kafka_topic_partition_list_t *partitions)
 static void
 err_cb (rd_kafka_t *rk, rd_kafka_resp_err_t err, const char *reason, void *opaque)
 {
-    const char *broker = opaque;
+    const char *broker = ((Meta) opaque)->broker;
     if (err == RD_KAFKA_RESP_ERR__FATAL) {
         char errstr[512];
         err = rd_kafka_fatal_error(rk, errstr, sizeof(errstr));
@@ -106,7 +133,7 @@ err_cb (rd_kafka_t *rk, rd_kafka_resp_err_t err, const char *reason, void *opaqu
 static void
 offset_commit_cb(UNUSED rd_kafka_t *rk, rd_kafka_resp_err_t err, UNUSED rd_kafka_topic_partition_list_t *partitions, void *opaque)
 {
-    const char *broker = opaque;
+    const char *broker = ((Meta) opaque)->broker;
 
     // Not considered an error, no offset to commit
     if (err == RD_KAFKA_RESP_ERR__NO_OFFSET)
@@ -120,17 +147,76 @@ offset_commit_cb(UNUSED rd_kafka_t *rk, rd_kafka_resp_err_t err, UNUSED rd_kafka
     }
 }
 
+/*
+ * _offsets_seek
+ *      Resume assigned partitions after the offsets a postgres producer
+ *      committed along with its rows, instead of the group's offsets.
+ *      Partitions without a stored offset start at the group's offset.
+ */
 static void
-rebalance_cb (rd_kafka_t *rk, rd_kafka_resp_err_t err, rd_kafka_topic_partition_list_t *partitions, void *opaque)
+_offsets_seek(Meta m, rd_kafka_topic_partition_list_t *partitions)
 {
+    PGconn *conn = PQconnectdb(m->offsets_conninfo);
+    PGresult *res;
+    char partition[12];
+    const char *params[2];
+    size_t n = strlen(m->offsets) + 64;
+    char *sql = SCALLOC(n, 1);
+
+    if (PQstatus(conn) != CONNECTION_OK)
+    {
+        logger_log("%s %d: %s: Failed to read offsets: %s",
+            __FILE__, __LINE__, m->broker, PQerrorMessage(conn));
+        abort();
+    }
+    snprintf(sql, n, "SELECT \"offset\" FROM %s "
+        "WHERE topic = $1 AND partition = $2", m->offsets);
 
-    const char *broker = opaque;
+    for (int i = 0; i < partitions->cnt; i++)
+    {
+        snprintf(partition, sizeof(partition), "%"PRId32,
+            partitions->elems[i].partition);
+        params[0] = partitions->elems[i].topic;
+        params[1] = partition;
+
+        res = PQexecParams(conn, sql, 2, NULL, params, NULL, NULL, 0);
+        // the producer creates the table with its first connection
+        if (PQresultStatus(res) == PGRES_FATAL_ERROR
+            && PQresultErrorField(res, PG_DIAG_SQLSTATE)
+            && !strcmp(PQresultErrorField(res, PG_DIAG_SQLSTATE), "42P01"))
+        {
+            PQclear(res);
+            break;
+        }
+        if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        {
+            logger_log("%s %d: %s: Failed to read offsets: %s",
+                __FILE__, __LINE__, m->broker, PQerrorMessage(conn));
+            abort();
+        }
+        if (PQntuples(res) == 1)
+            partitions->elems[i].offset
+                = strtoll(PQgetvalue(res, 0, 0), NULL, 10) + 1;
+        PQclear(res);
+    }
+
+    free(sql);
+    PQfinish(conn);
+}
+
+static void
+rebalance_cb (rd_kafka_t *rk, rd_kafka_resp_err_t err, rd_kafka_topic_partition_list_t *partitions, void *opaque)
+{
+    Meta m = opaque;
+    const char *broker = m->broker;
     logger_log("%s %d: %s: Consumer group rebalanced:",
         __FILE__, __LINE__, broker);
 
     switch (err)
     {
         case RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS:
+            if (m->offsets)
+                _offsets_seek(m, partitions);
             logger_log("assigned:");
             print_partition_list(partitions);
             rd_kafka_assign(rk, partitions);
@@ -352,7 +438,9 @@ kafka_consumer_meta_init(const char *broker,
                          const char *groupid,
                          const config_setting_t *kafka_options,
                          const config_setting_t *topic_options,
-                         int transactional)
+                         int transactional,
+                         const char *offsets,
+                         const char *offsets_conninfo)
 {
     Meta m = SCALLOC(1, sizeof(*m));
     char errstr[512];
@@ -364,8 +452,12 @@ kafka_consumer_meta_init(const char *broker,
     rd_kafka_topic_conf_t  *topic_conf;
     rd_kafka_queue_t       *rkqu = NULL;
 
+    m->broker = broker;
+    m->offsets = offsets;
+    m->offsets_conninfo = offsets_conninfo;
+
     conf = rd_kafka_conf_new();
-    rd_kafka_conf_set_opaque(conf, (void *) broker);
+    rd_kafka_conf_set_opaque(conf, (void *) m);
     config_group_apply(kafka_options, kafka_set_option, conf);
 
     if (groupid && rd_kafka_conf_set(conf, "group.id", groupid, errstr,
@@ -534,6 +626,7 @@ Consumer
 kafka_consumer_init(config_setting_t *config)
 {
     const char *broker = NULL, *topic = NULL, *groupid = NULL;
+    const char *offsets = NULL, *offsets_conninfo = NULL;
     int transactional = 0;
     config_setting_t *kafka_options, *topic_options, *kpart;
     int32_t *partarray = NULL;
@@ -548,6 +641,9 @@ kafka_consumer_init(config_setting_t *config)
         partarray = explode_partitions(config_setting_get_string(kpart));
 
     config_setting_lookup_bool(config, "transactional", &transactional);
+    config_setting_lookup_string(config, "offsets", &offsets);
+    config_setting_lookup_string(config, "offsets_conninfo",
+        &offsets_conninfo);
 
     kafka_options = config_setting_get_member(config, "kafka_options");
     topic_options = config_setting_get_member(config, "topic_options");
@@ -557,7 +653,9 @@ kafka_consumer_init(config_setting_t *config)
     kafka->meta = kafka_consumer_meta_init(broker, topic, partarray, groupid,
                                            kafka_options,
                                            topic_options,
-                                           transactional
+                                           transactional,
+                                           offsets,
+                                           offsets_conninfo
                                            );
     kafka->consumer_free = kafka_consumer_free;
     if(groupid && !transactional)
@@ -995,6 +1093,22 @@ kafka_consumer_validator(config_setting_t *config)
         // config_set_default_string(rkopts, "isolation_level", "read_committed");
     }
 
+    const char *offsets = NULL;
+    if (config_setting_lookup_string(config, "offsets", &offsets)
+        == CONFIG_TRUE)
+    {
+        // the sink reads the offsets from the rdkafka envelope
+        if (res != CONFIG_TRUE || !value)
+        {
+            fprintf(stderr, "%s %d: offsets need a transactional consumer!\n",
+                __FILE__, __LINE__);
+            goto err;
+        }
+        if (!CONF_L_IS_STRING(config, "offsets_conninfo", &offsets,
+            "kafka: offsets need an offsets_conninfo!"))
+            goto err;
+    }
+
     return kafka_validator(config);
     err:
 
@@ -21,6 +21,9 @@ int kafka_consumer_consume(Consumer c, Message msg);
 int kafka_simple_consumer_consume(Consumer c, Message msg);
 int kafka_transactional_consumer_consume(Consumer c, Message msg);
 
+bool kafka_message_offset(Message msg, const char **topic,
+    int32_t *partition, int64_t *offset);
+
 Validator kafka_validator_init();
 
 #endif
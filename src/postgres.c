@@ -1,14 +1,27 @@
 #include "schaufel.h"
+#include <arpa/inet.h>
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
 #include <libpq-fe.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/time.h>
+#include <time.h>
 
+#include "kafka.h"
 #include "postgres.h"
 #include "utils/array.h"
 #include "utils/config.h"
+#include "utils/fnv.h"
 #include "utils/helper.h"
 #include "utils/logger.h"
+#include "utils/metadata.h"
+#include "utils/pgtime.h"
 #include "utils/postgres.h"
 #include "utils/scalloc.h"
 
@@ -17,8 +30,15 @@ typedef enum {
     POSTGRES_JSON,
     POSTGRES_CSV,
     POSTGRES_BINARY,
+    POSTGRES_TYPED,
+    POSTGRES_INSERT,
 } postgres_format;
 
+// temporary staging table of an upsert
+#define PG_STAGING "schaufel_staging"
+// rows of a COPY FREEZE load, all of them are kept in memory for replay
+#define PG_FREEZE_MAX 10000000
+
 struct pg_parameters {
     const char     *host;
     const char     *dbname;
@@ -26,6 +46,20 @@ struct pg_parameters {
     const char     *host_replica;
     const char     *generation;
     postgres_format fmt;
+    const config_setting_t *columns;
+    const char     *table;      // table template
+    const char     *table_time;
+    const char     *table_key;
+    int             tables;
+    const char     *dead_letter;
+    const char     *upsert;     // ON CONFLICT clause
+    const char     *staging;
+    const char     *offsets;    // table of the kafka offsets
+    int             replica_ack;
+    const char     *shard;      // json pointer of the shard key
+    const char     *shard_key;  // metadata key of the shard key
+    int             freeze;     // rows of a COPY FREEZE load
+    const char     *freeze_like;
 };
 
 char *
@@ -53,29 +87,58 @@ _connectinfo(const char *host, const char *dbname, const char *user)
     return conninfo;
 }
 
-static char *
-_cpycmd(const char *host, const char *generation, postgres_format fmt)
+static const char *
+_format_name(postgres_format fmt)
 {
-    const char *format;
-    char       *cpycmd;
-
     switch (fmt) {
         case POSTGRES_CSV:
-            format = "csv";
-            break;
+            return "csv";
         case POSTGRES_BINARY:
-            format = "binary";
-            break;
+            return "binary";
         default:
-            format = "text";
-            break;
+            return "text";
     }
+}
 
-    if (host == NULL)
-        return NULL;
-    char *hostname;
+// formats a statement into a string of its own
+static char *
+_sqlf(const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+    char *sql;
+
+    va_start(ap, fmt);
+    len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+    {
+        logger_log("%s %d: error while formatting query string",
+                   __FILE__, __LINE__);
+        abort();
+    }
+
+    sql = SCALLOC(len + 1, 1);
+    va_start(ap, fmt);
+    vsnprintf(sql, len + 1, fmt, ap);
+    va_end(ap);
+    return sql;
+}
+
+/*
+ * _target_name
+ *      The table copied to: the topic, in json format
+ *      <host>_<port>_<generation>.data
+ */
+static char *
+_target_name(const char *host, const char *generation, postgres_format fmt)
+{
+    char *hostname, *target;
     int port = 0;
 
+    if (fmt != POSTGRES_JSON)
+        return strdup(generation);
+
     if (parse_connstring((char *)host, &hostname, &port) == -1)
         abort();
 
@@ -89,31 +152,9 @@ _cpycmd(const char *host, const char *generation, postgres_format fmt)
         ++ptr;
     }
 
-    int ret;
-    if (fmt == POSTGRES_CSV || fmt == POSTGRES_BINARY)
-    {
-        char *fmt = "COPY %s FROM STDIN (FORMAT %s)";
-        int len = strlen(fmt) + strlen(generation) + strlen(format) + 20;
-        cpycmd = SCALLOC(len, 1);
-        ret = snprintf(cpycmd, len, fmt, generation, format);
-    }
-    else
-    {
-        char *fmt = "COPY %s_%d_%s.data FROM STDIN (FORMAT %s)";
-        int len = strlen(fmt) + strlen(hostname) + strlen(generation) + strlen(format) + 20;
-        cpycmd = SCALLOC(len, 1);
-        ret = snprintf(cpycmd, len, fmt, hostname, port, generation, format);
-    }
-
-    if (ret < 0)
-    {
-        logger_log("%s %d: error while formatting COPY query string",
-                   __FILE__, __LINE__);
-        abort();
-    }
-
+    target = _sqlf("%s_%d_%s.data", hostname, port, generation);
     free(hostname);
-    return cpycmd;
+    return target;
 }
 
 static void
@@ -143,11 +184,235 @@ read_pg_params(struct pg_parameters *p, config_setting_t *config)
         p->fmt = POSTGRES_JSON;
     else if (strcmp(format, "binary") == 0)
         p->fmt = POSTGRES_BINARY;
+    else if (strcmp(format, "typed") == 0)
+        p->fmt = POSTGRES_TYPED;
+    else if (strcmp(format, "insert") == 0)
+        p->fmt = POSTGRES_INSERT;
     else
     {
         logger_log("%s %d: Unknown format: %s", __FILE__, __LINE__, format);
         abort();
     }
+
+    p->columns = config_setting_get_member(config, "columns");
+
+    config_setting_lookup_string(config, "table", &p->table);
+    config_setting_lookup_string(config, "table_time", &p->table_time);
+    config_setting_lookup_string(config, "table_key", &p->table_key);
+    if (config_setting_lookup_int(config, "tables", &p->tables) != CONFIG_TRUE)
+        p->tables = 4;
+    config_setting_lookup_string(config, "dead_letter", &p->dead_letter);
+    config_setting_lookup_string(config, "upsert", &p->upsert);
+    config_setting_lookup_string(config, "staging", &p->staging);
+    config_setting_lookup_string(config, "offsets", &p->offsets);
+    config_setting_lookup_string(config, "shard", &p->shard);
+    config_setting_lookup_string(config, "shard_key", &p->shard_key);
+    config_setting_lookup_int(config, "freeze", &p->freeze);
+    config_setting_lookup_string(config, "freeze_like", &p->freeze_like);
+
+    if (config_setting_lookup_string(config, "replica_ack", &format)
+        != CONFIG_TRUE || strcmp(format, "all") == 0)
+        p->replica_ack = PQ_ACK_ALL;
+    else
+        p->replica_ack = PQ_ACK_PRIMARY;
+}
+
+static void
+_meta_connect(Meta m)
+{
+    m->conn_master = pg_connect(m->conninfo);
+    if (m->conninfo_replica)
+    {
+        m->conn_replica = pg_connect(m->conninfo_replica);
+        replica_start(m);
+    }
+}
+
+/*
+ * _conflict_target
+ *      The columns of the conflict target of an ON CONFLICT clause,
+ *      "(a, b) DO UPDATE ..." yields "a, b". NULL without one.
+ */
+static char *
+_conflict_target(const char *upsert)
+{
+    const char *p;
+    int depth = 0;
+
+    while (isspace((unsigned char) *upsert))
+        upsert++;
+    if (*upsert != '(')
+        return NULL;
+
+    for (p = upsert; *p; p++)
+    {
+        if (*p == '(')
+            depth++;
+        else if (*p == ')' && --depth == 0)
+            return _sqlf("%.*s", (int) (p - upsert - 1), upsert + 1);
+    }
+    return NULL;
+}
+
+/*
+ * _meta_target
+ *      Prepare the COPY into target. Typed rows are binary COPY rows, their
+ *      columns are taken from the catalog of the master.
+ *
+ *      An upsert COPYs into a staging table, either a temporary one of the
+ *      session (emptied on commit) or the configured (unlogged) one, which
+ *      is emptied by the INSERT. Both happen in one transaction, the
+ *      staging table's rows are never visible to others. Rows of a batch
+ *      sharing a conflict key are reduced to one, as a single INSERT
+ *      can't update a row twice: the last one from the temporary table,
+ *      whose rows are in the order of the COPY.
+ *
+ *      With an offsets table, every COPY runs in a transaction of its own
+ *      as well, which stores the kafka offsets of the batch.
+ *
+ *      A COPY FREEZE load creates the target or, if it is empty, truncates
+ *      it in the same transaction (see _freeze) and takes freeze rows, so
+ *      the rows are written frozen and vacuum doesn't need to freeze them
+ *      later.
+ */
+static void
+_meta_target(Meta m, const char *target, postgres_format fmt,
+    const config_setting_t *columns, const char *upsert, const char *staging)
+{
+    const char *rel = target;
+    char *cols = NULL, *keys = NULL;
+
+    m->target = strdup(target);
+    m->cpyfmt = fmt;
+    if (fmt == POSTGRES_TYPED || fmt == POSTGRES_INSERT)
+    {
+        m->table = pgtypes_table(m->conn_master, target, columns);
+        cols = pgtypes_columns(m->conn_master, m->table);
+        m->cpyfmt = POSTGRES_BINARY;
+    }
+
+    if (fmt == POSTGRES_INSERT)
+    {
+        PgCopyBuf params = {0};
+        for (int i = 1; i <= m->table->ncolumns; i++)
+        {
+            params.len += snprintf(pgcopy_buf_reserve(&params, 16), 16,
+                "%s$%d", i > 1 ? ", " : "", i);
+        }
+        m->cpycmd = _sqlf("INSERT INTO %s (%s) VALUES (%s)%s%s", target,
+            cols, params.data, upsert ? " ON CONFLICT " : "",
+            upsert ? upsert : "");
+        m->cpyfmt = PQ_INSERT;
+        pgcopy_buf_free(&params);
+        free(cols);
+        return;
+    }
+
+    if (upsert)
+        keys = _conflict_target(upsert);
+
+    if (upsert && staging)
+    {
+        rel = staging;
+        m->cpybegin = strdup("BEGIN");
+        m->cpyend = _sqlf("WITH staged AS (DELETE FROM %s RETURNING %s) "
+            "INSERT INTO %s %s%s%s SELECT %s%s%s* FROM staged%s%s "
+            "ON CONFLICT %s; COMMIT",
+            staging, cols ? cols : "*", target,
+            cols ? "(" : "", cols ? cols : "", cols ? ")" : "",
+            keys ? "DISTINCT ON (" : "", keys ? keys : "", keys ? ") " : "",
+            keys ? " ORDER BY " : "", keys ? keys : "", upsert);
+    }
+    else if (upsert)
+    {
+        rel = PG_STAGING;
+        m->cpysession = _sqlf("DROP TABLE IF EXISTS pg_temp.%s; "
+            "CREATE TEMPORARY TABLE %s (LIKE %s INCLUDING DEFAULTS) "
+            "ON COMMIT DELETE ROWS", PG_STAGING, PG_STAGING, target);
+        m->cpybegin = strdup("BEGIN");
+        m->cpyend = _sqlf("INSERT INTO %s %s%s%s SELECT %s%s%s%s FROM %s"
+            "%s%s%s ON CONFLICT %s; COMMIT", target,
+            cols ? "(" : "", cols ? cols : "", cols ? ")" : "",
+            keys ? "DISTINCT ON (" : "", keys ? keys : "", keys ? ") " : "",
+            cols ? cols : "*", PG_STAGING,
+            keys ? " ORDER BY " : "", keys ? keys : "",
+            keys ? ", ctid DESC" : "", upsert);
+    }
+    else if (m->offsets)
+    {
+        m->cpybegin = strdup("BEGIN");
+        m->cpyend = strdup("COMMIT");
+    }
+    free(keys);
+
+    m->cpycmd = _sqlf("COPY %s %s%s%sFROM STDIN (FORMAT %s)", rel,
+        cols ? "(" : "", cols ? cols : "", cols ? ") " : "",
+        _format_name(m->cpyfmt));
+
+    if (m->freeze)
+    {
+        m->cpythawed = m->cpycmd;
+        m->cpycmd = _sqlf("COPY %s %s%s%sFROM STDIN (FORMAT %s, FREEZE)",
+            rel, cols ? "(" : "", cols ? cols : "", cols ? ") " : "",
+            _format_name(m->cpyfmt));
+        if (m->freeze_like)
+            m->cpybegin = _sqlf("BEGIN; CREATE TABLE IF NOT EXISTS %s "
+                "(LIKE %s INCLUDING ALL); "
+                "LOCK TABLE %s IN ACCESS EXCLUSIVE MODE",
+                target, m->freeze_like, target);
+        else
+            m->cpybegin = _sqlf("BEGIN; "
+                "LOCK TABLE %s IN ACCESS EXCLUSIVE MODE", target);
+        m->cpyend = strdup("COMMIT");
+    }
+    free(cols);
+}
+
+/*
+ * _meta_shards
+ *      Open a COPY stream to every host of the host list,
+ *      <host>[,<host>...][;<replica>[,<replica>...]]
+ */
+static void
+_meta_shards(Meta m, struct pg_parameters *p)
+{
+    Array master = parse_hostinfo_master((char *) p->host);
+    Array replica = parse_hostinfo_replica((char *) p->host);
+    Shards sh = SCALLOC(1, sizeof(*sh));
+    Meta s;
+
+    sh->jpointer = p->shard;
+    sh->key = p->shard_key;
+    sh->nstreams = array_used(master);
+    sh->streams = SCALLOC(sh->nstreams, sizeof(*sh->streams));
+
+    for (int i = 0; i < sh->nstreams; i++)
+    {
+        s = SCALLOC(1, sizeof(*s));
+        s->conninfo = _connectinfo(array_get(master, i), p->dbname, p->user);
+        if (i < (int) array_used(replica))
+            s->conninfo_replica = _connectinfo(array_get(replica, i),
+                p->dbname, p->user);
+        s->dead_letter = p->dead_letter;
+        s->replica_ack = p->replica_ack;
+        s->freeze = p->freeze;
+        s->freeze_like = p->freeze_like;
+        if (pthread_mutex_init(&s->commit_mutex, NULL) != 0) {
+            logger_log("%s %d: unable to create mutex", __FILE__, __LINE__ );
+            abort();
+        }
+        _meta_connect(s);
+
+        char *target = _target_name(array_get(master, i), p->generation,
+            p->fmt);
+        _meta_target(s, target, p->fmt, p->columns, p->upsert, p->staging);
+        free(target);
+        sh->streams[i] = s;
+    }
+
+    m->shards = sh;
+    array_free(&replica);
+    array_free(&master);
 }
 
 Meta
@@ -155,34 +420,60 @@ postgres_meta_init(struct pg_parameters *p)
 {
     Meta m = SCALLOC(1, sizeof(*m));
 
-    m->cpycmd = _cpycmd(p->host, p->generation, p->fmt);
-    m->conninfo = _connectinfo(p->host, p->dbname, p->user);
+    // shards connect to their hosts on their own
+    if (p->shard == NULL && p->shard_key == NULL)
+    {
+        m->conninfo = _connectinfo(p->host, p->dbname, p->user);
+        m->conninfo_replica = _connectinfo(p->host_replica, p->dbname,
+            p->user);
+    }
     m->cpyfmt = (int) p->fmt;
+    m->dead_letter = p->dead_letter;
+    m->offsets = p->offsets;
+    m->replica_ack = p->replica_ack;
+    m->freeze = p->freeze;
+    m->freeze_like = p->freeze_like;
 
-    m->conn_master = PQconnectdb(m->conninfo);
-    if (PQstatus(m->conn_master) != CONNECTION_OK)
-    {
-        logger_log("%s %d: %s", __FILE__, __LINE__, PQerrorMessage(m->conn_master));
+    if (pthread_mutex_init(&m->commit_mutex, NULL) != 0) {
+        logger_log("%s %d: unable to create mutex", __FILE__, __LINE__ );
         abort();
     }
 
-    m->conninfo_replica = _connectinfo(p->host_replica, p->dbname, p->user);
-
-    if (m->conninfo_replica == NULL)
+    // routed streams connect once their first message arrives
+    if (p->table)
+    {
+        Route r = SCALLOC(1, sizeof(*r));
+        r->template = p->table;
+        r->time = p->table_time;
+        r->key = p->table_key;
+        r->fmt = p->fmt;
+        r->columns = p->columns;
+        r->upsert = p->upsert;
+        r->staging = p->staging;
+        r->size = p->tables;
+        r->streams = SCALLOC(r->size, sizeof(*r->streams));
+        m->route = r;
         return m;
+    }
 
-    m->conn_replica = PQconnectdb(m->conninfo_replica);
-    if (PQstatus(m->conn_replica) != CONNECTION_OK)
+    if (p->shard || p->shard_key)
     {
-        logger_log("%s %d: %s", __FILE__, __LINE__, PQerrorMessage(m->conn_replica));
-        abort();
+        _meta_shards(m, p);
+        return m;
     }
 
-    if (pthread_mutex_init(&m->commit_mutex, NULL) != 0) {
-        logger_log("%s %d: unable to create mutex", __FILE__, __LINE__ );
-        abort();
+    _meta_connect(m);
+    if (m->offsets)
+    {
+        pg_offsets_table(m->conn_master, m->offsets);
+        if (m->conninfo_replica)
+            pg_offsets_table(m->conn_replica, m->offsets);
     }
 
+    char *target = _target_name(p->host, p->generation, p->fmt);
+    _meta_target(m, target, p->fmt, p->columns, p->upsert, p->staging);
+    free(target);
+
     return m;
 }
 
@@ -191,10 +482,38 @@ postgres_meta_free(Meta *m)
 {
     pthread_mutex_destroy(&(*m)->commit_mutex);
 
+    if ((*m)->route)
+    {
+        for (int i = 0; i < (*m)->route->nstreams; i++)
+            postgres_meta_free(&(*m)->route->streams[i]);
+        free((*m)->route->streams);
+        free((*m)->route);
+    }
+
+    if ((*m)->shards)
+    {
+        for (int i = 0; i < (*m)->shards->nstreams; i++)
+            postgres_meta_free(&(*m)->shards->streams[i]);
+        free((*m)->shards->streams);
+        free((*m)->shards);
+    }
+
     free((*m)->conninfo);
     free((*m)->cpycmd);
+    free((*m)->cpysession);
+    free((*m)->target);
+    free((*m)->cpybegin);
+    free((*m)->cpyend);
+    free((*m)->cpythawed);
+    free((*m)->rows);
+    for (int i = 0; i < (*m)->npositions; i++)
+        free((*m)->positions[i].topic);
+    free((*m)->positions);
+    pgcopy_buf_free(&(*m)->cpybuf);
+    pgtypes_table_free(&(*m)->table);
+    replica_stop(*m);
     PQfinish((*m)->conn_master);
-    if ((*m)->conninfo_replica == NULL)
+    if ((*m)->conninfo_replica)
         PQfinish((*m)->conn_replica);
     free((*m)->conninfo_replica);
     free(*m);
@@ -226,104 +545,343 @@ postgres_producer_init(config_setting_t *config)
     return postgres;
 }
 
-void
-postgres_producer_produce(Producer p, Message msg)
+/*
+ * Dynamic table routing
+ *
+ * The target table of a message is its template (e.g. events_%Y%m%d)
+ * formatted by strftime with the UTC time of the message, %k is
+ * replaced by a metadata value. The time is taken from a json pointer
+ * (timestamp or epoch seconds) or is the time of arrival.
+ */
+
+#define PG_TARGET_LEN 256
+
+static bool
+_route_time(const char *jpointer, Message msg, time_t *t)
 {
-    Meta m = (Meta)p->meta;
+    char *data = message_get_data(msg);
+    json_object *root, *found = NULL;
+    int64_t usec;
+    bool ret = false;
 
-    char *buf = (char *) message_get_data(msg);
-    size_t len = message_get_len(msg);
-    const char *newline = "\n";
-    char *lit = NULL;
-    const char *binheader =
-            "PGCOPY\n\377\r\n\0" //postgres magic
-            "\0\0\0\0"  // flags field (only bit 16 relevant)
-            "\0\0\0\0"; // Header extension area
+    if (data[message_get_len(msg)] != '\0')
+        return false;
+    if ((root = json_tokener_parse(data)) == NULL)
+        return false;
 
-    // a binary message ends on 0xffff and is not treated as a string
-    if (m->cpyfmt != POSTGRES_BINARY && buf[len] != '\0')
+    if (json_pointer_get(root, jpointer, &found) == 0 && found)
     {
-        logger_log("payload doesn't end on null terminator");
-        return;
+        switch (json_object_get_type(found))
+        {
+            case json_type_int:
+                *t = (time_t) json_object_get_int64(found);
+                ret = true;
+                break;
+            case json_type_string:
+                if ((ret = pgtime_timestamp(json_object_get_string(found),
+                        json_object_get_string_len(found), &usec)))
+                    *t = (time_t) (usec / 1000000
+                        + (int64_t) PGTIME_EPOCH_DAYS * 86400);
+                break;
+            default:
+                break;
+        }
     }
 
-    if (m->cpyfmt != POSTGRES_BINARY)
+    json_object_put(root);
+    return ret;
+}
+
+// metadata values become part of an identifier
+static size_t
+_route_key(MDatum datum, char *dst, size_t size)
+{
+    char num[16];
+    const char *src;
+    size_t i;
+
+    if (datum->type == MTYPE_STRING)
+        src = datum->value.string;
+    else if (datum->type == MTYPE_INT)
     {
-        char *s = strstr(buf, "\\u0000");
-        if (s != NULL)
-        {
-            logger_log("found invalid unicode byte sequence: %s", buf);
-            return;
-        }
+        snprintf(num, sizeof(num), "%u", *datum->value.value);
+        src = num;
+    }
+    else
+        return 0;
+
+    for (i = 0; src[i] && i < size; i++)
+        dst[i] = (isalnum((unsigned char) src[i])) ? src[i] : '_';
+    return i;
+}
+
+static bool
+_route_target(Route r, Message msg, char *target)
+{
+    char name[PG_TARGET_LEN];
+    const char *tpl = r->template;
+    time_t t = time(NULL);
+    struct tm tm;
+    size_t n = 0;
 
-        lit = PQescapeLiteral(m->conn_master, buf, strlen(buf));
+    if (r->time && !_route_time(r->time, msg, &t))
+    {
+        logger_log("%s %d: No timestamp at %s to route by",
+            __FILE__, __LINE__, r->time);
+        return false;
     }
 
-    pthread_mutex_lock(&m->commit_mutex);
-    if (m->copy == 0)
+    for (; *tpl && n < sizeof(name) - 1; tpl++)
     {
-        m->res = PQexec(m->conn_master, m->cpycmd);
-        if (PQresultStatus(m->res) != PGRES_COPY_IN)
+        if (tpl[0] == '%' && tpl[1] == 'k')
         {
-            logger_log("%s %d: %s", __FILE__, __LINE__, PQerrorMessage(m->conn_master));
-            abort();
+            MDatum key = metadata_find(message_get_metadata(msg),
+                (char *) r->key);
+            size_t len;
+            if (key == NULL
+                || !(len = _route_key(key, name + n, sizeof(name) - 1 - n)))
+            {
+                logger_log("%s %d: No metadata %s to route by",
+                    __FILE__, __LINE__, r->key);
+                return false;
+            }
+            n += len;
+            tpl++;
+            continue;
         }
-        PQclear(m->res);
+        if (tpl[0] == '%' && tpl[1] != '\0')
+            name[n++] = *tpl++;
+        if (n < sizeof(name) - 1)
+            name[n++] = *tpl;
+    }
+    name[n] = '\0';
 
-        if(m->cpyfmt  == POSTGRES_BINARY)
-            PQputCopyData(m->conn_master, binheader, 19);
+    gmtime_r(&t, &tm);
+    if (strftime(target, PG_TARGET_LEN, name, &tm) == 0)
+    {
+        logger_log("%s %d: Table name %s too long", __FILE__, __LINE__, name);
+        return false;
+    }
+    return true;
+}
 
-        if (m->conninfo_replica)
+/*
+ * _route
+ *      Find the COPY stream of the message's target table, open one if
+ *      there is none. The least recently used stream is committed and
+ *      its connections are taken over once all are in use.
+ */
+static Meta
+_route(Meta m, Message msg)
+{
+    char target[PG_TARGET_LEN];
+    Route r = m->route;
+    Meta s;
+    int i;
+
+    if (!_route_target(r, msg, target))
+        return NULL;
+
+    for (i = 0; i < r->nstreams; i++)
+        if (!strcmp(r->streams[i]->target, target))
+            break;
+
+    if (i < r->nstreams)
+        s = r->streams[i];
+    else
+    {
+        if (r->nstreams < r->size)
         {
-            m->res = PQexec(m->conn_replica, m->cpycmd);
-            if (PQresultStatus(m->res) != PGRES_COPY_IN)
-            {
-                logger_log("%s %d: %s", __FILE__, __LINE__, PQerrorMessage(m->conn_replica));
+            s = SCALLOC(1, sizeof(*s));
+            s->conninfo = strdup(m->conninfo);
+            s->dead_letter = m->dead_letter;
+            s->replica_ack = m->replica_ack;
+            s->freeze_like = m->freeze_like;
+            if (m->conninfo_replica)
+                s->conninfo_replica = strdup(m->conninfo_replica);
+            if (pthread_mutex_init(&s->commit_mutex, NULL) != 0) {
+                logger_log("%s %d: unable to create mutex", __FILE__, __LINE__ );
                 abort();
             }
-            PQclear(m->res);
-
-            if(m->cpyfmt  == POSTGRES_BINARY)
-                PQputCopyData(m->conn_replica, binheader, 19);
+            _meta_connect(s);
+            i = r->nstreams++;
         }
-        m->copy = 1;
+        else
+        {
+            i = r->nstreams - 1;
+            s = r->streams[i];
+            if (s->copy)
+            {
+                m->count -= s->count;
+                commit(&s);
+            }
+            free(s->target);
+            free(s->cpysession);
+            free(s->cpycmd);
+            free(s->cpybegin);
+            free(s->cpyend);
+            free(s->cpythawed);
+            s->cpysession = s->cpybegin = s->cpyend = s->cpythawed = NULL;
+            s->session = 0;
+            pgtypes_table_free(&s->table);
+        }
+
+        // every new target is loaded frozen
+        s->freeze = m->freeze;
+
+        _meta_target(s, target, r->fmt, r->columns, r->upsert, r->staging);
     }
 
-    if (m->cpyfmt != POSTGRES_BINARY) {
-        if (lit[0] == ' ' && lit[1] == 'E')
+    memmove(r->streams + 1, r->streams, i * sizeof(*r->streams));
+    r->streams[0] = s;
+    return s;
+}
+
+/*
+ * Sharding
+ *
+ * The shard key of a message is a metadata value or the value at a json
+ * pointer (numbers hash like their text). Its FNV-1a hash is mapped to a
+ * host by jump consistent hashing, so adding a host moves only the keys
+ * ending up on it.
+ */
+static Meta
+_shard(Meta m, Message msg)
+{
+    Shards sh = m->shards;
+    char *data = message_get_data(msg), num[16];
+    json_object *root = NULL, *found = NULL;
+    const char *key = NULL;
+    Fnv32_t hash;
+
+    if (sh->key)
+    {
+        MDatum datum = metadata_find(message_get_metadata(msg),
+            (char *) sh->key);
+        if (datum && datum->type == MTYPE_STRING)
+            key = datum->value.string;
+        else if (datum && datum->type == MTYPE_INT)
         {
-            PQputCopyData(m->conn_master, lit + 3, strlen(lit) - 4);
-            if (m->conninfo_replica)
-                PQputCopyData(m->conn_replica, lit + 3, strlen(lit) - 4);
+            snprintf(num, sizeof(num), "%u", *datum->value.value);
+            key = num;
         }
-        else if (lit[0] == '\'')
+    }
+    else if (data[message_get_len(msg)] == '\0'
+        && (root = json_tokener_parse(data)) != NULL
+        && json_pointer_get(root, sh->jpointer, &found) == 0 && found)
+        key = json_object_get_string(found);
+
+    if (key == NULL)
+    {
+        logger_log("%s %d: No shard key %s", __FILE__, __LINE__,
+            sh->key ? sh->key : sh->jpointer);
+        json_object_put(root);
+        return NULL;
+    }
+
+    hash = fnv32a_str((void *) key, strlen(key));
+    json_object_put(root);
+    return sh->streams[jump_hash(hash, sh->nstreams)];
+}
+
+/*
+ * _encode
+ *      Rows are encoded straight into the COPY buffer,
+ *      a rejected row leaves it untouched.
+ */
+static bool
+_encode(Meta m, char *buf, size_t len)
+{
+    ssize_t row;
+
+    if (m->table)
+    {
+        if (buf[len] != '\0')
         {
-            PQputCopyData(m->conn_master, lit + 1, strlen(lit) - 2);
-            if (m->conninfo_replica)
-                PQputCopyData(m->conn_replica, lit + 1, strlen(lit) - 2);
+            logger_log("%s %d: payload doesn't end on null terminator",
+                __FILE__, __LINE__);
+            return false;
         }
-        else
-            abort();
+        return pgtypes_row(m->table, buf, &m->cpybuf);
+    }
 
-        PQputCopyData(m->conn_master, newline, 1);
+    switch (m->cpyfmt)
+    {
+        case POSTGRES_JSON:
+            row = pgcopy_text(pgcopy_buf_reserve(&m->cpybuf,
+                PGCOPY_TEXT_MAXLEN(len)), buf, len);
+            break;
+        case POSTGRES_CSV:
+            row = pgcopy_csv(pgcopy_buf_reserve(&m->cpybuf,
+                PGCOPY_TEXT_MAXLEN(len)), buf, len);
+            break;
+        default:
+            memcpy(pgcopy_buf_reserve(&m->cpybuf, len), buf, len);
+            row = len;
+            break;
+    }
 
-        if (m->conninfo_replica)
-            PQputCopyData(m->conn_replica, newline, 1);
-    } else {
-       PQputCopyData(m->conn_master, buf, len);
+    if (row < 0)
+    {
+        logger_log("%s %d: found invalid unicode byte sequence: %.*s",
+            __FILE__, __LINE__, (int) len, buf);
+        return false;
+    }
+    m->cpybuf.len += row;
+    return true;
+}
+
+void
+postgres_producer_produce(Producer p, Message msg)
+{
+    Meta m = (Meta)p->meta;
+    Meta s = m; // COPY stream
+
+    char *buf = (char *) message_get_data(msg);
+    size_t len = message_get_len(msg);
 
-       if (m->conninfo_replica)
-           PQputCopyData(m->conn_replica, buf, len);
+    pthread_mutex_lock(&m->commit_mutex);
+    if ((m->route && (s = _route(m, msg)) == NULL)
+        || (m->shards && (s = _shard(m, msg)) == NULL))
+    {
+        pthread_mutex_unlock(&m->commit_mutex);
+        return;
     }
 
+    if (s->copy == 0)
+    {
+        copy_begin(&s);
+        m->copy = 1;
+    }
+
+    copy_row(&s);
+    if (!_encode(s, buf, len))
+    {
+        pthread_mutex_unlock(&m->commit_mutex);
+        return;
+    }
+    if (m->offsets)
+    {
+        const char *topic;
+        int32_t partition;
+        int64_t offset;
+
+        if (kafka_message_offset(msg, &topic, &partition, &offset))
+            copy_offset(&s, topic, partition, offset);
+    }
+    // every stream commits on its own
     m->count = m->count + 1;
-    if (m->count == 2000)
+    if (s != m)
+        s->count = s->count + 1;
+    if (s->cpybuf.len - s->flushed >= PGCOPY_FLUSH)
+        copy_flush(&s);
+    if (s->count == (s->freeze ? s->freeze : 2000))
     {
-        commit(&m);
+        if (s != m)
+            m->count -= s->count;
+        commit(&s);
     }
     pthread_mutex_unlock(&m->commit_mutex);
-
-    free(lit);
 }
 
 void
@@ -345,45 +903,800 @@ postgres_producer_free(Producer *p)
     *p = NULL;
 }
 
+/*
+ * Postgres consumer
+ *
+ * The consumer runs in one of two modes:
+ *  - export: stream a table or query through COPY ... TO STDOUT,
+ *            each row becomes a message
+ *  - replication: read a logical replication slot (pgoutput, wal2json),
+ *            each decoded change becomes a message. The LSN of a message
+ *            is acknowledged once a producer has handled it.
+ */
+
+typedef enum {
+    PG_CONSUMER_EXPORT,
+    PG_CONSUMER_REPLICATION,
+} pg_consumer_mode;
+
+/* Acknowledgement state of a replication consumer. Changes arrive in
+ * LSN order, but producers may handle them out of order. The changes in
+ * flight are kept in arrival order, and only the LSN behind which all
+ * of them are handled is confirmed. The state is shared with the
+ * metadata of every message in flight, which is why it is refcounted:
+ * producers may still run callbacks once the consumer has been freed. */
+typedef struct PgInflight {
+    uint64_t lsn;
+    bool     done;
+} PgInflight;
+
+typedef struct PgAck {
+    pthread_mutex_t  mutex;
+    uint64_t         flushed;   // LSN behind which all changes are handled
+    PgInflight      *inflight;  // ring of changes not yet confirmed
+    size_t           head;
+    size_t           count;
+    size_t           alloc;
+    uint64_t         seq;       // arrival number of inflight[head]
+    atomic_long      refcount;
+} *PgAck;
+
+// message metadata "pg_lsn"
+typedef struct PgLsn {
+    PgAck    ack;
+    uint64_t seq;
+    uint64_t lsn;
+} *PgLsn;
+
+typedef struct CMeta {
+    PGconn          *conn;
+    char            *conninfo;
+    char            *cmd;
+    pg_consumer_mode mode;
+    postgres_format  fmt;
+    bool             header;    // binary COPY header not yet stripped
+    int              status_interval;
+    time_t           last_status;
+    uint64_t         idle_lsn;  // server WAL end seen in keepalives
+    PgAck            ack;
+} *CMeta;
+
+// seconds between 1970-01-01 and 2000-01-01 (postgres epoch)
+#define PG_EPOCH_OFFSET 946684800LL
+// XLogData header: 'w', dataStart, walEnd, sendTime
+#define PG_XLOGDATA_HDR 25
+// Primary keepalive: 'k', walEnd, sendTime, replyRequested
+#define PG_KEEPALIVE_LEN 18
+#define PG_WAIT_MS 1000
+
+static uint64_t
+_pg_recvint64(const char *buf)
+{
+    uint64_t res = 0;
+    for (int i = 0; i < 8; i++)
+        res = (res << 8) | (uint8_t) buf[i];
+    return res;
+}
+
+static void
+_pg_sendint64(char *buf, uint64_t val)
+{
+    for (int i = 7; i >= 0; i--)
+    {
+        buf[i] = (char) (val & 0xff);
+        val >>= 8;
+    }
+}
+
+static int64_t
+_pg_now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((int64_t) tv.tv_sec - PG_EPOCH_OFFSET) * 1000000 + tv.tv_usec;
+}
+
+static void
+_pg_ack_release(PgAck ack)
+{
+    if (atomic_fetch_sub(&ack->refcount, 1) == 1)
+    {
+        pthread_mutex_destroy(&ack->mutex);
+        free(ack->inflight);
+        free(ack);
+    }
+}
+
+/*
+ * _pg_ack_add
+ *      a change of the consumer is in flight, returns its arrival number
+ */
+static uint64_t
+_pg_ack_add(PgAck ack, uint64_t lsn)
+{
+    uint64_t seq;
+
+    pthread_mutex_lock(&ack->mutex);
+    if (ack->count == ack->alloc)
+    {
+        size_t alloc = ack->alloc ? ack->alloc * 2 : 64;
+        PgInflight *inflight = SCALLOC(alloc, sizeof(*inflight));
+
+        // unwrap the ring
+        for (size_t i = 0; i < ack->count; i++)
+            inflight[i] = ack->inflight[(ack->head + i) % ack->alloc];
+        free(ack->inflight);
+        ack->inflight = inflight;
+        ack->alloc = alloc;
+        ack->head = 0;
+    }
+    ack->inflight[(ack->head + ack->count) % ack->alloc] =
+        (PgInflight) {.lsn = lsn, .done = false};
+    seq = ack->seq + ack->count++;
+    pthread_mutex_unlock(&ack->mutex);
+    return seq;
+}
+
+/*
+ * _pg_ack_done
+ *      Mark a change as handled and move the confirmed LSN behind all
+ *      changes handled in a row. A change sharing its LSN with one
+ *      still in flight does not confirm it.
+ */
+static void
+_pg_ack_done(PgAck ack, uint64_t seq)
+{
+    uint64_t lsn = 0;
+    bool moved = false;
+
+    pthread_mutex_lock(&ack->mutex);
+    ack->inflight[(ack->head + (seq - ack->seq)) % ack->alloc].done = true;
+    while (ack->count && ack->inflight[ack->head].done)
+    {
+        lsn = ack->inflight[ack->head].lsn;
+        ack->head = (ack->head + 1) % ack->alloc;
+        ack->count--;
+        ack->seq++;
+        moved = true;
+    }
+    if (moved)
+    {
+        if (ack->count && ack->inflight[ack->head].lsn <= lsn)
+            lsn = ack->inflight[ack->head].lsn
+                ? ack->inflight[ack->head].lsn - 1 : 0;
+        if (lsn > ack->flushed)
+            ack->flushed = lsn;
+    }
+    pthread_mutex_unlock(&ack->mutex);
+}
+
+/*
+ * _pg_lsn_ack
+ *      metadata callback of replicated messages, marks the change
+ *      of a message as handled
+ */
+static bool
+_pg_lsn_ack(Message msg)
+{
+    Metadata *md = message_get_metadata(msg);
+    MDatum datum = metadata_find(md, "pg_lsn");
+
+    if (datum == NULL || datum->type != MTYPE_OPAQUE
+        || datum->value.ptr == NULL)
+        return false;
+
+    PgLsn l = (PgLsn) datum->value.ptr;
+    if (l->ack == NULL)
+        return true;
+
+    _pg_ack_done(l->ack, l->seq);
+    _pg_ack_release(l->ack);
+    l->ack = NULL;
+    return true;
+}
+
+/*
+ * _pg_lsn_free
+ *      Release of the metadata. A message dropped by a hook never sees
+ *      its callback, it is handled all the same.
+ */
+static void
+_pg_lsn_free(void *lsn)
+{
+    PgLsn l = (PgLsn) lsn;
+
+    if (l->ack)
+    {
+        _pg_ack_done(l->ack, l->seq);
+        _pg_ack_release(l->ack);
+    }
+    free(l);
+}
+
+/*
+ * _pg_wait
+ *      wait for the connection socket to become readable,
+ *      returns 0 on timeout, 1 if input was consumed and -1 on error
+ */
+static int
+_pg_wait(PGconn *conn, int timeout)
+{
+    struct pollfd pfd = {.fd = PQsocket(conn), .events = POLLIN};
+    int ret;
+
+    if (pfd.fd < 0)
+        return -1;
+
+    ret = poll(&pfd, 1, timeout);
+    if (ret < 0)
+        return errno == EINTR ? 0 : -1;
+    if (ret == 0)
+        return 0;
+    if (!PQconsumeInput(conn))
+        return -1;
+    return 1;
+}
+
+static bool
+_pg_send_feedback(CMeta m, bool force)
+{
+    char buf[1 + 8 * 4 + 1];
+    time_t now = time(NULL);
+    uint64_t flushed;
+    bool idle;
+
+    if (!force && now - m->last_status < m->status_interval)
+        return true;
+
+    pthread_mutex_lock(&m->ack->mutex);
+    flushed = m->ack->flushed;
+    idle = m->ack->count == 0;
+    pthread_mutex_unlock(&m->ack->mutex);
+    /* With nothing in flight, everything the server sent us is handled.
+     * Confirm its WAL end so an idle slot does not retain WAL. */
+    if (idle && m->idle_lsn > flushed)
+        flushed = m->idle_lsn;
+
+    buf[0] = 'r';
+    _pg_sendint64(buf + 1, flushed);   // written
+    _pg_sendint64(buf + 9, flushed);   // flushed
+    _pg_sendint64(buf + 17, 0);        // applied
+    _pg_sendint64(buf + 25, _pg_now());
+    buf[33] = 0;                       // no reply requested
+
+    if (PQputCopyData(m->conn, buf, sizeof(buf)) <= 0 || PQflush(m->conn))
+    {
+        logger_log("%s %d: failed to send replication feedback: %s",
+            __FILE__, __LINE__, PQerrorMessage(m->conn));
+        return false;
+    }
+    m->last_status = now;
+    return true;
+}
+
+static char *
+_options_list(const config_setting_t *options)
+{
+    size_t len = 3;
+    int n = options ? config_setting_length(options) : 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        config_setting_t *o = config_setting_get_elem(options, i);
+        const char *value = config_setting_get_string(o);
+        // quotes, separators and doubled single quotes
+        len += strlen(config_setting_name(o)) + 2 * strlen(value) + 8;
+    }
+
+    char *res = SCALLOC(len, 1);
+    char *ptr = res;
+
+    if (n == 0)
+        return res;
+
+    *ptr++ = '(';
+    for (int i = 0; i < n; i++)
+    {
+        config_setting_t *o = config_setting_get_elem(options, i);
+        const char *value = config_setting_get_string(o);
+
+        ptr += sprintf(ptr, "%s\"%s\" '", i ? ", " : "",
+            config_setting_name(o));
+        for (; *value; value++)
+        {
+            if (*value == '\'')
+                *ptr++ = '\'';
+            *ptr++ = *value;
+        }
+        *ptr++ = '\'';
+    }
+    *ptr = ')';
+    return res;
+}
+
+static char *
+_export_cmd(const char *query, const char *table, postgres_format fmt)
+{
+    const char *format = fmt == POSTGRES_CSV ? "csv"
+        : fmt == POSTGRES_BINARY ? "binary" : "text";
+    const char *src = query ? query : table;
+    size_t len = strlen(src) + 64;
+    char *cmd = SCALLOC(len, 1);
+
+    if (query)
+        snprintf(cmd, len, "COPY (%s) TO STDOUT (FORMAT %s)", src, format);
+    else
+        snprintf(cmd, len, "COPY %s TO STDOUT (FORMAT %s)", src, format);
+    return cmd;
+}
+
+static char *
+_replication_cmd(const char *slot, const char *lsn,
+    const config_setting_t *options)
+{
+    char *opts = _options_list(options);
+    size_t len = strlen(slot) + strlen(lsn) + strlen(opts) + 64;
+    char *cmd = SCALLOC(len, 1);
+
+    snprintf(cmd, len, "START_REPLICATION SLOT \"%s\" LOGICAL %s %s",
+        slot, lsn, opts);
+    free(opts);
+    return cmd;
+}
+
+static void
+_create_slot(PGconn *conn, const char *slot, const char *plugin)
+{
+    size_t len = strlen(slot) + strlen(plugin) + 64;
+    char *cmd = SCALLOC(len, 1);
+    PGresult *res;
+
+    snprintf(cmd, len,
+        "CREATE_REPLICATION_SLOT \"%s\" LOGICAL %s NOEXPORT_SNAPSHOT",
+        slot, plugin);
+    res = PQexec(conn, cmd);
+
+    if (PQresultStatus(res) == PGRES_TUPLES_OK)
+        logger_log("%s %d: created replication slot %s (%s)",
+            __FILE__, __LINE__, slot, plugin);
+    else
+    {
+        const char *state = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+        // 42710: duplicate_object, the slot exists already
+        if (state == NULL || strcmp(state, "42710") != 0)
+        {
+            logger_log("%s %d: %s", __FILE__, __LINE__,
+                PQerrorMessage(conn));
+            abort();
+        }
+    }
+    PQclear(res);
+    free(cmd);
+}
+
 Consumer
-postgres_consumer_init(char *host)
+postgres_consumer_init(config_setting_t *config)
 {
-    struct pg_parameters    params = {0};
-    Consumer                postgres = SCALLOC(1, sizeof(*postgres));
+    struct pg_parameters params = {0};
+    const char *mode = NULL, *query = NULL, *slot = NULL, *plugin = NULL,
+        *lsn = NULL;
+    int create_slot = 0;
+    PGresult *res;
 
-    params.host = host;
-    postgres->meta          = postgres_meta_init(&params);
+    postgres_defaults(config);
+    read_pg_params(&params, config);
+
+    config_setting_lookup_string(config, "mode", &mode);
+    config_setting_lookup_string(config, "query", &query);
+    config_setting_lookup_string(config, "slot", &slot);
+    config_setting_lookup_string(config, "plugin", &plugin);
+    config_setting_lookup_string(config, "start_lsn", &lsn);
+    config_setting_lookup_bool(config, "create_slot", &create_slot);
+
+    Consumer postgres = SCALLOC(1, sizeof(*postgres));
+    CMeta m = SCALLOC(1, sizeof(*m));
+
+    m->fmt = params.fmt;
+    m->mode = (mode && strcmp(mode, "replication") == 0)
+        ? PG_CONSUMER_REPLICATION : PG_CONSUMER_EXPORT;
+    m->conninfo = _connectinfo(params.host, params.dbname, params.user);
+
+    if (m->mode == PG_CONSUMER_REPLICATION)
+    {
+        const char *repl = " replication=database";
+        size_t len = strlen(m->conninfo) + strlen(repl) + 1;
+        char *conninfo = SCALLOC(len, 1);
+        snprintf(conninfo, len, "%s%s", m->conninfo, repl);
+        free(m->conninfo);
+        m->conninfo = conninfo;
+
+        m->status_interval = 10;
+        config_setting_lookup_int(config, "status_interval",
+            &m->status_interval);
+        m->cmd = _replication_cmd(slot, lsn ? lsn : "0/0",
+            config_setting_get_member(config, "options"));
+
+        m->ack = SCALLOC(1, sizeof(*m->ack));
+        pthread_mutex_init(&m->ack->mutex, NULL);
+        atomic_init(&m->ack->refcount, 1);
+    }
+    else
+        m->cmd = _export_cmd(query, params.generation, params.fmt);
+
+    m->conn = PQconnectdb(m->conninfo);
+    if (PQstatus(m->conn) != CONNECTION_OK)
+    {
+        logger_log("%s %d: %s", __FILE__, __LINE__, PQerrorMessage(m->conn));
+        abort();
+    }
+
+    if (m->mode == PG_CONSUMER_REPLICATION && create_slot)
+        _create_slot(m->conn, slot, plugin ? plugin : "pgoutput");
+
+    res = PQexec(m->conn, m->cmd);
+    if (PQresultStatus(res) !=
+        (m->mode == PG_CONSUMER_REPLICATION ? PGRES_COPY_BOTH : PGRES_COPY_OUT))
+    {
+        logger_log("%s %d: %s", __FILE__, __LINE__, PQerrorMessage(m->conn));
+        abort();
+    }
+    PQclear(res);
+
+    m->header = m->fmt == POSTGRES_BINARY;
+    m->last_status = time(NULL);
+
+    postgres->meta          = m;
     postgres->consumer_free = postgres_consumer_free;
     postgres->consume       = postgres_consumer_consume;
 
     return postgres;
 }
 
+/*
+ * _copy_message
+ *      copy a COPY row or a decoded change into a null terminated
+ *      message payload
+ */
+static void
+_copy_message(Message msg, const char *data, size_t len)
+{
+    char *cpy = SCALLOC(len + 1, sizeof(*cpy));
+    memcpy(cpy, data, len);
+    message_set_data(msg, cpy);
+    message_set_len(msg, len);
+}
+
+/*
+ * _copy_data
+ *      fetch the next CopyData message without blocking longer than
+ *      PG_WAIT_MS. Returns its length, 0 if nothing arrived in time,
+ *      -1 at the end of the COPY and -2 on error.
+ */
+static int
+_copy_data(PGconn *conn, char **buf)
+{
+    int len;
+
+    while ((len = PQgetCopyData(conn, buf, 1)) == 0)
+    {
+        int ret = _pg_wait(conn, PG_WAIT_MS);
+        if (ret == 0)
+            return 0;
+        if (ret == -1)
+            return -2;
+    }
+    return len;
+}
+
+static int
+_export_consume(CMeta m, Message msg)
+{
+    char *buf = NULL;
+    const char *row;
+    int len = _copy_data(m->conn, &buf);
+
+    if (len == 0)
+        return 0;
+    if (len < 0)
+    {
+        PGresult *res = PQgetResult(m->conn);
+        if (len == -1 && PQresultStatus(res) == PGRES_COMMAND_OK)
+            logger_log("%s %d: export finished, %s rows",
+                __FILE__, __LINE__, PQcmdTuples(res));
+        else
+            logger_log("%s %d: export failed: %s",
+                __FILE__, __LINE__, PQerrorMessage(m->conn));
+        PQclear(res);
+        return -1;
+    }
+
+    row = buf;
+    if (m->fmt == POSTGRES_BINARY)
+    {
+        /* The header arrives with the first tuple and the trailer (-1)
+         * on its own, strip both. Each message is a single tuple. */
+        if (m->header)
+        {
+            uint32_t ext;
+            if (len < PGCOPY_HEADER_LEN
+                || memcmp(buf, PGCOPY_SIGNATURE, PGCOPY_SIGNATURE_LEN) != 0)
+            {
+                logger_log("%s %d: invalid binary COPY header",
+                    __FILE__, __LINE__);
+                PQfreemem(buf);
+                return -1;
+            }
+            memcpy(&ext, buf + PGCOPY_SIGNATURE_LEN + 4, 4);
+            row += PGCOPY_HEADER_LEN + ntohl(ext);
+            len -= PGCOPY_HEADER_LEN + ntohl(ext);
+            m->header = false;
+        }
+        if (len == 2 && (uint8_t) row[0] == 0xff && (uint8_t) row[1] == 0xff)
+            len = 0;
+    }
+    else if (len > 0 && row[len - 1] == '\n')
+        len--;  // row terminator
+
+    if (len > 0 || m->fmt != POSTGRES_BINARY)
+        _copy_message(msg, row, len);
+    PQfreemem(buf);
+    return 0;
+}
+
+static int
+_replication_consume(CMeta m, Message msg)
+{
+    char *buf = NULL;
+    int len = _copy_data(m->conn, &buf);
+
+    if (len == 0)
+        return _pg_send_feedback(m, false) ? 0 : -1;
+    if (len < 0)
+    {
+        PGresult *res = PQgetResult(m->conn);
+        logger_log("%s %d: replication stream ended: %s",
+            __FILE__, __LINE__, PQerrorMessage(m->conn));
+        PQclear(res);
+        return -1;
+    }
+
+    if (buf[0] == 'k' && len >= PG_KEEPALIVE_LEN)
+    {
+        uint64_t wal_end = _pg_recvint64(buf + 1);
+        bool reply = buf[PG_KEEPALIVE_LEN - 1];
+
+        if (wal_end > m->idle_lsn)
+            m->idle_lsn = wal_end;
+        PQfreemem(buf);
+        return _pg_send_feedback(m, reply) ? 0 : -1;
+    }
+
+    if (buf[0] != 'w' || len < PG_XLOGDATA_HDR)
+    {
+        logger_log("%s %d: unexpected replication message %c",
+            __FILE__, __LINE__, buf[0]);
+        PQfreemem(buf);
+        return 0;
+    }
+
+    _copy_message(msg, buf + PG_XLOGDATA_HDR, len - PG_XLOGDATA_HDR);
+
+    /* Provide callback functionality:
+     *  - callback function acknowledging the LSN
+     *  - pg_lsn envelope holding the LSN of the change */
+    Datum cb, lsn;
+    PgLsn l = SCALLOC(1, sizeof(*l));
+    Metadata *md = message_get_metadata(msg);
+    MDatum datum;
+
+    l->ack = m->ack;
+    l->lsn = _pg_recvint64(buf + 1);
+    l->seq = _pg_ack_add(m->ack, l->lsn);
+    atomic_fetch_add(&m->ack->refcount, 1);
+
+    cb.func = &_pg_lsn_ack;
+    lsn.ptr = l;
+    datum = mdatum_init(MTYPE_OPAQUE, lsn, sizeof(*l));
+    datum->release = _pg_lsn_free;
+    metadata_insert(md, "callback", mdatum_init(MTYPE_FUNC, cb, sizeof(void *)));
+    metadata_insert(md, "pg_lsn", datum);
+
+    PQfreemem(buf);
+    return _pg_send_feedback(m, false) ? 0 : -1;
+}
+
 int
-postgres_consumer_consume(UNUSED Consumer c, UNUSED Message msg)
+postgres_consumer_consume(Consumer c, Message msg)
 {
-    //TODO
-    return -1;
+    CMeta m = (CMeta) c->meta;
+
+    if (m->mode == PG_CONSUMER_REPLICATION)
+        return _replication_consume(m, msg);
+    return _export_consume(m, msg);
 }
 
 void
 postgres_consumer_free(Consumer *c)
 {
-    Meta m = (Meta) ((*c)->meta);
-    postgres_meta_free(&m);
+    CMeta m = (CMeta) ((*c)->meta);
+
+    if (m->mode == PG_CONSUMER_REPLICATION)
+    {
+        if (PQstatus(m->conn) == CONNECTION_OK)
+            _pg_send_feedback(m, true);
+        _pg_ack_release(m->ack);
+    }
+
+    PQfinish(m->conn);
+    free(m->conninfo);
+    free(m->cmd);
+    free(m);
     free(*c);
     *c = NULL;
 }
 
+bool
+postgres_consumer_validate(config_setting_t *config)
+{
+    const char *host = NULL, *mode = "export", *conf = NULL;
+    int threads = 0;
+    bool ret = true;
+
+    if(!CONF_L_IS_STRING(config, "host", &host, "require host string!"))
+        ret = false;
+    if(!CONF_L_IS_INT(config, "threads", &threads, "require a threads integer"))
+        ret = false;
+    if(!ret)
+        goto error;
+
+    if(strchr(host, ',') || strchr(host, ';') || threads != 1) {
+        fprintf(stderr, "%s %d: postgres consumer takes exactly one host "
+            "and one thread!\n", __FILE__, __LINE__);
+        ret = false;
+    }
+
+    config_setting_lookup_string(config, "mode", &mode);
+    if(strcmp(mode, "export") == 0) {
+        if(config_setting_lookup_string(config, "query", &conf) != CONFIG_TRUE
+            && !CONF_L_IS_STRING(config, "topic", &conf,
+                "export needs a query or a table (topic)!"))
+            ret = false;
+        if(config_setting_lookup_string(config, "format", &conf) == CONFIG_TRUE
+            && strcmp(conf, "json") != 0 && strcmp(conf, "csv") != 0
+            && strcmp(conf, "binary") != 0) {
+            fprintf(stderr, "%s %d: unknown format %s\n",
+                __FILE__, __LINE__, conf);
+            ret = false;
+        }
+    } else if(strcmp(mode, "replication") == 0) {
+        if(!CONF_L_IS_STRING(config, "slot", &conf,
+            "replication needs a slot!"))
+            ret = false;
+        else if(strspn(conf, "abcdefghijklmnopqrstuvwxyz0123456789_")
+            != strlen(conf)) {
+            fprintf(stderr, "%s %d: invalid slot name %s\n",
+                __FILE__, __LINE__, conf);
+            ret = false;
+        }
+        if(config_setting_lookup_string(config, "start_lsn", &conf)
+            == CONFIG_TRUE) {
+            unsigned int hi, lo;
+            char c;
+            if(sscanf(conf, "%X/%X%c", &hi, &lo, &c) != 2) {
+                fprintf(stderr, "%s %d: invalid start_lsn %s\n",
+                    __FILE__, __LINE__, conf);
+                ret = false;
+            }
+        }
+        config_setting_t *options = config_setting_get_member(config, "options");
+        if(options && !config_setting_is_group(options)) {
+            fprintf(stderr, "%s %d: replication options must be a group!\n",
+                __FILE__, __LINE__);
+            ret = false;
+        }
+        for(int i = 0; options && i < config_setting_length(options); i++) {
+            if(!config_setting_get_string(config_setting_get_elem(options, i))) {
+                fprintf(stderr, "%s %d: replication options must be strings!\n",
+                    __FILE__, __LINE__);
+                ret = false;
+            }
+        }
+    } else {
+        fprintf(stderr, "%s %d: unknown postgres consumer mode %s\n",
+            __FILE__, __LINE__, mode);
+        ret = false;
+    }
+
+    error:
+    return ret;
+}
+
+static bool
+_route_validate(config_setting_t *config, const char *table)
+{
+    const char *key = NULL, *format = "json", *jpointer = NULL;
+    int tables;
+
+    config_setting_lookup_string(config, "format", &format);
+    if(strstr(table, "%k") != NULL
+        && config_setting_lookup_string(config, "table_key", &key)
+        != CONFIG_TRUE) {
+        fprintf(stderr, "%s %d: table %s needs a table_key!\n",
+            __FILE__, __LINE__, table);
+        return false;
+    }
+    if(config_setting_lookup_string(config, "table_time", &jpointer)
+        == CONFIG_TRUE && strcmp(format, "json") && strcmp(format, "typed")
+        && strcmp(format, "insert")) {
+        fprintf(stderr, "%s %d: table_time needs json messages!\n",
+            __FILE__, __LINE__);
+        return false;
+    }
+    if(config_setting_lookup_int(config, "tables", &tables) == CONFIG_TRUE
+        && tables < 1) {
+        fprintf(stderr, "%s %d: tables must be positive!\n",
+            __FILE__, __LINE__);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * _copy_settings
+ *      Instances for further hosts share the settings of the
+ *      first one (string settings and the columns group).
+ */
+static void
+_copy_settings(config_setting_t *instance, const config_setting_t *config)
+{
+    const char *keys[] = {"dbname", "user", "format",
+        "table", "table_time", "table_key", "dead_letter",
+        "upsert", "staging", "replica_ack", "freeze_like"};
+    config_setting_t *setting, *columns, *column;
+    const char *value;
+    int tables;
+
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        if (config_setting_lookup_string(config, keys[i], &value)
+            != CONFIG_TRUE)
+            continue;
+        setting = config_setting_add(instance, keys[i], CONFIG_TYPE_STRING);
+        config_setting_set_string(setting, value);
+    }
+
+    if (config_setting_lookup_int(config, "tables", &tables) == CONFIG_TRUE)
+        config_setting_set_int(
+            config_setting_add(instance, "tables", CONFIG_TYPE_INT), tables);
+    if (config_setting_lookup_int(config, "freeze", &tables) == CONFIG_TRUE)
+        config_setting_set_int(
+            config_setting_add(instance, "freeze", CONFIG_TYPE_INT), tables);
+
+    if ((columns = config_setting_get_member(config, "columns")) == NULL)
+        return;
+    setting = config_setting_add(instance, "columns", CONFIG_TYPE_GROUP);
+    for (int i = 0; i < config_setting_length(columns); i++)
+    {
+        column = config_setting_get_elem(columns, i);
+        config_setting_set_string(
+            config_setting_add(setting, config_setting_name(column),
+                CONFIG_TYPE_STRING),
+            config_setting_get_string(column));
+    }
+}
+
 bool
 postgres_validate(config_setting_t *config)
 {
     config_setting_t *parent = NULL, *instance = NULL, *setting = NULL;
-    const char *hosts = NULL, *replicas = NULL, *topic = NULL;
+    const char *hosts = NULL, *replicas = NULL, *topic = NULL,
+        *format = NULL, *table = NULL, *upsert = NULL, *staging = NULL,
+        *value = NULL;
+    char *keys;
 
     Array master = NULL,replica = NULL;
 
-    int m, r, threads;
+    int m, r, threads, freeze;
     bool ret = true;
 
     // We need the parent list, because the postgres
@@ -408,8 +1721,100 @@ postgres_validate(config_setting_t *config)
             __FILE__, __LINE__, replicas);
         ret = false;
     }
-    if(!CONF_L_IS_STRING(config, "topic", &topic, "need a topic/generation!"))
+    if(config_setting_lookup_string(config, "table", &table) == CONFIG_TRUE) {
+        config_setting_lookup_string(config, "topic", &topic);
+        if(!_route_validate(config, table))
+            ret = false;
+    } else if(!CONF_L_IS_STRING(config, "topic", &topic, "need a topic/generation!"))
+        ret = false;
+    if(config_setting_lookup_string(config, "format", &format) == CONFIG_TRUE
+        && strcmp(format, "json") && strcmp(format, "csv")
+        && strcmp(format, "binary") && strcmp(format, "typed")
+        && strcmp(format, "insert")) {
+        fprintf(stderr, "%s %d: unknown format %s!\n",
+            __FILE__, __LINE__, format);
+        ret = false;
+    }
+    if(format && !strcmp(format, "insert")) {
+#ifdef LIBPQ_HAS_PIPELINING
+        // a batch is one pipeline on one connection
+        if(replicas || r || config_setting_get_member(config, "staging")
+            || config_setting_get_member(config, "offsets")) {
+            fprintf(stderr, "%s %d: format insert takes no replica, "
+                "staging or offsets!\n", __FILE__, __LINE__);
+            ret = false;
+        }
+#else
+        fprintf(stderr, "%s %d: format insert needs libpq 14!\n",
+            __FILE__, __LINE__);
         ret = false;
+#endif
+    }
+    if((setting = config_setting_get_member(config, "columns")) != NULL) {
+        if(!config_setting_is_group(setting)) {
+            fprintf(stderr, "%s %d: columns must be a group!\n",
+                __FILE__, __LINE__);
+            ret = false;
+        }
+        for (int i = 0; ret && i < config_setting_length(setting); i++) {
+            if(config_setting_type(config_setting_get_elem(setting, i))
+                != CONFIG_TYPE_STRING) {
+                fprintf(stderr, "%s %d: column %s needs a json pointer!\n",
+                    __FILE__, __LINE__,
+                    config_setting_name(config_setting_get_elem(setting, i)));
+                ret = false;
+            }
+        }
+    }
+    config_setting_lookup_string(config, "upsert", &upsert);
+    if(config_setting_lookup_string(config, "staging", &staging) == CONFIG_TRUE
+        && upsert == NULL) {
+        fprintf(stderr, "%s %d: a staging table needs upsert!\n",
+            __FILE__, __LINE__);
+        ret = false;
+    }
+    // duplicate keys of a batch are reduced by the conflict target
+    if(upsert && (format == NULL || strcmp(format, "insert"))
+        && strcasestr(upsert, "DO UPDATE")) {
+        if((keys = _conflict_target(upsert)) == NULL) {
+            fprintf(stderr, "%s %d: upsert %s needs a conflict target "
+                "(columns)!\n", __FILE__, __LINE__, upsert);
+            ret = false;
+        }
+        free(keys);
+    }
+    if((config_setting_lookup_string(config, "shard", &value) == CONFIG_TRUE
+        || config_setting_lookup_string(config, "shard_key", &value)
+        == CONFIG_TRUE) && (table || replicas)) {
+        fprintf(stderr, "%s %d: shards take replicas from the host list "
+            "and don't route tables!\n", __FILE__, __LINE__);
+        ret = false;
+    }
+    // a target is loaded frozen by a single stream
+    if(config_setting_lookup_int(config, "freeze", &freeze) == CONFIG_TRUE
+        && (freeze < 1 || freeze > PG_FREEZE_MAX || upsert
+        || config_setting_get_member(config, "offsets")
+        || (format && !strcmp(format, "insert")) || threads != 1 || m != 1)) {
+        fprintf(stderr, "%s %d: freeze needs a number of rows from 1 to "
+            "%d, a single host and thread, no upsert, offsets or format "
+            "insert!\n", __FILE__, __LINE__, PG_FREEZE_MAX);
+        ret = false;
+    }
+    if(config_setting_lookup_string(config, "replica_ack", &value)
+        == CONFIG_TRUE && strcmp(value, "all") && strcmp(value, "primary")) {
+        fprintf(stderr, "%s %d: replica_ack must be all or primary!\n",
+            __FILE__, __LINE__);
+        ret = false;
+    }
+    // a batch's offsets cover all earlier messages of its partitions
+    if(config_setting_lookup_string(config, "offsets", &value) == CONFIG_TRUE
+        && (table || threads != 1 || m != 1
+        || config_setting_get_member(config, "shard")
+        || config_setting_get_member(config, "shard_key"))) {
+        fprintf(stderr, "%s %d: offsets need a single host and thread "
+            "and no table routing or shards!\n", __FILE__, __LINE__);
+        ret = false;
+    }
     if(!ret) goto error;
 
     if(m == 0) {
@@ -423,6 +1828,12 @@ postgres_validate(config_setting_t *config)
             __FILE__, __LINE__);
     }
 
+    // a sharded producer keeps the host list
+    if(config_setting_lookup_string(config, "shard", &value) == CONFIG_TRUE
+        || config_setting_lookup_string(config, "shard_key", &value)
+        == CONFIG_TRUE)
+        goto error;
+
     setting = config_setting_get_member(config, "host");
     config_setting_set_string(setting, array_get(master, 0));
 
@@ -444,12 +1855,16 @@ postgres_validate(config_setting_t *config)
         setting = config_setting_add(instance, "host", CONFIG_TYPE_STRING);
         config_setting_set_string(setting, array_get(master, i));
 
-        setting = config_setting_add(instance, "topic", CONFIG_TYPE_STRING);
-        config_setting_set_string(setting, topic);
+        if(topic) {
+            setting = config_setting_add(instance, "topic", CONFIG_TYPE_STRING);
+            config_setting_set_string(setting, topic);
+        }
 
         setting = config_setting_add(instance, "threads", CONFIG_TYPE_INT);
         config_setting_set_int(setting, threads);
 
+        _copy_settings(instance, config);
+
         if(r && (array_get(replica,i) != NULL)) {
             setting = config_setting_add(instance, "replica", CONFIG_TYPE_STRING);
             config_setting_set_string(setting, array_get(replica, i));
@@ -467,7 +1882,7 @@ postgres_validator_init()
 {
     Validator v = SCALLOC(1,sizeof(*v));
 
-    v->validate_consumer = postgres_validate;
+    v->validate_consumer = postgres_consumer_validate;
     v->validate_producer = postgres_validate;
     return v;
 }
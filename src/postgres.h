@@ -13,7 +13,7 @@ void postgres_producer_free(Producer *p);
 
 void postgres_producer_produce(Producer p, Message msg);
 
-Consumer postgres_consumer_init(char *host);
+Consumer postgres_consumer_init(config_setting_t *config);
 
 void postgres_consumer_free(Consumer *c);
 
@@ -260,8 +260,8 @@ queue_add(Queue q, void *data, size_t datalen, int64_t xmark, Metadata *md)
 
     if(!hooklist_run(q->postadd,newmsg->msg))
     {
-        // Bad Message is already free'd
-        metadata_free(md);
+        // Bad Message is already free'd, its metadata included
+        *md = NULL;
         message_list_free(&newmsg);
         return EBADMSG;
     }
@@ -0,0 +1,222 @@
+#include "schaufel.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
+
+#include "utils/compress.h"
+#include "utils/logger.h"
+#include "utils/scalloc.h"
+
+
+/*
+ * Frame compression
+ *
+ * Buffers are compressed as independent frames. Concatenated, they are
+ * a valid stream of the format (zcat, zstdcat and lz4cat read them, so
+ * does the file consumer), and a file cut short loses the last frame
+ * only.
+ */
+
+typedef enum {
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD,
+    COMPRESS_LZ4,
+} compress_format;
+
+static const struct {
+    const char *name;
+    const char *suffix;
+    bool        supported;
+} _formats[] = {
+#ifdef HAVE_LIBZ
+    [COMPRESS_GZIP] = {"gzip", ".gz", true},
+#else
+    [COMPRESS_GZIP] = {"gzip", ".gz", false},
+#endif
+#ifdef HAVE_LIBZSTD
+    [COMPRESS_ZSTD] = {"zstd", ".zst", true},
+#else
+    [COMPRESS_ZSTD] = {"zstd", ".zst", false},
+#endif
+#ifdef HAVE_LIBLZ4
+    [COMPRESS_LZ4]  = {"lz4",  ".lz4", true},
+#else
+    [COMPRESS_LZ4]  = {"lz4",  ".lz4", false},
+#endif
+};
+
+typedef struct Compressor {
+    compress_format fmt;
+    int             level;
+#ifdef HAVE_LIBZ
+    z_stream        z;
+#endif
+#ifdef HAVE_LIBZSTD
+    ZSTD_CCtx      *zstd;
+#endif
+} *Compressor;
+
+static int
+_compress_format(const char *name)
+{
+    for (size_t i = 0; name && i < sizeof(_formats) / sizeof(*_formats); i++)
+        if (!strcmp(name, _formats[i].name))
+            return i;
+    return -1;
+}
+
+bool
+compress_supported(const char *name)
+{
+    int fmt = _compress_format(name);
+    return fmt >= 0 && _formats[fmt].supported;
+}
+
+Compressor
+compress_init(const char *name, int level)
+{
+    Compressor c;
+    bool ok = true;
+
+    if (!compress_supported(name))
+    {
+        logger_log("%s %d: %s compression is not supported",
+            __FILE__, __LINE__, name);
+        abort();
+    }
+
+    c = SCALLOC(1, sizeof(*c));
+    c->fmt = _compress_format(name);
+    c->level = level;
+
+    switch (c->fmt)
+    {
+#ifdef HAVE_LIBZ
+        case COMPRESS_GZIP:
+            ok = deflateInit2(&c->z, level ? level : Z_DEFAULT_COMPRESSION,
+                Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+            break;
+#endif
+#ifdef HAVE_LIBZSTD
+        case COMPRESS_ZSTD:
+            ok = (c->zstd = ZSTD_createCCtx()) != NULL;
+            break;
+#endif
+        default:
+            break;
+    }
+    if (!ok)
+    {
+        logger_log("%s %d: failed to initialize %s compression",
+            __FILE__, __LINE__, name);
+        abort();
+    }
+    return c;
+}
+
+ssize_t
+compress_frame(Compressor c, const void *src, size_t len, PgCopyBuf *dst)
+{
+    switch (c->fmt)
+    {
+#ifdef HAVE_LIBZ
+        case COMPRESS_GZIP:
+        {
+            size_t bound = deflateBound(&c->z, len);
+
+            c->z.next_in = (Bytef *) src;
+            c->z.avail_in = len;
+            c->z.next_out = (Bytef *) pgcopy_buf_reserve(dst, bound);
+            c->z.avail_out = bound;
+            if (deflate(&c->z, Z_FINISH) != Z_STREAM_END)
+            {
+                logger_log("%s %d: gzip: %s", __FILE__, __LINE__,
+                    c->z.msg ? c->z.msg : "deflate failed");
+                return -1;
+            }
+            bound -= c->z.avail_out;
+            deflateReset(&c->z);
+            dst->len += bound;
+            return bound;
+        }
+#endif
+#ifdef HAVE_LIBZSTD
+        case COMPRESS_ZSTD:
+        {
+            size_t bound = ZSTD_compressBound(len);
+            size_t ret = ZSTD_compressCCtx(c->zstd,
+                pgcopy_buf_reserve(dst, bound), bound, src, len,
+                c->level ? c->level : ZSTD_CLEVEL_DEFAULT);
+
+            if (ZSTD_isError(ret))
+            {
+                logger_log("%s %d: zstd: %s", __FILE__, __LINE__,
+                    ZSTD_getErrorName(ret));
+                return -1;
+            }
+            dst->len += ret;
+            return ret;
+        }
+#endif
+#ifdef HAVE_LIBLZ4
+        case COMPRESS_LZ4:
+        {
+            LZ4F_preferences_t prefs = {.compressionLevel = c->level};
+            size_t bound = LZ4F_compressFrameBound(len, &prefs);
+            size_t ret = LZ4F_compressFrame(pgcopy_buf_reserve(dst, bound),
+                bound, src, len, &prefs);
+
+            if (LZ4F_isError(ret))
+            {
+                logger_log("%s %d: lz4: %s", __FILE__, __LINE__,
+                    LZ4F_getErrorName(ret));
+                return -1;
+            }
+            dst->len += ret;
+            return ret;
+        }
+#endif
+        default:
+            (void) src;
+            (void) len;
+            (void) dst;
+            return -1;
+    }
+}
+
+const char *
+compress_suffix(Compressor c)
+{
+    return _formats[c->fmt].suffix;
+}
+
+void
+compress_free(Compressor *c)
+{
+    switch ((*c)->fmt)
+    {
+#ifdef HAVE_LIBZ
+        case COMPRESS_GZIP:
+            deflateEnd(&(*c)->z);
+            break;
+#endif
+#ifdef HAVE_LIBZSTD
+        case COMPRESS_ZSTD:
+            ZSTD_freeCCtx((*c)->zstd);
+            break;
+#endif
+        default:
+            break;
+    }
+    free(*c);
+    *c = NULL;
+}
@@ -0,0 +1,23 @@
+#ifndef _SCHAUFEL_UTILS_COMPRESS_H
+#define _SCHAUFEL_UTILS_COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "utils/pgcopy.h"
+
+typedef struct Compressor *Compressor;
+
+/* true if schaufel was built with support for gzip, zstd or lz4 */
+bool compress_supported(const char *name);
+/* level 0 picks the default level of the format */
+Compressor compress_init(const char *name, int level);
+/* appends len bytes of src to dst as one independent frame (a gzip
+ * member, zstd or lz4 frame), returns the size of the frame */
+ssize_t compress_frame(Compressor c, const void *src, size_t len,
+    PgCopyBuf *dst);
+const char *compress_suffix(Compressor c);
+void compress_free(Compressor *c);
+
+#endif
@@ -0,0 +1,285 @@
+#include "schaufel.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
+
+#include "utils/decompress.h"
+#include "utils/logger.h"
+#include "utils/scalloc.h"
+
+
+/*
+ * Streaming decompression
+ *
+ * Compressed input is read in blocks of DECOMPRESS_IN bytes and
+ * decompressed straight into the buffer of the caller. Concatenated
+ * streams (gzip members, zstd and lz4 frames) are read one after the
+ * other, like zcat does.
+ */
+
+#define DECOMPRESS_IN (128 << 10)
+
+typedef enum {
+    DECOMPRESS_GZIP,
+    DECOMPRESS_ZSTD,
+    DECOMPRESS_LZ4,
+} decompress_format;
+
+static const struct {
+    const char   *name;
+    const uint8_t magic[4];
+    size_t        len;
+} _formats[] = {
+    [DECOMPRESS_GZIP] = {"gzip", {0x1f, 0x8b}, 2},
+    [DECOMPRESS_ZSTD] = {"zstd", {0x28, 0xb5, 0x2f, 0xfd}, 4},
+    [DECOMPRESS_LZ4]  = {"lz4",  {0x04, 0x22, 0x4d, 0x18}, 4},
+};
+
+typedef struct Decompressor {
+    int               fd;
+    decompress_format fmt;
+    char             *in;
+    size_t            pos;
+    size_t            len;
+    bool              eof;
+    bool              frame;    // in the middle of a stream
+#ifdef HAVE_LIBZ
+    z_stream          z;
+#endif
+#ifdef HAVE_LIBZSTD
+    ZSTD_DCtx        *zstd;
+#endif
+#ifdef HAVE_LIBLZ4
+    LZ4F_dctx        *lz4;
+#endif
+} *Decompressor;
+
+static bool
+_decompress_start(Decompressor d)
+{
+    switch (d->fmt)
+    {
+#ifdef HAVE_LIBZ
+        case DECOMPRESS_GZIP:
+            return inflateInit2(&d->z, 16 + MAX_WBITS) == Z_OK;
+#endif
+#ifdef HAVE_LIBZSTD
+        case DECOMPRESS_ZSTD:
+            return (d->zstd = ZSTD_createDCtx()) != NULL;
+#endif
+#ifdef HAVE_LIBLZ4
+        case DECOMPRESS_LZ4:
+            return !LZ4F_isError(LZ4F_createDecompressionContext(&d->lz4,
+                LZ4F_VERSION));
+#endif
+        default:
+            logger_log("%s %d: schaufel was built without %s support",
+                __FILE__, __LINE__, _formats[d->fmt].name);
+            return false;
+    }
+}
+
+Decompressor
+decompress_init(int fd)
+{
+    uint8_t magic[4];
+    ssize_t r;
+    Decompressor d;
+
+    // a pipe can't be peeked at, it's read as it is
+    if ((r = pread(fd, magic, sizeof(magic), 0)) <= 0)
+        return NULL;
+
+    for (size_t i = 0; i < sizeof(_formats) / sizeof(*_formats); i++)
+    {
+        if ((size_t) r < _formats[i].len
+            || memcmp(magic, _formats[i].magic, _formats[i].len) != 0)
+            continue;
+
+        d = SCALLOC(1, sizeof(*d));
+        d->fd = fd;
+        d->fmt = i;
+        d->in = SCALLOC(DECOMPRESS_IN, 1);
+        if (!_decompress_start(d))
+        {
+            logger_log("%s %d: failed to initialize %s decompression",
+                __FILE__, __LINE__, _formats[i].name);
+            abort();
+        }
+        return d;
+    }
+    return NULL;
+}
+
+/*
+ * _decompress
+ *      Decompress from the input buffer into buf.
+ *      Returns the bytes written or -1 on corrupt input.
+ */
+static ssize_t
+_decompress(Decompressor d, void *buf, size_t len)
+{
+    switch (d->fmt)
+    {
+#ifdef HAVE_LIBZ
+        case DECOMPRESS_GZIP:
+        {
+            int ret;
+
+            d->z.next_in = (Bytef *) d->in + d->pos;
+            d->z.avail_in = d->len - d->pos;
+            d->z.next_out = buf;
+            d->z.avail_out = len;
+            ret = inflate(&d->z, Z_NO_FLUSH);
+            d->pos = d->len - d->z.avail_in;
+            len -= d->z.avail_out;
+
+            if (ret == Z_STREAM_END)
+            {
+                inflateReset(&d->z);
+                d->frame = false;
+            }
+            else if (ret == Z_OK || ret == Z_BUF_ERROR)
+                d->frame = true;
+            else
+            {
+                logger_log("%s %d: gzip: %s", __FILE__, __LINE__,
+                    d->z.msg ? d->z.msg : "corrupt input");
+                return -1;
+            }
+            return len;
+        }
+#endif
+#ifdef HAVE_LIBZSTD
+        case DECOMPRESS_ZSTD:
+        {
+            ZSTD_inBuffer in = {d->in, d->len, d->pos};
+            ZSTD_outBuffer out = {buf, len, 0};
+            size_t ret = ZSTD_decompressStream(d->zstd, &out, &in);
+
+            if (ZSTD_isError(ret))
+            {
+                logger_log("%s %d: zstd: %s", __FILE__, __LINE__,
+                    ZSTD_getErrorName(ret));
+                return -1;
+            }
+            d->pos = in.pos;
+            d->frame = ret != 0;
+            return out.pos;
+        }
+#endif
+#ifdef HAVE_LIBLZ4
+        case DECOMPRESS_LZ4:
+        {
+            size_t src = d->len - d->pos;
+            size_t ret = LZ4F_decompress(d->lz4, buf, &len,
+                d->in + d->pos, &src, NULL);
+
+            if (LZ4F_isError(ret))
+            {
+                logger_log("%s %d: lz4: %s", __FILE__, __LINE__,
+                    LZ4F_getErrorName(ret));
+                return -1;
+            }
+            d->pos += src;
+            d->frame = ret != 0;
+            return len;
+        }
+#endif
+        default:
+            (void) buf;
+            (void) len;
+            return -1;
+    }
+}
+
+/*
+ * decompress_read
+ *      Returns up to len decompressed bytes, 0 at the end of the
+ *      input and -1 on errors (errno is set).
+ */
+ssize_t
+decompress_read(Decompressor d, void *buf, size_t len)
+{
+    ssize_t r;
+    size_t pos;
+
+    while (42)
+    {
+        if (d->pos == d->len && !d->eof)
+        {
+            do
+                r = read(d->fd, d->in, DECOMPRESS_IN);
+            while (r == -1 && errno == EINTR);
+            if (r < 0)
+                return -1;
+            d->eof = r == 0;
+            d->pos = 0;
+            d->len = r;
+        }
+        if (d->pos == d->len && d->eof && !d->frame)
+            return 0;
+
+        // pending output is flushed with no input left
+        pos = d->pos;
+        if ((r = _decompress(d, buf, len)) != 0)
+        {
+            if (r < 0)
+                errno = EIO;
+            return r;
+        }
+        if (d->eof && d->pos == pos)
+        {
+            logger_log("%s %d: %s: truncated input", __FILE__, __LINE__,
+                _formats[d->fmt].name);
+            return 0;
+        }
+    }
+}
+
+const char *
+decompress_name(Decompressor d)
+{
+    return _formats[d->fmt].name;
+}
+
+void
+decompress_free(Decompressor *d)
+{
+    switch ((*d)->fmt)
+    {
+#ifdef HAVE_LIBZ
+        case DECOMPRESS_GZIP:
+            inflateEnd(&(*d)->z);
+            break;
+#endif
+#ifdef HAVE_LIBZSTD
+        case DECOMPRESS_ZSTD:
+            ZSTD_freeDCtx((*d)->zstd);
+            break;
+#endif
+#ifdef HAVE_LIBLZ4
+        case DECOMPRESS_LZ4:
+            LZ4F_freeDecompressionContext((*d)->lz4);
+            break;
+#endif
+        default:
+            break;
+    }
+    free((*d)->in);
+    free(*d);
+    *d = NULL;
+}
@@ -0,0 +1,17 @@
+#ifndef _SCHAUFEL_UTILS_DECOMPRESS_H
+#define _SCHAUFEL_UTILS_DECOMPRESS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct Decompressor *Decompressor;
+
+/* detects gzip, zstd or lz4 (frame) by the magic bytes at the start of
+ * the file, returns NULL for anything else */
+Decompressor decompress_init(int fd);
+/* like read(2), but returns the decompressed stream */
+ssize_t decompress_read(Decompressor d, void *buf, size_t len);
+const char *decompress_name(Decompressor d);
+void decompress_free(Decompressor *d);
+
+#endif
@@ -216,3 +216,21 @@ Fnv32_t (*fold_init(char *name))(Fnv32_t)
     uint32_t i = _foldtypes_enum(name);
     return fold_types[i].hash;
 }
+
+/*
+ * jump_hash
+ *      Jump consistent hash (Lamping, Veach): maps a key to one of
+ *      buckets, growing buckets by one moves only 1/buckets of the keys
+ */
+int32_t jump_hash(uint64_t key, int32_t buckets)
+{
+    int64_t b = -1, j = 0;
+
+    while (j < buckets)
+    {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (b + 1) * ((double) (1LL << 31) / (double) ((key >> 33) + 1));
+    }
+    return (int32_t) b;
+}
@@ -4,6 +4,9 @@
 typedef uint32_t Fnv32_t;
 
 Fnv32_t (*fnv_init(char *name)) (void *,size_t);
+Fnv32_t fnv32a_str(void *buf, size_t len);
 Fnv32_t (*fold_init(char *name)) (Fnv32_t);
 
+int32_t jump_hash(uint64_t key, int32_t buckets);
+
 #endif
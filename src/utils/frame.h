@@ -0,0 +1,32 @@
+#ifndef _SCHAUFEL_UTILS_FRAME_H
+#define _SCHAUFEL_UTILS_FRAME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Length prefixed records: a length (big endian u32 or LEB128 varint),
+ * the payload and, optionally, the CRC32C of the payload (big endian).
+ * Records are at most FRAME_MAXLEN bytes long either way. */
+typedef enum {
+    FRAME_LINES,    // no framing, records end in a newline
+    FRAME_U32,
+    FRAME_VARINT,
+} frame_type;
+
+#define FRAME_HEADER_MAXLEN 5
+#define FRAME_CRC_LEN       4
+#define FRAME_MAXLEN        UINT32_MAX
+
+int frame_type_init(const char *name);
+
+size_t frame_header(frame_type type, size_t len, uint8_t *dst);
+ssize_t frame_parse(frame_type type, const uint8_t *src, size_t avail,
+    size_t *len);
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+void frame_crc(const void *data, size_t len, uint8_t *dst);
+bool frame_crc_check(const void *data, size_t len, const uint8_t *crc);
+
+#endif
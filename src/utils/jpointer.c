@@ -0,0 +1,647 @@
+#include "schaufel.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "utils/jpointer.h"
+#include "utils/logger.h"
+#include "utils/scalloc.h"
+
+
+/*
+ * On demand json pointers
+ *
+ * Hooks and producers usually want a handful of fields of a document,
+ * so instead of building a json-c tree, the document is scanned once
+ * and every pointer is resolved on the way, its value being a view into
+ * the document. Values no pointer leads into are skipped, but checked
+ * all the same: json-c would not take a malformed document either.
+ * Strings are searched for their closing quote 32 (AVX2) or 16 (SSE2)
+ * bytes at a time.
+ *
+ * Only values json-c would turn into the same string are taken: plain
+ * (unescaped) strings, integers, booleans and null. Anything else (a
+ * pointer to an object, array, double or escaped string, a key with
+ * escapes, odd syntax) makes jpointers_extract return false, and the
+ * caller has json-c decide.
+ */
+
+// json-c's tokener refuses deeper documents, it may as well say so
+#define JPOINTER_MAXDEPTH 30
+
+/*
+ * The pointers are compiled into a trie of their reference tokens, so
+ * /context/a and /context/b share the lookup of context, and every
+ * pointer is resolved in the same descent into the document.
+ */
+typedef struct JNode {
+    char         *key;      // unescaped
+    size_t        len;
+    long          index;    // array index, -1 if not one, -2 if empty
+    struct JNode *children;
+    int           nchildren;
+    int          *ends;     // the pointers ending at this node
+    int           nends;
+} JNode;
+
+struct JPointers {
+    int     n;
+    char  **pointers;
+    JNode   root;
+};
+
+typedef struct Scan {
+    JPointers   jp;
+    JValue     *values;
+    const char *p;
+    const char *end;
+    int         depth;
+    bool        array;      // the value is an array element
+} Scan;
+
+enum {
+    J_STRING = 1,       // ends a run of string bytes
+    J_SPACE  = 2,
+    J_DELIM  = 4,       // ends a scalar
+    J_ESCAPE = 8,       // may follow a backslash
+    J_HEX    = 16,
+};
+
+static const uint8_t _class[256] = {
+    ['"']  = J_STRING | J_ESCAPE, ['\\'] = J_STRING | J_ESCAPE,
+    ['/']  = J_ESCAPE, ['b'] = J_ESCAPE | J_HEX, ['f'] = J_ESCAPE | J_HEX,
+    ['n']  = J_ESCAPE, ['r'] = J_ESCAPE, ['t'] = J_ESCAPE, ['u'] = J_ESCAPE,
+    ['0'] = J_HEX, ['1'] = J_HEX, ['2'] = J_HEX, ['3'] = J_HEX,
+    ['4'] = J_HEX, ['5'] = J_HEX, ['6'] = J_HEX, ['7'] = J_HEX,
+    ['8'] = J_HEX, ['9'] = J_HEX, ['a'] = J_HEX, ['c'] = J_HEX,
+    ['d'] = J_HEX, ['e'] = J_HEX, ['A'] = J_HEX, ['B'] = J_HEX,
+    ['C'] = J_HEX, ['D'] = J_HEX, ['E'] = J_HEX, ['F'] = J_HEX,
+    ['}']  = J_DELIM, [']'] = J_DELIM, [','] = J_DELIM,
+    [' ']  = J_SPACE | J_DELIM, ['\t'] = J_SPACE | J_DELIM,
+    ['\n'] = J_SPACE | J_DELIM, ['\r'] = J_SPACE | J_DELIM,
+};
+
+/*
+ * _jscan
+ *      next quote or backslash, end if there is none
+ */
+static inline const char *
+_jscan(const char *p, const char *end)
+{
+#if defined(__AVX2__)
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bs = _mm256_set1_epi8('\\');
+
+    for (; p + 32 <= end; p += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                    _mm256_cmpeq_epi8(v, bs));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#elif defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bs = _mm_set1_epi8('\\');
+
+    for (; p + 16 <= end; p += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                 _mm_cmpeq_epi8(v, bs));
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; p < end; p++)
+        if (_class[(uint8_t) *p] & J_STRING)
+            return p;
+    return end;
+}
+
+/*
+ * _string_end
+ *      closing quote of the string starting behind p, NULL if there
+ *      is none or an escape is invalid
+ */
+static const char *
+_string_end(const char *p, const char *end, bool *escaped)
+{
+    *escaped = false;
+    while ((p = _jscan(p, end)) < end && *p == '\\')
+    {
+        *escaped = true;
+        if (++p == end || !(_class[(uint8_t) *p] & J_ESCAPE))
+            return NULL;
+        if (*p++ == 'u')
+        {
+            if (end - p < 4)
+                return NULL;
+            for (int i = 0; i < 4; i++)
+                if (!(_class[(uint8_t) *p++] & J_HEX))
+                    return NULL;
+        }
+    }
+    return p < end ? p : NULL;
+}
+
+// the next byte which is not white space, 0 at the end
+static inline char
+_ws(Scan *s)
+{
+    while (s->p < s->end && _class[(uint8_t) *s->p] & J_SPACE)
+        s->p++;
+    return s->p < s->end ? *s->p : '\0';
+}
+
+static inline bool
+_delim(Scan *s, const char *p)
+{
+    return p == s->end || _class[(uint8_t) *p] & J_DELIM;
+}
+
+static inline const char *
+_digits(const char *p, const char *end)
+{
+    while (p < end && *p >= '0' && *p <= '9')
+        p++;
+    return p;
+}
+
+/*
+ * _skip_scalar
+ *      skip a string, literal or number (of any kind), if it is valid
+ *      json
+ */
+static bool
+_skip_scalar(Scan *s)
+{
+    const char *p = s->p, *q;
+    bool escaped;
+
+    switch (*p)
+    {
+        case '"':
+            if ((p = _string_end(p + 1, s->end, &escaped)) == NULL)
+                return false;
+            s->p = p + 1;
+            return true;
+        case 't':
+            if (s->end - p < 4 || memcmp(p, "true", 4))
+                return false;
+            p += 4;
+            break;
+        case 'f':
+            if (s->end - p < 5 || memcmp(p, "false", 5))
+                return false;
+            p += 5;
+            break;
+        case 'n':
+            if (s->end - p < 4 || memcmp(p, "null", 4))
+                return false;
+            p += 4;
+            break;
+        default:
+            // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+            if (*p == '-')
+                p++;
+            if ((q = _digits(p, s->end)) == p || (*p == '0' && q > p + 1))
+                return false;
+            p = q;
+            if (p < s->end && *p == '.')
+            {
+                if ((q = _digits(p + 1, s->end)) == p + 1)
+                    return false;
+                p = q;
+            }
+            if (p < s->end && (*p == 'e' || *p == 'E'))
+            {
+                if (++p < s->end && (*p == '+' || *p == '-'))
+                    p++;
+                if ((q = _digits(p, s->end)) == p)
+                    return false;
+                p = q;
+            }
+    }
+    if (!_delim(s, p))
+        return false;
+    s->p = p;
+    return true;
+}
+
+// a scalar json-c would print as it is written
+static bool
+_scalar(Scan *s, JValue *v)
+{
+    const char *p = s->p;
+    bool escaped;
+
+    v->found = true;
+    v->data = p;
+    switch (*p)
+    {
+        case '"':
+            if ((p = _string_end(p + 1, s->end, &escaped)) == NULL
+                || escaped)
+                return false;
+            v->data++;
+            v->len = p - v->data;
+            s->p = p + 1;
+            return true;
+        case 't':
+            v->len = 4;
+            if (s->end - p < 4 || memcmp(p, "true", 4))
+                return false;
+            break;
+        case 'f':
+            v->len = 5;
+            if (s->end - p < 5 || memcmp(p, "false", 5))
+                return false;
+            break;
+        case 'n':
+            v->len = 4;
+            if (s->end - p < 4 || memcmp(p, "null", 4))
+                return false;
+            // json-c holds a null element, but doesn't find it
+            v->found = !s->array;
+            v->data = NULL;
+            break;
+        default:
+            // integers of int64 range, no -0 and no leading zeros
+            if (*p == '-')
+                p++;
+            if (p == s->end || *p < '0' || *p > '9'
+                || (*p == '0' && (p > s->p || !_delim(s, p + 1))))
+                return false;
+            while (p < s->end && *p >= '0' && *p <= '9')
+                p++;
+            v->len = p - s->p;
+            if (v->len > 18 + (size_t) (*s->p == '-'))
+                return false;
+            break;
+    }
+    if (!_delim(s, s->p + v->len))
+        return false;
+    s->p += v->len;
+    return true;
+}
+
+static bool _value(Scan *s, JNode *node);
+
+// duplicate keys: forget what an earlier one found
+static void
+_forget(Scan *s, JNode *node)
+{
+    for (int i = 0; i < node->nends; i++)
+        memset(&s->values[node->ends[i]], 0, sizeof(JValue));
+    for (int i = 0; i < node->nchildren; i++)
+        _forget(s, &node->children[i]);
+}
+
+static bool
+_object(Scan *s, JNode *node)
+{
+    JNode *child;
+    const char *key, *q;
+    size_t len;
+    bool escaped;
+
+    if (++s->depth > JPOINTER_MAXDEPTH)
+        return false;
+    s->p++;
+    if (_ws(s) == '}')
+        goto done;
+
+    for (;;)
+    {
+        if (_ws(s) != '"'
+            || (q = _string_end(s->p + 1, s->end, &escaped)) == NULL
+            || escaped)
+            return false;
+        key = s->p + 1;
+        len = q - key;
+        s->p = q + 1;
+        if (_ws(s) != ':')
+            return false;
+        s->p++;
+
+        // the last of duplicate keys wins, as in json-c
+        child = NULL;
+        for (int i = 0; node && i < node->nchildren; i++)
+        {
+            if (node->children[i].len == len
+                && memcmp(node->children[i].key, key, len) == 0)
+            {
+                child = &node->children[i];
+                _forget(s, child);
+                break;
+            }
+        }
+        s->array = false;
+        if (!_value(s, child))
+            return false;
+
+        if (_ws(s) == '}')
+            break;
+        if (*s->p != ',')
+            return false;
+        s->p++;
+    }
+
+    done:
+    s->p++;
+    s->depth--;
+    return true;
+}
+
+static bool
+_array(Scan *s, JNode *node)
+{
+    JNode *child;
+
+    if (++s->depth > JPOINTER_MAXDEPTH)
+        return false;
+    s->p++;
+    if (_ws(s) == ']')
+        goto done;
+
+    for (int i = 0; node && i < node->nchildren; i++)
+        if (node->children[i].index == -2)
+            return false;
+
+    for (long index = 0;; index++)
+    {
+        child = NULL;
+        for (int i = 0; node && i < node->nchildren; i++)
+            if (node->children[i].index == index)
+                child = &node->children[i];
+        s->array = true;
+        if (!_value(s, child))
+            return false;
+
+        if (_ws(s) == ']')
+            break;
+        if (*s->p != ',')
+            return false;
+        s->p++;
+    }
+
+    done:
+    s->p++;
+    s->depth--;
+    return true;
+}
+
+/*
+ * _value
+ *      Resolve the pointers at this value: those ending at the node
+ *      take it, its children lead into it. Without a node the value
+ *      is only checked.
+ */
+static bool
+_value(Scan *s, JNode *node)
+{
+    JValue v;
+    char c = _ws(s);
+
+    if (c == '{' || c == '[')
+    {
+        // objects and arrays as strings are json-c's business
+        if (node && node->nends)
+            return false;
+        return c == '{' ? _object(s, node) : _array(s, node);
+    }
+    if (c == '\0')
+        return false;
+    if (!node || node->nends == 0)
+        return _skip_scalar(s);
+
+    if (!_scalar(s, &v))
+        return false;
+    for (int i = 0; i < node->nends; i++)
+        s->values[node->ends[i]] = v;
+    return true;
+}
+
+/*
+ * _segment
+ *      a reference token of a pointer: ~1 and ~0 are unescaped, array
+ *      indexes are digits without leading zeros (as json-c has it)
+ */
+static void
+_segment(JNode *node, const char *token, size_t len)
+{
+    size_t i, n = 0;
+
+    node->key = SCALLOC(len + 1, 1);
+    for (i = 0; i < len; i++)
+    {
+        if (token[i] == '~' && i + 1 < len
+            && (token[i + 1] == '0' || token[i + 1] == '1'))
+            node->key[n++] = token[++i] == '1' ? '/' : '~';
+        else
+            node->key[n++] = token[i];
+    }
+    node->len = n;
+
+    // json-c takes an empty token for some index
+    node->index = len ? -1 : -2;
+    if (len == 0 || len > 18 || (len > 1 && token[0] == '0'))
+        return;
+    for (i = 0; i < len; i++)
+        if (token[i] < '0' || token[i] > '9')
+            return;
+    node->index = strtol(token, NULL, 10);
+}
+
+// the child of node for a token, added if there is none
+static JNode *
+_child(JNode *node, const char *token, size_t len)
+{
+    JNode seg;
+
+    _segment(&seg, token, len);
+    for (int i = 0; i < node->nchildren; i++)
+    {
+        if (node->children[i].len == seg.len
+            && memcmp(node->children[i].key, seg.key, seg.len) == 0)
+        {
+            free(seg.key);
+            return &node->children[i];
+        }
+    }
+
+    node->children = realloc(node->children,
+        (node->nchildren + 1) * sizeof(JNode));
+    if (!node->children)
+    {
+        logger_log("%s %d: Failed to allocate memory", __FILE__, __LINE__);
+        abort();
+    }
+    node = &node->children[node->nchildren++];
+    memset(node, 0, sizeof(*node));
+    node->key = seg.key;
+    node->len = seg.len;
+    node->index = seg.index;
+    return node;
+}
+
+/*
+ * jpointers_init
+ *      Compile the pointers into a trie of their reference tokens. An
+ *      invalid pointer (not starting with /) is never found, the empty
+ *      one (the whole document) is left to json-c.
+ */
+JPointers
+jpointers_init(char *const *pointers, int n)
+{
+    JPointers jp = SCALLOC(1, sizeof(*jp));
+
+    jp->n = n;
+    jp->pointers = SCALLOC(n, sizeof(*jp->pointers));
+
+    for (int i = 0; i < n; i++)
+    {
+        const char *p = pointers[i], *q;
+        JNode *node = &jp->root;
+
+        jp->pointers[i] = strdup(p);
+        if (!jp->pointers[i])
+        {
+            logger_log("%s %d: Failed to strdup", __FILE__, __LINE__);
+            abort();
+        }
+        if (*p && *p != '/')
+            continue;
+        for (; *p; p = q)
+        {
+            q = strchrnul(++p, '/');
+            node = _child(node, p, q - p);
+        }
+        node->ends = realloc(node->ends, (node->nends + 1) * sizeof(int));
+        if (!node->ends)
+        {
+            logger_log("%s %d: Failed to allocate memory", __FILE__, __LINE__);
+            abort();
+        }
+        node->ends[node->nends++] = i;
+    }
+    return jp;
+}
+
+/*
+ * jpointers_extract
+ *      Resolve all pointers in one pass over the document.
+ *      Returns false if json-c has to do it.
+ */
+bool
+jpointers_extract(JPointers jp, const char *doc, size_t len, JValue *values)
+{
+    Scan s = {.jp = jp, .values = values, .p = doc, .end = doc + len};
+    char c = _ws(&s);
+
+    memset(values, 0, jp->n * sizeof(*values));
+
+    // a document of null would be no document to json-c
+    if ((c != '{' && c != '[') || !_value(&s, &jp->root))
+        return false;
+    // trailing bytes are json-c's business
+    return _ws(&s) == '\0' && s.p == s.end;
+}
+
+// json_pointer_get on every pointer of a subtree
+static void
+_jpointer_get(JPointers jp, json_object *doc, JNode *node, JValue *values)
+{
+    json_object *found;
+
+    for (int i = 0; i < node->nends; i++)
+    {
+        JValue *v = &values[node->ends[i]];
+        found = NULL;
+        v->found = json_pointer_get(doc, jp->pointers[node->ends[i]],
+            &found) == 0;
+        v->data = json_object_get_string(found);
+        v->len = v->data ? strlen(v->data) : 0;
+    }
+    for (int i = 0; i < node->nchildren; i++)
+        _jpointer_get(jp, doc, &node->children[i], values);
+}
+
+static void
+_resolve(JPointers jp, json_object *doc, json_object *obj, JNode *node,
+    JValue *values)
+{
+    json_object *child;
+    JNode *next;
+
+    for (int i = 0; i < node->nends; i++)
+    {
+        JValue *v = &values[node->ends[i]];
+        v->found = true;
+        v->data = json_object_get_string(obj);
+        v->len = v->data ? strlen(v->data) : 0;
+    }
+
+    for (int i = 0; i < node->nchildren; i++)
+    {
+        next = &node->children[i];
+        if (json_object_is_type(obj, json_type_object))
+        {
+            if (json_object_object_get_ex(obj, next->key, &child))
+                _resolve(jp, doc, child, next, values);
+        }
+        else if (json_object_is_type(obj, json_type_array))
+        {
+            // whatever json-c makes of an empty index
+            if (next->index == -2)
+                _jpointer_get(jp, doc, next, values);
+            else if (next->index >= 0
+                && (size_t) next->index < json_object_array_length(obj)
+                && (child = json_object_array_get_idx(obj, next->index)))
+                _resolve(jp, doc, child, next, values);
+        }
+    }
+}
+
+/*
+ * jpointers_resolve
+ *      Resolve all pointers in one descent into a json-c tree.
+ *      The values point into the tree.
+ */
+void
+jpointers_resolve(JPointers jp, json_object *doc, JValue *values)
+{
+    memset(values, 0, jp->n * sizeof(*values));
+    _resolve(jp, doc, doc, &jp->root, values);
+}
+
+static void
+_node_free(JNode *node)
+{
+    for (int i = 0; i < node->nchildren; i++)
+        _node_free(&node->children[i]);
+    free(node->children);
+    free(node->ends);
+    free(node->key);
+}
+
+void
+jpointers_free(JPointers *jp)
+{
+    for (int i = 0; i < (*jp)->n; i++)
+        free((*jp)->pointers[i]);
+    free((*jp)->pointers);
+    _node_free(&(*jp)->root);
+    free(*jp);
+    *jp = NULL;
+}
@@ -0,0 +1,24 @@
+#ifndef _SCHAUFEL_UTILS_JPOINTER_H
+#define _SCHAUFEL_UTILS_JPOINTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <json-c/json.h>
+
+/* a value a json pointer found, a view into the document (or into a
+ * json-c object); data is NULL for json null */
+typedef struct JValue {
+    const char *data;
+    size_t      len;
+    bool        found;
+} JValue;
+
+typedef struct JPointers *JPointers;
+
+JPointers jpointers_init(char *const *pointers, int n);
+bool jpointers_extract(JPointers jp, const char *doc, size_t len,
+    JValue *values);
+void jpointers_resolve(JPointers jp, json_object *doc, JValue *values);
+void jpointers_free(JPointers *jp);
+
+#endif
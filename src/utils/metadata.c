@@ -23,7 +23,9 @@ mdatum_free(HTableNode* n, UNUSED void *arg)
     MDatum m = (MDatum) n;
 
     // todo: is it good to run callbacks on free?
-    if(m->type != MTYPE_FUNC)
+    if(m->type != MTYPE_FUNC && m->release)
+        m->release(m->value.ptr);
+    else if(m->type != MTYPE_FUNC)
         free(m->value.ptr);
     else // disown function pointer
         m->value.func = NULL;
@@ -192,6 +194,6 @@ metadata_free(Metadata *md)
     htable_free_items((HTable *)m);
     free(m);
 
-    md = NULL;
+    *md = NULL;
     return;
 }
@@ -32,6 +32,7 @@ typedef struct mdatum {
     Datum      value;
     uint64_t   len;
     MTypes     type;
+    void     (*release) (void *);   // frees an opaque value instead of free
 } *MDatum;
 
 
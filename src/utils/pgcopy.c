@@ -0,0 +1,221 @@
+#include "schaufel.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "utils/logger.h"
+#include "utils/pgcopy.h"
+
+
+/*
+ * COPY text encoding
+ *
+ * A message is written as a single column row of COPY text format.
+ * Backslash, tab, newline and carriage return have to be escaped,
+ * NUL can't be stored in text or jsonb at all. Neither can the json
+ * escape \u0000, which is why a backslash is looked at more closely.
+ *
+ * Payloads are mostly free of any of those bytes, so the scan for
+ * the next special byte is what matters: it runs 32 (AVX2) or 16
+ * (SSE2) bytes at a time and the runs in between are memcpy'd.
+ */
+
+static const uint8_t _special[256] = {
+    ['\0'] = 1, ['\t'] = 1, ['\n'] = 1, ['\r'] = 1, ['\\'] = 1,
+};
+
+// offset of the first byte in src which needs escaping, len if none
+static inline size_t
+_pgcopy_scan(const char *src, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i nul = _mm256_setzero_si256();
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i nl  = _mm256_set1_epi8('\n');
+    const __m256i cr  = _mm256_set1_epi8('\r');
+    const __m256i bs  = _mm256_set1_epi8('\\');
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, nul),
+                            _mm256_cmpeq_epi8(v, tab)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, nl),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr),
+                                            _mm256_cmpeq_epi8(v, bs))));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(m);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#elif defined(__SSE2__)
+    const __m128i nul = _mm_setzero_si128();
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i nl  = _mm_set1_epi8('\n');
+    const __m128i cr  = _mm_set1_epi8('\r');
+    const __m128i bs  = _mm_set1_epi8('\\');
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, nul), _mm_cmpeq_epi8(v, tab)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, nl),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                      _mm_cmpeq_epi8(v, bs))));
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(m);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; i < len; i++)
+        if (_special[(uint8_t) src[i]])
+            break;
+    return i;
+}
+
+// a trailing newline of a message (file consumer) terminates the row
+static inline size_t
+_pgcopy_chomp(const char *src, size_t len)
+{
+    if (len && src[len - 1] == '\n')
+        len--;
+    if (len && src[len - 1] == '\r')
+        len--;
+    return len;
+}
+
+static inline bool
+_pgcopy_u0000(const char *src, size_t len, size_t i)
+{
+    return len - i >= 6 && memcmp(src + i + 1, "u0000", 5) == 0;
+}
+
+/*
+ * pgcopy_text
+ *      Write len bytes of src as one row of COPY text format to dst,
+ *      which holds at least PGCOPY_TEXT_MAXLEN(len) bytes.
+ *      Returns the row length or -1 if src can't be stored.
+ */
+ssize_t
+pgcopy_text(char *dst, const char *src, size_t len)
+{
+    char  *out = dst;
+    size_t i = 0;
+
+    len = _pgcopy_chomp(src, len);
+
+    while (i < len)
+    {
+        size_t run = _pgcopy_scan(src + i, len - i);
+        memcpy(out, src + i, run);
+        out += run;
+        i += run;
+        if (i == len)
+            break;
+
+        *out++ = '\\';
+        switch (src[i])
+        {
+            case '\0':
+                return -1;
+            case '\t':
+                *out++ = 't';
+                break;
+            case '\n':
+                *out++ = 'n';
+                break;
+            case '\r':
+                *out++ = 'r';
+                break;
+            default:
+                if (_pgcopy_u0000(src, len, i))
+                    return -1;
+                *out++ = '\\';
+                // an escaped backslash never starts an escape sequence
+                if (i + 1 < len && src[i + 1] == '\\')
+                {
+                    *out++ = '\\';
+                    *out++ = '\\';
+                    i++;
+                }
+                break;
+        }
+        i++;
+    }
+    *out++ = '\n';
+    return out - dst;
+}
+
+/*
+ * pgcopy_csv
+ *      CSV rows are passed through as they are, they only get
+ *      checked for NUL and \u0000 and terminated.
+ */
+ssize_t
+pgcopy_csv(char *dst, const char *src, size_t len)
+{
+    const char *p = src;
+
+    len = _pgcopy_chomp(src, len);
+
+    if (memchr(src, '\0', len) != NULL)
+        return -1;
+    while ((p = memchr(p, '\\', len - (p - src))) != NULL)
+    {
+        if (_pgcopy_u0000(src, len, p - src))
+            return -1;
+        // skip the escaped character
+        p += 2;
+        if (p >= src + len)
+            break;
+    }
+
+    memcpy(dst, src, len);
+    dst[len] = '\n';
+    return len + 1;
+}
+
+/*
+ * pgcopy_buf_reserve
+ *      Make room for n more bytes, returns where to write them.
+ *      The buffer only ever grows, it is reused for every batch.
+ */
+char *
+pgcopy_buf_reserve(PgCopyBuf *buf, size_t n)
+{
+    if (buf->len + n > buf->size)
+    {
+        size_t size = buf->size ? buf->size : PGCOPY_FLUSH;
+        while (size < buf->len + n)
+            size *= 2;
+
+        char *data = realloc(buf->data, size);
+        if (data == NULL)
+        {
+            logger_log("%s %d: Failed to allocate COPY buffer",
+                __FILE__, __LINE__);
+            abort();
+        }
+        buf->data = data;
+        buf->size = size;
+    }
+    return buf->data + buf->len;
+}
+
+void
+pgcopy_buf_free(PgCopyBuf *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->size = 0;
+}
@@ -0,0 +1,37 @@
+#ifndef _SCHAUFEL_UTILS_PGCOPY_H
+#define _SCHAUFEL_UTILS_PGCOPY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* rows are collected in a PgCopyBuf and handed to libpq once it
+ * holds PGCOPY_FLUSH bytes (or on commit) */
+#define PGCOPY_FLUSH 65536
+
+/* worst case size of a row produced by pgcopy_text/pgcopy_csv:
+ * every byte escaped plus the row terminator */
+#define PGCOPY_TEXT_MAXLEN(len) (2 * (len) + 1)
+
+/* binary COPY framing: signature, flags and header extension length,
+ * the trailer is a field count of -1 */
+#define PGCOPY_SIGNATURE     "PGCOPY\n\377\r\n\0"
+#define PGCOPY_SIGNATURE_LEN 11
+#define PGCOPY_HEADER        PGCOPY_SIGNATURE "\0\0\0\0\0\0\0\0"
+#define PGCOPY_HEADER_LEN    19
+#define PGCOPY_TRAILER       "\377\377"
+#define PGCOPY_TRAILER_LEN   2
+
+typedef struct PgCopyBuf {
+    char   *data;
+    size_t  len;
+    size_t  size;
+} PgCopyBuf;
+
+char *pgcopy_buf_reserve(PgCopyBuf *buf, size_t n);
+void pgcopy_buf_free(PgCopyBuf *buf);
+
+ssize_t pgcopy_text(char *dst, const char *src, size_t len);
+ssize_t pgcopy_csv(char *dst, const char *src, size_t len);
+
+#endif
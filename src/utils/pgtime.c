@@ -0,0 +1,207 @@
+#include "schaufel.h"
+#include <stdint.h>
+
+#include "utils/pgtime.h"
+
+
+/*
+ * Conversion of RFC 3339 dates and timestamps (and epochs) into
+ * postgres' binary representation: days (date) or microseconds
+ * (timestamp, timestamptz) relative to 2000-01-01 UTC.
+ *
+ * Every field sits at a fixed offset, so digits are converted pairwise
+ * and validated with a single comparison per field instead of strtoul.
+ */
+
+// days before the first of a month in a common year
+static const uint16_t _ydays[13] = {
+    0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334, 365
+};
+
+// scales a fraction of n digits to microseconds
+static const uint32_t _scale[7] = {
+    1000000, 100000, 10000, 1000, 100, 10, 1
+};
+
+// epochs below are seconds, then milliseconds, then microseconds
+#define EPOCH_MILLIS 100000000000LL
+#define EPOCH_MICROS 100000000000000LL
+
+static inline bool
+_d2(const char *s, uint32_t *out)
+{
+    uint32_t a = (uint8_t) s[0] - '0', b = (uint8_t) s[1] - '0';
+    *out = a * 10 + b;
+    return (a <= 9) & (b <= 9);
+}
+
+static inline bool
+_d4(const char *s, uint32_t *out)
+{
+    uint32_t hi, lo;
+    bool ok = _d2(s, &hi) & _d2(s + 2, &lo);
+    *out = hi * 100 + lo;
+    return ok;
+}
+
+static inline bool
+_leap(uint32_t y)
+{
+    return (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+}
+
+// days since 1970-01-01 of a proleptic gregorian date
+static int64_t
+_days_from_civil(int64_t y, uint32_t m, uint32_t d)
+{
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+// YYYY-MM-DD
+static bool
+_date(const char *s, int64_t *days)
+{
+    uint32_t year, month, day, mdays;
+
+    if (!(_d4(s, &year) & _d2(s + 5, &month) & _d2(s + 8, &day))
+        || s[4] != '-' || s[7] != '-')
+        return false;
+
+    if (year == 0 || month - 1 > 11 || day == 0)
+        return false;
+    mdays = _ydays[month] - _ydays[month - 1] + (month == 2 && _leap(year));
+    if (day > mdays)
+        return false;
+
+    *days = _days_from_civil(year, month, day) - PGTIME_EPOCH_DAYS;
+    return true;
+}
+
+/*
+ * _epoch
+ *      integral seconds, milliseconds or microseconds since 1970, told
+ *      apart by magnitude: below 10^11 are seconds (up to the year
+ *      5138), below 10^14 milliseconds. Millisecond epochs before
+ *      1973-03-03 are thus taken for seconds.
+ */
+static bool
+_epoch(const char *s, size_t len, int64_t *usec)
+{
+    int64_t v = 0, abs;
+    bool neg = len && *s == '-';
+    size_t i = neg;
+
+    // 17 digits are the year 5138 in microseconds
+    if (len == i || len - i > 17)
+        return false;
+    for (; i < len; i++)
+    {
+        uint32_t d = (uint8_t) s[i] - '0';
+        if (d > 9)
+            return false;
+        v = v * 10 + d;
+    }
+    abs = v;
+    if (neg)
+        v = -v;
+
+    if (abs < EPOCH_MILLIS)
+        v *= 1000000;
+    else if (abs < EPOCH_MICROS)
+        v *= 1000;
+    *usec = v - (int64_t) PGTIME_EPOCH_DAYS * 86400 * 1000000;
+    return true;
+}
+
+/*
+ * pgtime_date
+ *      2019-11-05, or anything pgtime_timestamp takes. A timestamp keeps
+ *      its written date whatever its offset, as postgres' ::date does,
+ *      an epoch becomes its UTC date.
+ */
+bool
+pgtime_date(const char *s, size_t len, int32_t *days)
+{
+    int64_t d, usec;
+
+    if (len >= 10 && s[4] == '-')
+    {
+        if (!_date(s, &d) || (len > 10 && !pgtime_timestamp(s, len, &usec)))
+            return false;
+    }
+    else
+    {
+        if (!pgtime_timestamp(s, len, &usec))
+            return false;
+        // floor, the day before 2000-01-01 is -1
+        d = usec / 86400000000LL - (usec % 86400000000LL < 0);
+    }
+    *days = (int32_t) d;
+    return true;
+}
+
+/*
+ * pgtime_timestamp
+ *      2019-11-05T11:31:34Z, 2019-11-05 11:31:34.123456+02:00
+ *      The separator is T or a space, the zone Z or an offset from UTC.
+ *      Postgres stores 6 digits after the decimal point, any more are
+ *      truncated. A leap second is normalized into the next minute, as
+ *      postgres does. Plain integers are epochs (see _epoch).
+ */
+bool
+pgtime_timestamp(const char *s, size_t len, int64_t *usec)
+{
+    int64_t  days, offset = 0;
+    uint32_t hour, minute, second, micro = 0, oh, om;
+    size_t   i = 19, n;
+
+    if (len < 20 || s[4] != '-')
+        return _epoch(s, len, usec);
+
+    if (!_date(s, &days)
+        || !(s[10] == 'T' || s[10] == 't' || s[10] == ' ')
+        || !(_d2(s + 11, &hour) & _d2(s + 14, &minute)
+             & _d2(s + 17, &second))
+        || s[13] != ':' || s[16] != ':')
+        return false;
+    if (hour > 23 || minute > 59 || second > 60)
+        return false;
+
+    if (s[i] == '.')
+    {
+        for (n = 0, i++; i < len && (uint8_t) (s[i] - '0') <= 9; i++, n++)
+            if (n < 6)
+                micro = micro * 10 + (s[i] - '0');
+        if (n == 0)
+            return false;
+        micro *= _scale[n < 6 ? n : 6];
+    }
+
+    switch (len - i)
+    {
+        case 1:
+            if (s[i] != 'Z' && s[i] != 'z')
+                return false;
+            break;
+        case 6:
+            if (!(s[i] == '+' || s[i] == '-') || s[i + 3] != ':'
+                || !(_d2(s + i + 1, &oh) & _d2(s + i + 4, &om))
+                || oh > 23 || om > 59)
+                return false;
+            offset = (oh * 60 + om) * 60;
+            if (s[i] == '-')
+                offset = -offset;
+            break;
+        default:
+            return false;
+    }
+
+    *usec = ((days * 86400 + hour * 3600 + minute * 60 + second - offset)
+             * 1000000LL) + micro;
+    return true;
+}
@@ -0,0 +1,14 @@
+#ifndef _SCHAUFEL_UTILS_PGTIME_H
+#define _SCHAUFEL_UTILS_PGTIME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// days between 1970-01-01 and 2000-01-01 (postgres epoch)
+#define PGTIME_EPOCH_DAYS 10957
+
+bool pgtime_date(const char *s, size_t len, int32_t *days);
+bool pgtime_timestamp(const char *s, size_t len, int64_t *usec);
+
+#endif
@@ -0,0 +1,768 @@
+#include "schaufel.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils/endian.h"
+#include "utils/logger.h"
+#include "utils/pgtime.h"
+#include "utils/pgtypes.h"
+#include "utils/scalloc.h"
+
+
+/*
+ * Typed binary COPY
+ *
+ * The columns of the target table are read from pg_attribute on startup.
+ * Every column is fed by a json pointer (/<column name> unless configured
+ * otherwise) and encoded in the binary send format of its type, so the
+ * server doesn't need to parse text. Missing keys and json null become
+ * NULL.
+ */
+
+// type oids, see pg_type.dat
+#define BOOLOID         16
+#define INT8OID         20
+#define INT2OID         21
+#define INT4OID         23
+#define TEXTOID         25
+#define JSONOID         114
+#define FLOAT4OID       700
+#define FLOAT8OID       701
+#define TEXTARRAYOID    1009
+#define VARCHAROID      1043
+#define DATEOID         1082
+#define TIMESTAMPOID    1114
+#define TIMESTAMPTZOID  1184
+#define NUMERICOID      1700
+#define UUIDOID         2950
+#define JSONBOID        3802
+
+#define NUMERIC_POS     0x0000
+#define NUMERIC_NEG     0x4000
+#define NUMERIC_NAN     0xC000
+#define NUMERIC_DIGITS  1000    // decimal digits accepted in a numeric
+#define NUMERIC_DSCALE  0x3FFF
+
+static bool _encode_bool(json_object *val, PgCopyBuf *buf);
+static bool _encode_int2(json_object *val, PgCopyBuf *buf);
+static bool _encode_int4(json_object *val, PgCopyBuf *buf);
+static bool _encode_int8(json_object *val, PgCopyBuf *buf);
+static bool _encode_float4(json_object *val, PgCopyBuf *buf);
+static bool _encode_float8(json_object *val, PgCopyBuf *buf);
+static bool _encode_numeric(json_object *val, PgCopyBuf *buf);
+static bool _encode_text(json_object *val, PgCopyBuf *buf);
+static bool _encode_json(json_object *val, PgCopyBuf *buf);
+static bool _encode_jsonb(json_object *val, PgCopyBuf *buf);
+static bool _encode_uuid(json_object *val, PgCopyBuf *buf);
+static bool _encode_date(json_object *val, PgCopyBuf *buf);
+static bool _encode_timestamp(json_object *val, PgCopyBuf *buf);
+static bool _encode_textarray(json_object *val, PgCopyBuf *buf);
+
+static const struct {
+    Oid        type;
+    pg_encode  encode;
+} pg_types [] = {
+    {BOOLOID, &_encode_bool},
+    {INT2OID, &_encode_int2},
+    {INT4OID, &_encode_int4},
+    {INT8OID, &_encode_int8},
+    {FLOAT4OID, &_encode_float4},
+    {FLOAT8OID, &_encode_float8},
+    {NUMERICOID, &_encode_numeric},
+    {TEXTOID, &_encode_text},
+    {VARCHAROID, &_encode_text},
+    {JSONOID, &_encode_json},
+    {JSONBOID, &_encode_jsonb},
+    {UUIDOID, &_encode_uuid},
+    {DATEOID, &_encode_date},
+    {TIMESTAMPOID, &_encode_timestamp},
+    {TIMESTAMPTZOID, &_encode_timestamp},
+    {TEXTARRAYOID, &_encode_textarray},
+};
+
+pg_encode
+pgtypes_encoder(Oid type)
+{
+    for (size_t i = 0; i < sizeof(pg_types) / sizeof(pg_types[0]); i++)
+        if (pg_types[i].type == type)
+            return pg_types[i].encode;
+    return NULL;
+}
+
+static inline char *
+_put(PgCopyBuf *buf, size_t n)
+{
+    char *p = pgcopy_buf_reserve(buf, n);
+    buf->len += n;
+    return p;
+}
+
+static inline void
+_put16(PgCopyBuf *buf, uint16_t v)
+{
+    v = htons(v);
+    memcpy(_put(buf, 2), &v, 2);
+}
+
+static inline void
+_put32(PgCopyBuf *buf, uint32_t v)
+{
+    v = htonl(v);
+    memcpy(_put(buf, 4), &v, 4);
+}
+
+static inline void
+_put64(PgCopyBuf *buf, uint64_t v)
+{
+    v = htobe64(v);
+    memcpy(_put(buf, 8), &v, 8);
+}
+
+static inline void
+_put_field(PgCopyBuf *buf, const void *data, uint32_t len)
+{
+    _put32(buf, len);
+    memcpy(_put(buf, len), data, len);
+}
+
+// integers are taken from json numbers or strings holding one
+static bool
+_json_int(json_object *val, int64_t min, int64_t max, int64_t *res)
+{
+    const char *s;
+    char *end;
+
+    switch (json_object_get_type(val))
+    {
+        case json_type_int:
+            errno = 0;
+            *res = json_object_get_int64(val);
+            if (errno)
+                return false;
+            break;
+        case json_type_string:
+            s = json_object_get_string(val);
+            errno = 0;
+            *res = strtoll(s, &end, 10);
+            if (errno || end == s || *end != '\0')
+                return false;
+            break;
+        default:
+            return false;
+    }
+    return *res >= min && *res <= max;
+}
+
+static bool
+_json_double(json_object *val, double *res)
+{
+    const char *s;
+    char *end;
+
+    switch (json_object_get_type(val))
+    {
+        case json_type_int:
+        case json_type_double:
+            *res = json_object_get_double(val);
+            return true;
+        case json_type_string:
+            s = json_object_get_string(val);
+            *res = strtod(s, &end);
+            return end != s && *end == '\0';
+        default:
+            return false;
+    }
+}
+
+// strings are stored as they are, anything else as json
+static const char *
+_json_text(json_object *val, size_t *len)
+{
+    const char *s;
+
+    if (json_object_get_type(val) == json_type_string)
+    {
+        s = json_object_get_string(val);
+        *len = json_object_get_string_len(val);
+        // \u0000 decodes to NUL, which text can't store
+        if (memchr(s, '\0', *len) != NULL)
+            return NULL;
+        return s;
+    }
+
+    s = json_object_to_json_string_ext(val, JSON_C_TO_STRING_PLAIN);
+    *len = strlen(s);
+    return s;
+}
+
+static bool
+_encode_bool(json_object *val, PgCopyBuf *buf)
+{
+    const char *s;
+    char b;
+
+    switch (json_object_get_type(val))
+    {
+        case json_type_boolean:
+            b = json_object_get_boolean(val) ? 1 : 0;
+            break;
+        case json_type_string:
+            s = json_object_get_string(val);
+            if (!strcmp(s, "true") || !strcmp(s, "t"))
+                b = 1;
+            else if (!strcmp(s, "false") || !strcmp(s, "f"))
+                b = 0;
+            else
+                return false;
+            break;
+        default:
+            return false;
+    }
+    _put_field(buf, &b, 1);
+    return true;
+}
+
+static bool
+_encode_int2(json_object *val, PgCopyBuf *buf)
+{
+    int64_t v;
+    if (!_json_int(val, INT16_MIN, INT16_MAX, &v))
+        return false;
+    _put32(buf, 2);
+    _put16(buf, (uint16_t) v);
+    return true;
+}
+
+static bool
+_encode_int4(json_object *val, PgCopyBuf *buf)
+{
+    int64_t v;
+    if (!_json_int(val, INT32_MIN, INT32_MAX, &v))
+        return false;
+    _put32(buf, 4);
+    _put32(buf, (uint32_t) v);
+    return true;
+}
+
+static bool
+_encode_int8(json_object *val, PgCopyBuf *buf)
+{
+    int64_t v;
+    if (!_json_int(val, INT64_MIN, INT64_MAX, &v))
+        return false;
+    _put32(buf, 8);
+    _put64(buf, (uint64_t) v);
+    return true;
+}
+
+static bool
+_encode_float4(json_object *val, PgCopyBuf *buf)
+{
+    double d;
+    float f;
+    uint32_t v;
+
+    if (!_json_double(val, &d))
+        return false;
+    f = (float) d;
+    memcpy(&v, &f, 4);
+    _put32(buf, 4);
+    _put32(buf, v);
+    return true;
+}
+
+static bool
+_encode_float8(json_object *val, PgCopyBuf *buf)
+{
+    double d;
+    uint64_t v;
+
+    if (!_json_double(val, &d))
+        return false;
+    memcpy(&v, &d, 8);
+    _put32(buf, 8);
+    _put64(buf, v);
+    return true;
+}
+
+static inline int
+_floordiv4(int n)
+{
+    return n >= 0 ? n / 4 : -((-n + 3) / 4);
+}
+
+/*
+ * _encode_numeric
+ *      The decimal representation (json number or string, with optional
+ *      exponent) is regrouped into base 10000 digits aligned on the
+ *      decimal point: ndigits, weight of the first digit, sign, display
+ *      scale, digits. The json number is used as written, so no
+ *      precision is lost to a double.
+ */
+static bool
+_encode_numeric(json_object *val, PgCopyBuf *buf)
+{
+    static const uint16_t pow10[4] = {1, 10, 100, 1000};
+    uint8_t  d[NUMERIC_DIGITS];
+    uint16_t groups[NUMERIC_DIGITS / 4 + 2] = {0};
+    int      nd = 0, point = -1, first = -1, last = -1;
+    int      weight = 0, ndigits = 0, dscale;
+    uint16_t sign = NUMERIC_POS;
+    const char *s;
+    long     exp = 0;
+
+    switch (json_object_get_type(val))
+    {
+        case json_type_int:
+        case json_type_double:
+        case json_type_string:
+            s = json_object_get_string(val);
+            break;
+        default:
+            return false;
+    }
+
+    if (!strcmp(s, "NaN"))
+    {
+        _put32(buf, 8);
+        _put16(buf, 0);
+        _put16(buf, 0);
+        _put16(buf, NUMERIC_NAN);
+        _put16(buf, 0);
+        return true;
+    }
+
+    if (*s == '-' || *s == '+')
+        sign = *s++ == '-' ? NUMERIC_NEG : NUMERIC_POS;
+
+    for (; *s; s++)
+    {
+        if (*s >= '0' && *s <= '9')
+        {
+            if (nd == NUMERIC_DIGITS)
+                return false;
+            d[nd++] = *s - '0';
+        }
+        else if (*s == '.' && point < 0)
+            point = nd;
+        else
+            break;
+    }
+    if (nd == 0)
+        return false;
+    if (point < 0)
+        point = nd;
+
+    if (*s == 'e' || *s == 'E')
+    {
+        char *end;
+        errno = 0;
+        exp = strtol(s + 1, &end, 10);
+        if (errno || end == s + 1 || exp > NUMERIC_DIGITS
+            || exp < -NUMERIC_DIGITS)
+            return false;
+        s = end;
+    }
+    if (*s != '\0')
+        return false;
+
+    point += exp;
+    dscale = nd - point > 0 ? nd - point : 0;
+    if (dscale > NUMERIC_DSCALE)
+        return false;
+
+    for (int i = 0; i < nd; i++)
+        if (d[i])
+        {
+            if (first < 0)
+                first = i;
+            last = i;
+        }
+
+    if (first < 0)
+        sign = NUMERIC_POS;     // zero
+    else
+    {
+        // digit i has the decimal position point - 1 - i
+        weight = _floordiv4(point - 1 - first);
+        ndigits = weight - _floordiv4(point - 1 - last) + 1;
+        for (int i = first; i <= last; i++)
+        {
+            int p = point - 1 - i;
+            int g = _floordiv4(p);
+            groups[weight - g] += d[i] * pow10[p - 4 * g];
+        }
+    }
+
+    _put32(buf, 8 + 2 * ndigits);
+    _put16(buf, (uint16_t) ndigits);
+    _put16(buf, (uint16_t) weight);
+    _put16(buf, sign);
+    _put16(buf, (uint16_t) dscale);
+    for (int i = 0; i < ndigits; i++)
+        _put16(buf, groups[i]);
+    return true;
+}
+
+static bool
+_encode_text(json_object *val, PgCopyBuf *buf)
+{
+    size_t len;
+    const char *s = _json_text(val, &len);
+
+    if (s == NULL)
+        return false;
+    _put_field(buf, s, len);
+    return true;
+}
+
+static bool
+_encode_json(json_object *val, PgCopyBuf *buf)
+{
+    const char *s = json_object_to_json_string_ext(val, JSON_C_TO_STRING_PLAIN);
+    _put_field(buf, s, strlen(s));
+    return true;
+}
+
+static bool
+_encode_jsonb(json_object *val, PgCopyBuf *buf)
+{
+    const char *s = json_object_to_json_string_ext(val, JSON_C_TO_STRING_PLAIN);
+    size_t len = strlen(s);
+
+    // jsonb can't store \u0000
+    if (strstr(s, "\\u0000") != NULL)
+        return false;
+
+    _put32(buf, len + 1);
+    *_put(buf, 1) = 1;  // jsonb version
+    memcpy(_put(buf, len), s, len);
+    return true;
+}
+
+static inline int
+_hex(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// 8-4-4-4-12 or 32 hex digits
+static bool
+_encode_uuid(json_object *val, PgCopyBuf *buf)
+{
+    uint8_t uuid[16];
+    const char *s;
+    size_t len;
+    bool dashed;
+    int n = 0;
+
+    if (json_object_get_type(val) != json_type_string)
+        return false;
+    s = json_object_get_string(val);
+    len = json_object_get_string_len(val);
+    if (len != 32 && len != 36)
+        return false;
+    dashed = len == 36;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        int h;
+        if (dashed && (i == 8 || i == 13 || i == 18 || i == 23))
+        {
+            if (s[i] != '-')
+                return false;
+            continue;
+        }
+        if ((h = _hex(s[i])) < 0)
+            return false;
+        if (n % 2)
+            uuid[n / 2] |= h;
+        else
+            uuid[n / 2] = h << 4;
+        n++;
+    }
+
+    _put_field(buf, uuid, 16);
+    return true;
+}
+
+// json-c only knows the length of strings
+static inline size_t
+_strlen(json_object *val)
+{
+    if (json_object_get_type(val) == json_type_string)
+        return json_object_get_string_len(val);
+    return strlen(json_object_get_string(val));
+}
+
+static bool
+_encode_date(json_object *val, PgCopyBuf *buf)
+{
+    int32_t days;
+
+    // integers are epochs
+    if (json_object_get_type(val) != json_type_string
+        && json_object_get_type(val) != json_type_int)
+        return false;
+    if (!pgtime_date(json_object_get_string(val), _strlen(val), &days))
+        return false;
+
+    _put32(buf, 4);
+    _put32(buf, (uint32_t) days);
+    return true;
+}
+
+static bool
+_encode_timestamp(json_object *val, PgCopyBuf *buf)
+{
+    int64_t usec;
+
+    // integers are epochs
+    if (json_object_get_type(val) != json_type_string
+        && json_object_get_type(val) != json_type_int)
+        return false;
+    if (!pgtime_timestamp(json_object_get_string(val), _strlen(val), &usec))
+        return false;
+
+    _put32(buf, 8);
+    _put64(buf, (uint64_t) usec);
+    return true;
+}
+
+/*
+ * _encode_textarray
+ *      one dimensional array: ndim, null flag, element type,
+ *      dimension, lower bound, elements
+ */
+static bool
+_encode_textarray(json_object *val, PgCopyBuf *buf)
+{
+    size_t n, start, len;
+    uint32_t hasnull = 0;
+    const char *s;
+
+    if (json_object_get_type(val) != json_type_array)
+        return false;
+    n = json_object_array_length(val);
+
+    _put32(buf, 0);     // length, patched below
+    start = buf->len;
+
+    _put32(buf, n ? 1 : 0);
+    _put32(buf, 0);
+    _put32(buf, TEXTOID);
+    if (n)
+    {
+        _put32(buf, n);
+        _put32(buf, 1);
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        json_object *elem = json_object_array_get_idx(val, i);
+        if (elem == NULL)
+        {
+            _put32(buf, (uint32_t) -1);
+            hasnull = 1;
+            continue;
+        }
+        if ((s = _json_text(elem, &len)) == NULL)
+            return false;
+        _put_field(buf, s, len);
+    }
+
+    hasnull = htonl(hasnull);
+    memcpy(buf->data + start + 4, &hasnull, 4);
+    uint32_t size = htonl((uint32_t) (buf->len - start));
+    memcpy(buf->data + start - 4, &size, 4);
+    return true;
+}
+
+/*
+ * pgtypes_table
+ *      Read the columns of a table. If columns is given (a group of
+ *      column = "json pointer"), only those columns are copied.
+ */
+PgTable
+pgtypes_table(PGconn *conn, const char *table, const config_setting_t *columns)
+{
+    const char *query =
+        "SELECT a.attname, COALESCE(NULLIF(t.typbasetype, 0), a.atttypid), "
+        "format_type(a.atttypid, a.atttypmod) "
+        "FROM pg_catalog.pg_attribute a "
+        "JOIN pg_catalog.pg_type t ON t.oid = a.atttypid "
+        "WHERE a.attrelid = $1::regclass AND a.attnum > 0 "
+        "AND NOT a.attisdropped ORDER BY a.attnum";
+    PGresult *res;
+    PgTable t;
+    int rows;
+
+    res = PQexecParams(conn, query, 1, NULL, &table, NULL, NULL, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+    {
+        logger_log("%s %d: Failed to read columns of %s: %s",
+            __FILE__, __LINE__, table, PQerrorMessage(conn));
+        abort();
+    }
+    rows = PQntuples(res);
+
+    t = SCALLOC(1, sizeof(*t));
+    t->name = strdup(table);
+    t->ncolumns = columns ? config_setting_length(columns) : rows;
+    t->columns = SCALLOC(t->ncolumns ? t->ncolumns : 1, sizeof(*t->columns));
+    if (t->ncolumns == 0)
+    {
+        logger_log("%s %d: Table %s has no columns",
+            __FILE__, __LINE__, table);
+        abort();
+    }
+
+    for (int i = 0; i < t->ncolumns; i++)
+    {
+        PgColumn *c = &t->columns[i];
+        int row = i;
+
+        if (columns)
+        {
+            config_setting_t *col = config_setting_get_elem(columns, i);
+            const char *name = config_setting_name(col);
+
+            for (row = 0; row < rows; row++)
+                if (!strcmp(PQgetvalue(res, row, 0), name))
+                    break;
+            if (row == rows)
+            {
+                logger_log("%s %d: Column %s not found in %s",
+                    __FILE__, __LINE__, name, table);
+                abort();
+            }
+            c->jpointer = strdup(config_setting_get_string(col));
+        }
+        else
+        {
+            size_t len = strlen(PQgetvalue(res, row, 0)) + 2;
+            c->jpointer = SCALLOC(len, 1);
+            snprintf(c->jpointer, len, "/%s", PQgetvalue(res, row, 0));
+        }
+
+        c->name = strdup(PQgetvalue(res, row, 0));
+        c->type = (Oid) strtoul(PQgetvalue(res, row, 1), NULL, 10);
+        c->encode = pgtypes_encoder(c->type);
+        if (c->encode == NULL)
+        {
+            logger_log("%s %d: Column %s of %s has unsupported type %s",
+                __FILE__, __LINE__, c->name, table, PQgetvalue(res, row, 2));
+            abort();
+        }
+    }
+
+    PQclear(res);
+    return t;
+}
+
+/*
+ * pgtypes_columns
+ *      The quoted column list of the COPY: "a", "b"
+ */
+char *
+pgtypes_columns(PGconn *conn, PgTable table)
+{
+    size_t len = 0, size = 64;
+    char *cols = SCALLOC(size, 1);
+
+    for (int i = 0; i < table->ncolumns; i++)
+    {
+        char *ident = PQescapeIdentifier(conn, table->columns[i].name,
+            strlen(table->columns[i].name));
+        if (ident == NULL)
+        {
+            logger_log("%s %d: %s", __FILE__, __LINE__, PQerrorMessage(conn));
+            abort();
+        }
+        while (len + strlen(ident) + 3 > size)
+        {
+            size *= 2;
+            cols = realloc(cols, size);
+            if (cols == NULL)
+            {
+                logger_log("%s %d: Failed to allocate", __FILE__, __LINE__);
+                abort();
+            }
+        }
+        len += snprintf(cols + len, size - len, "%s%s", i ? ", " : "", ident);
+        PQfreemem(ident);
+    }
+
+    return cols;
+}
+
+/*
+ * pgtypes_row
+ *      Append a json document as binary COPY row. On failure
+ *      the buffer is left as it was.
+ */
+bool
+pgtypes_row(PgTable table, const char *data, PgCopyBuf *buf)
+{
+    json_object *root, *found;
+    size_t start = buf->len;
+
+    root = json_tokener_parse(data);
+    if (root == NULL)
+    {
+        logger_log("%s %d: Failed to tokenize json!", __FILE__, __LINE__);
+        return false;
+    }
+
+    _put16(buf, (uint16_t) table->ncolumns);
+    for (int i = 0; i < table->ncolumns; i++)
+    {
+        PgColumn *c = &table->columns[i];
+
+        found = NULL;
+        if (json_pointer_get(root, c->jpointer, &found) != 0
+            || found == NULL)
+        {
+            _put32(buf, (uint32_t) -1);
+            continue;
+        }
+        if (!c->encode(found, buf))
+        {
+            logger_log("%s %d: Column %s: can't encode %s",
+                __FILE__, __LINE__, c->name,
+                json_object_to_json_string_ext(found, JSON_C_TO_STRING_PLAIN));
+            buf->len = start;
+            json_object_put(root);
+            return false;
+        }
+    }
+
+    json_object_put(root);
+    return true;
+}
+
+void
+pgtypes_table_free(PgTable *table)
+{
+    if (*table == NULL)
+        return;
+
+    for (int i = 0; i < (*table)->ncolumns; i++)
+    {
+        free((*table)->columns[i].name);
+        free((*table)->columns[i].jpointer);
+    }
+    free((*table)->columns);
+    free((*table)->name);
+    free(*table);
+    *table = NULL;
+}
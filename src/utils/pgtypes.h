@@ -0,0 +1,36 @@
+#ifndef _SCHAUFEL_UTILS_PGTYPES_H
+#define _SCHAUFEL_UTILS_PGTYPES_H
+
+#include <json-c/json.h>
+#include <libconfig.h>
+#include <libpq-fe.h>
+#include <stdbool.h>
+
+#include "utils/pgcopy.h"
+
+/* encodes a json value as one field of a binary COPY row
+ * (length word and data), returns false if it doesn't fit the type */
+typedef bool (*pg_encode)(json_object *val, PgCopyBuf *buf);
+
+typedef struct PgColumn {
+    char      *name;
+    char      *jpointer;
+    Oid        type;
+    pg_encode  encode;
+} PgColumn;
+
+typedef struct PgTable {
+    char      *name;
+    PgColumn  *columns;
+    int        ncolumns;
+} *PgTable;
+
+PgTable pgtypes_table(PGconn *conn, const char *table,
+    const config_setting_t *columns);
+char *pgtypes_columns(PGconn *conn, PgTable table);
+bool pgtypes_row(PgTable table, const char *data, PgCopyBuf *buf);
+void pgtypes_table_free(PgTable *table);
+
+pg_encode pgtypes_encoder(Oid type);
+
+#endif
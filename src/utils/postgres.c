@@ -1,4 +1,12 @@
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
 #ifdef __linux__
 #include <sys/prctl.h>
@@ -6,22 +14,1199 @@
 
 #include "utils/logger.h"
 #include "utils/postgres.h"
+#include "utils/scalloc.h"
 
 
+#define PG_BACKOFF_MAX 32     // seconds
+
+// sleeps for the current backoff, then doubles it
+static void
+_backoff(unsigned *backoff)
+{
+    sleep(*backoff);
+    *backoff = *backoff < PG_BACKOFF_MAX ? *backoff * 2 : PG_BACKOFF_MAX;
+}
+
+/*
+ * pg_connect
+ *      Connect, retrying with exponential backoff until the server
+ *      can be reached.
+ */
+PGconn *
+pg_connect(const char *conninfo)
+{
+    unsigned backoff = 1;
+    PGconn *conn = PQconnectdb(conninfo);
+
+    while (PQstatus(conn) != CONNECTION_OK)
+    {
+        logger_log("%s %d: %s(retrying in %us)", __FILE__, __LINE__,
+            PQerrorMessage(conn), backoff);
+        _backoff(&backoff);
+        PQreset(conn);
+    }
+    return conn;
+}
+
+static bool
+_exec(PGconn *conn, const char *sql, ExecStatusType status)
+{
+    PGresult *res = PQexec(conn, sql);
+    bool ok = PQresultStatus(res) == status;
+
+    PQclear(res);
+    return ok;
+}
+
+// leave a failed transaction, if there is one
+static void
+_rollback(PGconn *conn)
+{
+    if (PQstatus(conn) == CONNECTION_OK
+        && PQtransactionStatus(conn) != PQTRANS_IDLE)
+        PQclear(PQexec(conn, "ROLLBACK"));
+}
+
+static void _thaw(Meta m);
+
+/*
+ * _freeze
+ *      COPY FREEZE needs a target created or truncated in its transaction.
+ *      cpybegin created the target if it was missing and locked it, it is
+ *      truncated only if it holds no rows: rows committed earlier (by an
+ *      earlier run or a stream evicted before) are kept and the target
+ *      is loaded without FREEZE instead.
+ */
+static bool
+_freeze(Meta m, PGconn *conn)
+{
+    size_t n = strlen(m->target) + 32;
+    char sql[n];
+    PGresult *res;
+    bool empty;
+
+    snprintf(sql, n, "SELECT 1 FROM %s LIMIT 1", m->target);
+    res = PQexec(conn, sql);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+    {
+        PQclear(res);
+        return false;
+    }
+    empty = PQntuples(res) == 0;
+    PQclear(res);
+
+    if (empty)
+    {
+        snprintf(sql, n, "TRUNCATE %s", m->target);
+        return _exec(conn, sql, PGRES_COMMAND_OK);
+    }
+
+    logger_log("%s %d: %s holds rows, loading it without FREEZE",
+        __FILE__, __LINE__, m->target);
+    _thaw(m);
+    return _exec(conn, "ROLLBACK", PGRES_COMMAND_OK);
+}
+
+/*
+ * _copy_failed
+ *      A statement of the COPY failed: if the connection is lost, it is
+ *      to be reset. Any other error (a missing table, permissions, bad
+ *      SQL) won't go away by retrying and is fatal.
+ */
+static void
+_copy_failed(PGconn *conn)
+{
+    if (PQstatus(conn) == CONNECTION_BAD)
+        return;
+    logger_log("%s %d: %s", __FILE__, __LINE__, PQerrorMessage(conn));
+    abort();
+}
+
+/*
+ * _copy_start
+ *      Start the COPY on conn and replay `replay` bytes of data (the batch
+ *      so far). While the connection is lost, it is reset with backoff.
+ *      Meanwhile the producer blocks, the queue fills up and consumers
+ *      stall: a failover costs latency instead of data.
+ */
+static void
+_copy_start(Meta m, PGconn *conn, const char *data, size_t replay)
+{
+    unsigned backoff = 1;
+
+    while (42)
+    {
+        if (PQstatus(conn) == CONNECTION_BAD)
+        {
+            logger_log("%s %d: Connection lost, reconnecting in %us: %s",
+                __FILE__, __LINE__, backoff, PQerrorMessage(conn));
+            _backoff(&backoff);
+            PQreset(conn);
+            continue;
+        }
+
+        // a new session (or a reset one) needs its setup first
+        if (m->cpysession && m->session != PQbackendPID(conn))
+        {
+            if (!_exec(conn, m->cpysession, PGRES_COMMAND_OK))
+            {
+                _copy_failed(conn);
+                continue;
+            }
+            m->session = PQbackendPID(conn);
+        }
+
+        if (m->cpybegin && !_exec(conn, m->cpybegin, PGRES_COMMAND_OK))
+        {
+            _copy_failed(conn);
+            continue;
+        }
+
+        if (m->freeze && !_freeze(m, conn))
+        {
+            _copy_failed(conn);
+            continue;
+        }
+
+        if (!_exec(conn, m->cpycmd, PGRES_COPY_IN))
+        {
+            _copy_failed(conn);
+            continue;
+        }
+
+        if (replay && PQputCopyData(conn, data, replay) != 1)
+        {
+            _copy_failed(conn);
+            continue;
+        }
+        return;
+    }
+}
+
+/*
+ * _committed
+ *      Whether the source offsets of the batch are stored, i.e. the server
+ *      committed it although the connection was lost before it said so.
+ *      The connection is reset with backoff until the server can tell.
+ */
+static bool
+_committed(Meta m, PGconn *conn)
+{
+    unsigned backoff = 1;
+    PGresult *res;
+    bool committed;
+
+    while (42)
+    {
+        if (PQstatus(conn) == CONNECTION_BAD)
+        {
+            logger_log("%s %d: Connection lost, reconnecting in %us: %s",
+                __FILE__, __LINE__, backoff, PQerrorMessage(conn));
+            _backoff(&backoff);
+            PQreset(conn);
+            continue;
+        }
+
+        res = PQexec(conn, m->cpycommitted);
+        if (PQresultStatus(res) == PGRES_TUPLES_OK)
+        {
+            committed = strcmp(PQgetvalue(res, 0, 0), "t") == 0;
+            PQclear(res);
+            return committed;
+        }
+        PQclear(res);
+        _copy_failed(conn);
+    }
+}
+
+/*
+ * _copy_end
+ *      End the COPY on conn and check the result. Should the connection be
+ *      lost, the COPY of data is replayed on a new one, unless its stored
+ *      source offsets show it was committed. Returns false with the
+ *      server's error if the rows were rejected.
+ */
+static bool
+_copy_end(Meta m, PGconn *conn, const char *data, size_t len, char **error)
+{
+    PGresult *res;
+    bool ok;
+
+    while (42)
+    {
+        if (PQputCopyEnd(conn, NULL) == 1)
+        {
+            ok = true;
+            while ((res = PQgetResult(conn)) != NULL)
+            {
+                if (PQresultStatus(res) != PGRES_COMMAND_OK)
+                    ok = false;
+                PQclear(res);
+            }
+            if (ok && (m->cpyoffsets == NULL
+                || _exec(conn, m->cpyoffsets, PGRES_COMMAND_OK))
+                && (m->cpyend == NULL
+                || _exec(conn, m->cpyend, PGRES_COMMAND_OK)))
+                return true;
+        }
+
+        if (PQstatus(conn) != CONNECTION_BAD)
+        {
+            // first line, without CONTEXT and the like
+            *error = strndup(PQerrorMessage(conn),
+                strcspn(PQerrorMessage(conn), "\n"));
+            _rollback(conn);
+            return false;
+        }
+
+        /* The commit was not confirmed. With source offsets, the server
+         * tells whether it committed anyway. Without, the batch is
+         * replayed and rows are duplicated should it have. */
+        if (m->cpyoffsets && _committed(m, conn))
+        {
+            logger_log("%s %d: Connection lost during commit, the batch "
+                "was committed", __FILE__, __LINE__);
+            return true;
+        }
+        logger_log("%s %d: Connection lost during commit, replaying",
+            __FILE__, __LINE__);
+        _copy_start(m, conn, data, len);
+    }
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+/*
+ * Pipelined INSERTs
+ *
+ * For tables COPY doesn't suit (triggers, per row conflict handling),
+ * rows are encoded as binary COPY rows like typed ones and sent as the
+ * binary parameters of a prepared INSERT, in pipeline mode: statements
+ * are sent as rows are flushed, their results are read on commit. The
+ * statements of a batch form one implicit transaction.
+ *
+ * The connection is nonblocking. Whenever the server can't take more,
+ * the results it sent meanwhile are read into libpq's buffer, so it
+ * never blocks on sending them while we block on sending it rows.
+ */
+
+static void _dead_letter(Meta m, const char *row, size_t len,
+    const char *error);
+
+/*
+ * _insert_flush
+ *      Send what libpq buffered of the pipeline, reading input
+ *      while the socket doesn't take more
+ */
+static bool
+_insert_flush(PGconn *conn)
+{
+    struct pollfd pfd = {.fd = PQsocket(conn), .events = POLLIN | POLLOUT};
+    int ret;
+
+    while ((ret = PQflush(conn)) == 1)
+    {
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return false;
+        if ((pfd.revents & POLLIN) && !PQconsumeInput(conn))
+            return false;
+    }
+    return ret == 0;
+}
+
+/*
+ * _insert_send
+ *      Send the rows [from, to) of the batch, except those done already.
+ *      With each, every row is followed by a sync and commits on its own.
+ */
+static bool
+_insert_send(Meta m, PGconn *conn, int from, int to, const char *done,
+    bool each)
+{
+    int n = m->table->ncolumns;
+    const char *values[n];
+    int lengths[n], formats[n];
+    const char *field;
+    uint32_t len;
+
+    for (int i = from; i < to; i++)
+    {
+        if (done && done[i])
+            continue;
+
+        field = m->cpybuf.data + m->rows[i] + 2;
+        for (int c = 0; c < n; c++)
+        {
+            memcpy(&len, field, 4);
+            len = ntohl(len);
+            field += 4;
+            values[c] = len == (uint32_t) -1 ? NULL : field;
+            lengths[c] = len == (uint32_t) -1 ? 0 : (int) len;
+            formats[c] = 1;
+            field += lengths[c];
+        }
+        if (PQsendQueryPrepared(conn, "", n, values, lengths, formats, 0) != 1
+            || (each && PQpipelineSync(conn) != 1))
+            return false;
+    }
+    return _insert_flush(conn);
+}
+
+/*
+ * _insert_start
+ *      Enter pipeline mode, prepare the INSERT and send `replay` rows
+ *      of the batch. Until this succeeds, the connection is reset
+ *      with backoff.
+ */
+static void
+_insert_start(Meta m, PGconn *conn, const char *done, int replay, bool each)
+{
+    unsigned backoff = 1;
+    bool reset = PQstatus(conn) == CONNECTION_BAD;
+    int n = m->table->ncolumns;
+    Oid types[n];
+
+    for (int c = 0; c < n; c++)
+        types[c] = m->table->columns[c].type;
+
+    while (42)
+    {
+        if (reset)
+        {
+            logger_log("%s %d: Connection lost, reconnecting in %us: %s",
+                __FILE__, __LINE__, backoff, PQerrorMessage(conn));
+            _backoff(&backoff);
+            PQreset(conn);
+            if (PQstatus(conn) != CONNECTION_OK)
+                continue;
+            reset = false;
+        }
+
+        if (PQsetnonblocking(conn, 1) != 0
+            || (PQpipelineStatus(conn) == PQ_PIPELINE_OFF
+                && PQenterPipelineMode(conn) != 1)
+            || PQsendPrepare(conn, "", m->cpycmd, n, types) != 1
+            || !_insert_send(m, conn, 0, replay, done, each))
+        {
+            reset = true;
+            continue;
+        }
+        return;
+    }
+}
+
+/*
+ * _insert_result
+ *      Read the results of the next statement of the pipeline (and the
+ *      sync following it). The first error is returned in *error.
+ *      Returns false if the connection is lost.
+ */
+static bool
+_insert_result(PGconn *conn, bool sync, char **error)
+{
+    PGresult *res;
+    bool ok;
+
+    while ((res = PQgetResult(conn)) != NULL)
+    {
+        if (PQresultStatus(res) == PGRES_FATAL_ERROR && *error == NULL)
+            *error = strndup(PQresultErrorMessage(res),
+                strcspn(PQresultErrorMessage(res), "\n"));
+        PQclear(res);
+    }
+    if (PQstatus(conn) == CONNECTION_BAD)
+        return false;
+    if (!sync)
+        return true;
+
+    res = PQgetResult(conn);
+    ok = PQresultStatus(res) == PGRES_PIPELINE_SYNC;
+    PQclear(res);
+    return ok;
+}
+
+static void
+_insert_reject(Meta m, int row, const char *error)
+{
+    _dead_letter(m, m->cpybuf.data + m->rows[row],
+        (row + 1 < m->count ? m->rows[row + 1] : m->cpybuf.len)
+        - m->rows[row], error);
+    m->rejected++;
+}
+
+/*
+ * _insert_batch
+ *      Sync the batch sent in one transaction and read its results.
+ *      *failed is its rejected row, -1 if none or the INSERT itself
+ *      failed. Returns false if the connection is lost.
+ */
+static bool
+_insert_batch(Meta m, PGconn *conn, int *failed, char **error)
+{
+    bool ok = PQpipelineSync(conn) == 1 && _insert_flush(conn)
+        && _insert_result(conn, false, error);
+    bool prepared = *error == NULL;
+
+    *failed = -1;
+    for (int row = 0; ok && row < m->count; row++)
+    {
+        ok = _insert_result(conn, false, error);
+        if (prepared && *error && *failed < 0)
+            *failed = row;
+    }
+    return ok && _insert_result(conn, true, error);
+}
+
+/*
+ * _insert_commit
+ *      Sync the pipeline and check the results of the batch. Should a
+ *      row be rejected, the implicit transaction is rolled back: the
+ *      row is dropped and the others are sent once more, each in a
+ *      transaction of its own, so further rejected rows are found
+ *      without sending the batch again. Should the INSERT fail to
+ *      prepare, all rows are rejected. Should the connection be lost,
+ *      the rows not yet committed are replayed.
+ */
+static void
+_insert_commit(Meta m, PGconn *conn)
+{
+    char *done, *error = NULL, *prepare = NULL;
+    int row, failed;
+    bool ok;
+
+    while (!_insert_batch(m, conn, &failed, &error))
+    {
+        logger_log("%s %d: Connection lost during commit, replaying",
+            __FILE__, __LINE__);
+        free(error);
+        error = NULL;
+        _insert_start(m, conn, NULL, m->count, false);
+    }
+
+    if (error == NULL)
+    {
+        PQexitPipelineMode(conn);
+        return;
+    }
+
+    done = SCALLOC(m->count + 1, 1);
+    if (failed < 0)
+    {
+        logger_log("%s %d: Batch of %d rows rejected: %s: %s",
+            __FILE__, __LINE__, m->count, m->cpycmd, error);
+        for (row = 0; row < m->count; row++)
+            _insert_reject(m, row, error);
+        memset(done, 1, m->count);
+    }
+    else
+    {
+        _insert_reject(m, failed, error);
+        done[failed] = 1;
+    }
+    free(error);
+    error = NULL;
+
+    // the rest, row by row
+    for (ok = false; !ok; free(prepare), prepare = NULL)
+    {
+        if (memchr(done, 0, m->count) == NULL)
+            break;
+        _insert_start(m, conn, done, m->count, true);
+        // a failed PREPARE fails every row
+        if (!(ok = _insert_result(conn, false, &prepare)))
+            continue;
+
+        for (row = 0; ok && row < m->count; row++)
+        {
+            if (done[row])
+                continue;
+            if (!(ok = _insert_result(conn, true, &error)))
+                break;
+            if (prepare || error)
+                _insert_reject(m, row, prepare ? prepare : error);
+            free(error);
+            error = NULL;
+            done[row] = 1;
+        }
+    }
+
+    free(error);
+    free(done);
+    PQexitPipelineMode(conn);
+}
+#endif
+
+static inline void
+_copy_put(Meta m, const void *data, size_t len)
+{
+    memcpy(pgcopy_buf_reserve(&m->cpybuf, len), data, len);
+    m->cpybuf.len += len;
+}
+
+/*
+ * copy_begin
+ *      Start a COPY on the master. A batch is kept in the COPY buffer
+ *      until it is committed, including the binary header. The replica
+ *      gets the batch on commit.
+ */
+void
+copy_begin(Meta *m)
+{
+#ifdef LIBPQ_HAS_PIPELINING
+    if ((*m)->cpyfmt == PQ_INSERT)
+    {
+        _insert_start(*m, (*m)->conn_master, NULL, 0, false);
+        (*m)->copy = 1;
+        return;
+    }
+#endif
+    _copy_start(*m, (*m)->conn_master, NULL, 0);
+
+    if ((*m)->cpyfmt == PQ_COPY_BINARY)
+        _copy_put(*m, PGCOPY_HEADER, PGCOPY_HEADER_LEN);
+    (*m)->copy = 1;
+}
+
+/*
+ * copy_flush
+ *      Hand the rows not yet sent to libpq. The buffer is kept
+ *      for a replay.
+ */
+void
+copy_flush(Meta *m)
+{
+    Meta s = *m;
+    size_t len = s->cpybuf.len - s->flushed;
+
+    if (len == 0)
+        return;
+
+#ifdef LIBPQ_HAS_PIPELINING
+    // a failed send is replayed on commit
+    if (s->cpyfmt == PQ_INSERT)
+    {
+        _insert_send(s, s->conn_master, s->sent, s->count, NULL, false);
+        s->sent = s->count;
+        s->flushed = s->cpybuf.len;
+        return;
+    }
+#endif
+    if (PQputCopyData(s->conn_master, s->cpybuf.data + s->flushed, len) != 1)
+        _copy_start(s, s->conn_master, s->cpybuf.data, s->cpybuf.len);
+    s->flushed = s->cpybuf.len;
+}
+
+/*
+ * copy_row
+ *      Remember where the next row of the batch starts
+ */
+void
+copy_row(Meta *m)
+{
+    Meta s = *m;
+
+    if (s->count == s->rowsize)
+    {
+        s->rowsize = s->rowsize ? s->rowsize * 2 : 2048;
+        s->rows = realloc(s->rows, s->rowsize * sizeof(*s->rows));
+        if (s->rows == NULL)
+        {
+            logger_log("%s %d: Failed to allocate", __FILE__, __LINE__);
+            abort();
+        }
+    }
+    s->rows[s->count] = s->cpybuf.len;
+}
+
+/*
+ * copy_offset
+ *      Remember the source offset of a row, the highest offset of each
+ *      partition is stored with the batch
+ */
+void
+copy_offset(Meta *m, const char *topic, int32_t partition, int64_t offset)
+{
+    Meta s = *m;
+    int i;
+
+    for (i = 0; i < s->npositions; i++)
+        if (s->positions[i].partition == partition
+            && !strcmp(s->positions[i].topic, topic))
+            break;
+
+    if (i == s->npositions)
+    {
+        s->positions = realloc(s->positions,
+            (s->npositions + 1) * sizeof(*s->positions));
+        if (s->positions == NULL)
+        {
+            logger_log("%s %d: Failed to allocate", __FILE__, __LINE__);
+            abort();
+        }
+        s->positions[i].topic = strdup(topic);
+        s->positions[i].partition = partition;
+        s->positions[i].offset = offset;
+        s->npositions++;
+    }
+    else if (offset > s->positions[i].offset)
+        s->positions[i].offset = offset;
+}
+
+/*
+ * _offsets_stmt
+ *      Upsert the source offsets of the batch into the offsets table.
+ *      check is set to a query telling whether they are stored: an
+ *      offset a later batch stored counts as not stored, at worst rows
+ *      are then duplicated.
+ */
+static char *
+_offsets_stmt(Meta m, char **check)
+{
+    PgCopyBuf values = {0}, sql = {0};
+    char *topic;
+    size_t n;
+
+    for (int i = 0; i < m->npositions; i++)
+    {
+        topic = PQescapeLiteral(m->conn_master, m->positions[i].topic,
+            strlen(m->positions[i].topic));
+        if (topic == NULL)
+        {
+            logger_log("%s %d: %s", __FILE__, __LINE__,
+                PQerrorMessage(m->conn_master));
+            abort();
+        }
+        n = strlen(topic) + 48;
+        values.len += snprintf(pgcopy_buf_reserve(&values, n), n,
+            "%s(%s, %" PRId32 ", %" PRId64 ")", i ? ", " : "", topic,
+            m->positions[i].partition, m->positions[i].offset);
+        PQfreemem(topic);
+    }
+
+    n = 2 * strlen(m->offsets) + values.len + 256;
+    snprintf(pgcopy_buf_reserve(&sql, n), n, "SELECT count(*) = %d FROM %s o"
+        " JOIN (VALUES %s) v (topic, partition, \"offset\")"
+        " ON o.topic = v.topic AND o.partition = v.partition"
+        " AND o.\"offset\" = v.\"offset\"", m->npositions, m->offsets,
+        values.data);
+    *check = sql.data;
+
+    sql = (PgCopyBuf) {0};
+    snprintf(pgcopy_buf_reserve(&sql, n), n,
+        "INSERT INTO %s (topic, partition, \"offset\") VALUES %s"
+        " ON CONFLICT (topic, partition)"
+        " DO UPDATE SET \"offset\" = EXCLUDED.\"offset\"", m->offsets,
+        values.data);
+
+    for (int i = 0; i < m->npositions; i++)
+        free(m->positions[i].topic);
+    m->npositions = 0;
+    pgcopy_buf_free(&values);
+    return sql.data;
+}
+
+/*
+ * _dead_letter
+ *      Append a rejected row to the dead letter file: a comment holding the
+ *      COPY command and the server error, followed by the row as it was
+ *      sent (binary rows hex encoded as \x...).
+ */
+static void
+_dead_letter(Meta m, const char *row, size_t len, const char *error)
+{
+    PgCopyBuf rec = {0};
+    int fd = -1;
+    size_t n = strlen(m->cpycmd) + strlen(error) + 8;
+
+    n = snprintf(pgcopy_buf_reserve(&rec, n), n, "-- %s: %s\n",
+        m->cpycmd, error);
+    rec.len = n;
+
+    if (m->cpyfmt == PQ_COPY_BINARY || m->cpyfmt == PQ_INSERT)
+    {
+        char *hex = pgcopy_buf_reserve(&rec, 2 * len + 3);
+        *hex++ = '\\';
+        *hex++ = 'x';
+        for (size_t i = 0; i < len; i++)
+        {
+            *hex++ = "0123456789abcdef"[(unsigned char) row[i] >> 4];
+            *hex++ = "0123456789abcdef"[(unsigned char) row[i] & 0xF];
+        }
+        *hex = '\n';
+        rec.len += 2 * len + 3;
+    }
+    else
+    {
+        memcpy(pgcopy_buf_reserve(&rec, len), row, len);
+        rec.len += len;
+    }
+
+    if (m->dead_letter == NULL
+        || (fd = open(m->dead_letter, O_WRONLY | O_APPEND | O_CREAT, 0640)) < 0
+        || write(fd, rec.data, rec.len) != (ssize_t) rec.len)
+        logger_log("%s %d: Dropped row: %s: %.*s", __FILE__, __LINE__,
+            error, (int) (m->cpyfmt >= PQ_COPY_BINARY ? 0 : len), row);
+    if (m->dead_letter && fd >= 0)
+        close(fd);
+
+    pgcopy_buf_free(&rec);
+}
+
+/*
+ * _thaw
+ *      The COPY FREEZE load (and the TRUNCATE of the target) is committed,
+ *      later batches are copied as usual
+ */
+static void
+_thaw(Meta m)
+{
+    free(m->cpybegin);
+    free(m->cpyend);
+    free(m->cpycmd);
+    m->cpybegin = NULL;
+    m->cpyend = NULL;
+    m->cpycmd = m->cpythawed;
+    m->cpythawed = NULL;
+    m->freeze = 0;
+}
+
+/*
+ * _copy_range
+ *      COPY the rows [lo, hi) of a rejected batch on their own.
+ *      end is the offset of the end of the last row. Returns false with
+ *      the server's error if they were rejected.
+ */
+static bool
+_copy_range(Meta m, PGconn *conn, int lo, int hi, size_t end,
+    PgCopyBuf *sub, char **error)
+{
+    size_t from = m->rows[lo], to = hi < m->count ? m->rows[hi] : end;
+
+    sub->len = 0;
+    if (m->cpyfmt == PQ_COPY_BINARY)
+    {
+        memcpy(pgcopy_buf_reserve(sub, PGCOPY_HEADER_LEN), m->cpybuf.data,
+            PGCOPY_HEADER_LEN);
+        sub->len += PGCOPY_HEADER_LEN;
+    }
+    memcpy(pgcopy_buf_reserve(sub, to - from), m->cpybuf.data + from,
+        to - from);
+    sub->len += to - from;
+    if (m->cpyfmt == PQ_COPY_BINARY)
+    {
+        memcpy(pgcopy_buf_reserve(sub, PGCOPY_TRAILER_LEN), PGCOPY_TRAILER,
+            PGCOPY_TRAILER_LEN);
+        sub->len += PGCOPY_TRAILER_LEN;
+    }
+
+    _copy_start(m, conn, sub->data, sub->len);
+    if (!_copy_end(m, conn, sub->data, sub->len, error))
+        return false;
+    if (m->freeze)
+        _thaw(m);
+    return true;
+}
+
+/*
+ * _copy_bisect
+ *      The rows [lo, hi) were rejected with error. They are split in
+ *      halves which are copied on their own, until the offending rows
+ *      are isolated, which takes O(k log n) COPYs for k bad rows out of n.
+ *      end is the offset of the end of the last row.
+ */
+static void
+_copy_bisect(Meta m, PGconn *conn, int lo, int hi, size_t end,
+    PgCopyBuf *sub, char *error)
+{
+    size_t from = m->rows[lo], to = hi < m->count ? m->rows[hi] : end;
+    int mid = lo + (hi - lo) / 2;
+
+    if (hi - lo == 1)
+    {
+        // the replica only counts its rejections, the master reports them
+        if (conn == m->conn_master)
+            _dead_letter(m, m->cpybuf.data + from, to - from, error);
+        m->rejected++;
+    }
+    free(error);
+    if (hi - lo == 1)
+        return;
+
+    error = NULL;
+    if (!_copy_range(m, conn, lo, mid, end, sub, &error))
+        _copy_bisect(m, conn, lo, mid, end, sub, error);
+    error = NULL;
+    if (!_copy_range(m, conn, mid, hi, end, sub, &error))
+        _copy_bisect(m, conn, mid, hi, end, sub, error);
+}
+
+/*
+ * _commit
+ *      Commit the batch on conn. Should it be rejected,
+ *      commit what can be committed of it.
+ */
+static void
+_commit(Meta m, PGconn *conn, size_t end)
+{
+    PgCopyBuf sub = {0};
+    char *error = NULL, *offsets = m->cpyoffsets;
+
+    if (_copy_end(m, conn, m->cpybuf.data, m->cpybuf.len, &error))
+    {
+        if (m->freeze)
+            _thaw(m);
+        return;
+    }
+
+    logger_log("%s %d: Batch of %d rows rejected, isolating bad rows: %s",
+        __FILE__, __LINE__, m->count, error);
+
+    /* The source offsets are stored once all parts of the batch are in,
+     * should schaufel stop before, committed parts are loaded again.
+     * The batch was rejected as a whole already, bisection goes on with
+     * its halves. */
+    m->cpyoffsets = NULL;
+    if (m->count > 0)
+        _copy_bisect(m, conn, 0, m->count, end, &sub, error);
+    else
+        free(error);
+    pgcopy_buf_free(&sub);
+
+    m->cpyoffsets = offsets;
+    if (offsets == NULL)
+        return;
+    logger_log("%s %d: Storing the offsets of the split batch on their own, "
+        "its rows are no longer loaded exactly once", __FILE__, __LINE__);
+    if (!_exec(conn, offsets, PGRES_COMMAND_OK))
+        logger_log("%s %d: Failed to store offsets: %s",
+            __FILE__, __LINE__, PQerrorMessage(conn));
+}
+
+/*
+ * A replica is written by a worker thread of its own, from a copy of the
+ * batch: the master doesn't wait for a slow replica while copying, and
+ * both commit concurrently. The policy replica_ack decides whether
+ * commit() waits for the replica as well. Either way the replica is at
+ * most one batch behind, and rows rejected by only one of the two
+ * are reported as divergence.
+ */
+typedef struct Replica {
+    struct Meta     batch;      // copy of the batch being committed
+    size_t          end;        // end of its last row
+    int             expected;   // rows of it rejected by the master
+    bool            busy;
+    bool            checked;
+    bool            stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    pthread_t       worker;
+} *Replica;
+
+static void *
+_replica_worker(void *replica)
+{
+    Replica r = (Replica) replica;
+    Meta b = &r->batch;
+
+    #ifdef PR_SET_NAME
+    prctl(PR_SET_NAME, "replica_worker");
+    #endif
+
+    pthread_mutex_lock(&r->mutex);
+    while (42)
+    {
+        while (!r->busy && !r->stop)
+            pthread_cond_wait(&r->cond, &r->mutex);
+        if (!r->busy)
+            break;
+        pthread_mutex_unlock(&r->mutex);
+
+        b->rejected = 0;
+        _copy_start(b, b->conn_replica, b->cpybuf.data, b->cpybuf.len);
+        _commit(b, b->conn_replica, r->end);
+
+        pthread_mutex_lock(&r->mutex);
+        r->busy = false;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->mutex);
+    return NULL;
+}
+
+// wait for the replica to commit its batch, compare it with the master's
+static void
+_replica_wait(Replica r)
+{
+    pthread_mutex_lock(&r->mutex);
+    while (r->busy)
+        pthread_cond_wait(&r->cond, &r->mutex);
+
+    if (!r->checked && r->expected != r->batch.rejected)
+        logger_log("%s %d: Replica diverged: %d rows rejected by the master, "
+            "%d by the replica (%s)", __FILE__, __LINE__, r->expected,
+            r->batch.rejected, r->batch.cpycmd);
+    r->checked = true;
+    pthread_mutex_unlock(&r->mutex);
+}
+
+static char *
+_strdup_null(const char *s)
+{
+    return s ? strdup(s) : NULL;
+}
+
+// hand the batch over to the replica worker
+static void
+_replica_put(Meta m, size_t end)
+{
+    Replica r = m->replica;
+    Meta b = &r->batch;
+
+    _replica_wait(r);
+
+    // the replica's session is set up anew for a new target
+    if (m->cpysession && (b->cpysession == NULL
+        || strcmp(b->cpysession, m->cpysession)))
+        b->session = 0;
+    free(b->cpysession);
+    free(b->cpycmd);
+    free(b->cpybegin);
+    free(b->cpyend);
+    free(b->cpyoffsets);
+    free(b->cpycommitted);
+    free(b->cpythawed);
+    free(b->target);
+    b->target = strdup(m->target);
+    b->cpycmd = strdup(m->cpycmd);
+    b->cpythawed = _strdup_null(m->cpythawed);
+    b->freeze = m->freeze;
+    b->cpysession = _strdup_null(m->cpysession);
+    b->cpybegin = _strdup_null(m->cpybegin);
+    b->cpyend = _strdup_null(m->cpyend);
+    b->cpyoffsets = _strdup_null(m->cpyoffsets);
+    b->cpycommitted = _strdup_null(m->cpycommitted);
+    b->cpyfmt = m->cpyfmt;
+    b->conn_replica = m->conn_replica;
+
+    b->cpybuf.len = 0;
+    memcpy(pgcopy_buf_reserve(&b->cpybuf, m->cpybuf.len), m->cpybuf.data,
+        m->cpybuf.len);
+    b->cpybuf.len = m->cpybuf.len;
+    if (b->rowsize < m->count)
+    {
+        b->rowsize = m->rowsize;
+        b->rows = realloc(b->rows, b->rowsize * sizeof(*b->rows));
+        if (b->rows == NULL)
+        {
+            logger_log("%s %d: Failed to allocate", __FILE__, __LINE__);
+            abort();
+        }
+    }
+    memcpy(b->rows, m->rows, m->count * sizeof(*b->rows));
+    b->count = m->count;
+
+    pthread_mutex_lock(&r->mutex);
+    r->end = end;
+    r->expected = 0;
+    r->busy = true;
+    r->checked = false;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+/*
+ * replica_start
+ *      Start the worker writing conn_replica
+ */
+void
+replica_start(Meta m)
+{
+    Replica r = SCALLOC(1, sizeof(*r));
+
+    r->checked = true;
+    if (pthread_mutex_init(&r->mutex, NULL) != 0
+        || pthread_cond_init(&r->cond, NULL) != 0)
+    {
+        logger_log("%s %d: unable to create mutex", __FILE__, __LINE__);
+        abort();
+    }
+    if (pthread_create(&r->worker, NULL, _replica_worker, r))
+    {
+        logger_log("%s %d: Failed to create replica worker!",
+            __FILE__, __LINE__);
+        abort();
+    }
+    m->replica = r;
+}
+
+/*
+ * replica_stop
+ *      Let the worker commit its batch and stop it
+ */
+void
+replica_stop(Meta m)
+{
+    Replica r = m->replica;
+
+    if (r == NULL)
+        return;
+
+    _replica_wait(r);
+    pthread_mutex_lock(&r->mutex);
+    r->stop = true;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+    pthread_join(r->worker, NULL);
+
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->mutex);
+    free(r->batch.cpysession);
+    free(r->batch.cpycmd);
+    free(r->batch.cpybegin);
+    free(r->batch.cpyend);
+    free(r->batch.cpyoffsets);
+    free(r->batch.cpycommitted);
+    free(r->batch.cpythawed);
+    free(r->batch.target);
+    free(r->batch.rows);
+    pgcopy_buf_free(&r->batch.cpybuf);
+    free(r);
+    m->replica = NULL;
+}
+
 void
 commit(Meta *m)
 {
+    Route route = (*m)->route;
+    Shards shards = (*m)->shards;
+    size_t end = (*m)->cpybuf.len;
+
+    if (route || shards)
+    {
+        Meta *streams = route ? route->streams : shards->streams;
+        int nstreams = route ? route->nstreams : shards->nstreams;
+
+        for (int i = 0; i < nstreams; i++)
+            if (streams[i]->copy)
+                commit(&streams[i]);
+
+        (*m)->count = 0;
+        (*m)->copy  = 0;
+        (*m)->commit_iter = 0;
+        return;
+    }
+
+#ifdef LIBPQ_HAS_PIPELINING
+    if ((*m)->cpyfmt == PQ_INSERT)
+    {
+        copy_flush(m);
+        _insert_commit(*m, (*m)->conn_master);
+        (*m)->cpybuf.len = 0;
+        (*m)->flushed = 0;
+        (*m)->sent = 0;
+        (*m)->count = 0;
+        (*m)->copy  = 0;
+        (*m)->commit_iter = 0;
+        return;
+    }
+#endif
+
     if((*m)->cpyfmt == PQ_COPY_BINARY)
-        PQputCopyData((*m)->conn_master, "\377\377", 2);
-    PQputCopyEnd((*m)->conn_master, NULL);
-    if ((*m)->conninfo_replica)
-        PQputCopyEnd((*m)->conn_replica, NULL);
+        _copy_put(*m, PGCOPY_TRAILER, PGCOPY_TRAILER_LEN);
+    copy_flush(m);
 
+    if ((*m)->npositions > 0)
+        (*m)->cpyoffsets = _offsets_stmt(*m, &(*m)->cpycommitted);
+
+    if ((*m)->replica)
+        _replica_put(*m, end);
+
+    (*m)->rejected = 0;
+    _commit(*m, (*m)->conn_master, end);
+
+    if ((*m)->replica)
+    {
+        pthread_mutex_lock(&(*m)->replica->mutex);
+        (*m)->replica->expected = (*m)->rejected;
+        pthread_mutex_unlock(&(*m)->replica->mutex);
+        if ((*m)->replica_ack != PQ_ACK_PRIMARY)
+            _replica_wait((*m)->replica);
+    }
+
+    free((*m)->cpyoffsets);
+    free((*m)->cpycommitted);
+    (*m)->cpyoffsets = NULL;
+    (*m)->cpycommitted = NULL;
+    (*m)->cpybuf.len = 0;
+    (*m)->flushed = 0;
     (*m)->count = 0;
     (*m)->copy  = 0;
     (*m)->commit_iter = 0;
 }
 
+/*
+ * pg_offsets_table
+ *      Create the table of committed source offsets
+ */
+void
+pg_offsets_table(PGconn *conn, const char *table)
+{
+    size_t n = strlen(table) + 160;
+    char *sql = malloc(n);
+
+    if (sql == NULL)
+    {
+        logger_log("%s %d: Failed to allocate", __FILE__, __LINE__);
+        abort();
+    }
+    snprintf(sql, n, "CREATE TABLE IF NOT EXISTS %s (topic text NOT NULL, "
+        "partition integer NOT NULL, \"offset\" bigint NOT NULL, "
+        "PRIMARY KEY (topic, partition))", table);
+
+    if (!_exec(conn, sql, PGRES_COMMAND_OK))
+    {
+        logger_log("%s %d: Failed to create %s: %s", __FILE__, __LINE__,
+            table, PQerrorMessage(conn));
+        abort();
+    }
+    free(sql);
+}
+
+/*
+ * _autocommit
+ *      Commit what the producer holds, except frozen loads: those are
+ *      committed once they hold all their rows (or on shutdown), so
+ *      all of them are frozen.
+ */
+static void
+_autocommit(Meta *m)
+{
+    Route route = (*m)->route;
+    Shards shards = (*m)->shards;
+
+    if (route || shards)
+    {
+        Meta *streams = route ? route->streams : shards->streams;
+        int nstreams = route ? route->nstreams : shards->nstreams;
+
+        for (int i = 0; i < nstreams; i++)
+        {
+            if (!streams[i]->copy || streams[i]->freeze)
+                continue;
+            logger_log("%s %d: Autocommiting %d entries",
+                __FILE__, __LINE__, streams[i]->count);
+            (*m)->count -= streams[i]->count;
+            commit(&streams[i]);
+        }
+        return;
+    }
+
+    if ((*m)->freeze)
+        return;
+    logger_log("%s %d: Autocommiting %d entries",
+        __FILE__, __LINE__, (*m)->count);
+    commit(m);
+}
+
 static void
 _commit_worker_cleanup(void *mutex)
 {
@@ -50,11 +1235,8 @@ commit_worker(void *meta)
 
         /* if count > 0 it implies that copy == 1,
          * therefore it is safe to commit data */
-        if((!((*m)->commit_iter)) && ((*m)->count > 0)) {
-            logger_log("%s %d: Autocommiting %d entries",
-                __FILE__, __LINE__, (*m)->count);
-            commit(m);
-        }
+        if((!((*m)->commit_iter)) && ((*m)->count > 0))
+            _autocommit(m);
 
         pthread_cleanup_pop(0);
         pthread_mutex_unlock(&((*m)->commit_mutex));
@@ -3,12 +3,31 @@
 
 #include <libpq-fe.h>
 #include <pthread.h>
+#include <stdint.h>
+
+#include "utils/pgcopy.h"
+#include "utils/pgtypes.h"
 
 #define PQ_COPY_TEXT   0
 #define PQ_COPY_CSV    1
 #define PQ_COPY_BINARY 2
+#define PQ_INSERT      3    // pipelined INSERTs of binary rows
+
+/* copies a batch has to be committed to before commit() returns */
+#define PQ_ACK_ALL     0
+#define PQ_ACK_PRIMARY 1
 
 typedef struct Internal *Internal;
+typedef struct Route *Route;
+typedef struct Shards *Shards;
+typedef struct Replica *Replica;
+
+// highest source (kafka) offset of a partition in a batch
+typedef struct PgOffset {
+    char            *topic;
+    int32_t         partition;
+    int64_t         offset;
+} PgOffset;
 
 typedef struct Meta {
     PGconn          *conn_master;
@@ -17,16 +36,82 @@ typedef struct Meta {
     char            *conninfo;
     char            *conninfo_replica;
     char            *cpycmd;
+    char            *cpysession;    // run once per session, before COPYs
+    int             session;    // backend pid cpysession ran on
+    char            *cpybegin;  // run before the COPY
+    char            *cpyend;    // run after the COPY, ends its transaction
     int             cpyfmt;
     int             count;
     int             copy;
     int             commit_iter;
+    PgCopyBuf       cpybuf;     // the uncommitted batch
+    size_t          flushed;    // bytes of cpybuf handed to libpq
+    int             sent;       // rows handed to libpq (PQ_INSERT)
+    int             freeze;     // rows of the COPY FREEZE load, 0 once done
+    const char      *freeze_like;   // creates the target like this table
+    char            *cpythawed; // cpycmd once the frozen load is committed
+    size_t          *rows;      // offsets of the rows in cpybuf
+    int             rowsize;
+    const char      *dead_letter;   // file for rejected rows
+    int             rejected;   // rows of the batch rejected
+    const char      *offsets;   // table of the committed source offsets
+    PgOffset        *positions; // source offsets of the batch
+    int             npositions;
+    char            *cpyoffsets;    // stores them, in the COPY's transaction
+    char            *cpycommitted;  // checks whether they were stored
+    PgTable         table;      // typed binary COPY
+    char            *target;    // table of a routed COPY stream
+    Route           route;      // dynamic table routing
+    Shards          shards;     // one stream per host
+    Replica         replica;    // writes conn_replica
+    int             replica_ack;
     pthread_mutex_t commit_mutex;
     pthread_t       commit_worker;
     Internal        internal;
 } *Meta;
 
+/*
+ * With dynamic table routing, every target table has its own COPY stream
+ * (a Meta with its own connections), kept in a LRU, most recently used first.
+ * The streams share the commit mutex and worker of the producer's Meta.
+ */
+typedef struct Route {
+    const char             *template;
+    const char             *time;      // json pointer, arrival time if NULL
+    const char             *key;       // metadata key for %k
+    int                     fmt;
+    const config_setting_t *columns;   // typed COPY
+    const char             *upsert;
+    const char             *staging;
+    Meta                   *streams;
+    int                     nstreams;
+    int                     size;
+} *Route;
+
+/*
+ * A sharded producer holds a COPY stream per host and copies a message
+ * to the host its key hashes to (jump consistent hash). Like routed
+ * streams, the shards share the commit mutex and worker.
+ */
+typedef struct Shards {
+    const char             *jpointer;  // key from the json message
+    const char             *key;       // key from metadata
+    Meta                   *streams;
+    int                     nstreams;
+} *Shards;
+
+PGconn *pg_connect(const char *conninfo);
+void copy_begin(Meta *m);
+void copy_flush(Meta *m);
+void copy_row(Meta *m);
+void copy_offset(Meta *m, const char *topic, int32_t partition,
+    int64_t offset);
 void commit(Meta *m);
 
+void pg_offsets_table(PGconn *conn, const char *table);
+
+void replica_start(Meta m);
+void replica_stop(Meta m);
+
 void *commit_worker(void *meta);
 #endif
@@ -0,0 +1,63 @@
+#include "schaufel.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "test/test.h"
+#include "utils/compress.h"
+#include "utils/decompress.h"
+
+#define SAMPLE "sample/dummy_compress"
+
+static const char *formats[] = {"gzip", "zstd", "lz4"};
+
+// compress two frames, as a segment is written, and read them back
+static bool
+roundtrip(const char *name)
+{
+    Compressor c = compress_init(name, 0);
+    Decompressor d;
+    PgCopyBuf buf = {0};
+    char out[64];
+    ssize_t r;
+    size_t total = 0;
+    bool ok;
+    FILE *fp;
+    int fd;
+
+    ok = compress_frame(c, "first\nsecond\n", 13, &buf) > 0
+        && compress_frame(c, "third\n", 6, &buf) > 0;
+    compress_free(&c);
+
+    fp = fopen(SAMPLE, "w");
+    fwrite(buf.data, buf.len, 1, fp);
+    fclose(fp);
+    pgcopy_buf_free(&buf);
+
+    fd = open(SAMPLE, O_RDONLY);
+    d = decompress_init(fd);
+    ok &= d != NULL;
+    if (d != NULL)
+    {
+        ok &= strcmp(decompress_name(d), name) == 0;
+        while ((r = decompress_read(d, out + total, sizeof(out) - total))
+                > 0)
+            total += r;
+        decompress_free(&d);
+    }
+    close(fd);
+    unlink(SAMPLE);
+
+    return ok && total == 19 && memcmp(out, "first\nsecond\nthird\n", 19) == 0;
+}
+
+int
+main(void)
+{
+    pretty_assert(!compress_supported("bzip2"));
+
+    for (size_t i = 0; i < sizeof(formats) / sizeof(*formats); i++)
+        if (compress_supported(formats[i]))
+            pretty_assert(roundtrip(formats[i]));
+    return 0;
+}
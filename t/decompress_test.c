@@ -0,0 +1,68 @@
+#include "schaufel.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+#include "test/test.h"
+#include "utils/decompress.h"
+
+#define SAMPLE "sample/dummy_compressed"
+
+static size_t
+read_all(Decompressor d, char *buf, size_t len)
+{
+    size_t total = 0;
+    ssize_t r;
+
+    // small reads, so streams are continued across calls
+    while ((r = decompress_read(d, buf + total,
+            len - total < 7 ? len - total : 7)) > 0)
+        total += r;
+    return total;
+}
+
+int
+main(void)
+{
+    char buf[256];
+    FILE *fp;
+    int fd;
+
+    fp = fopen(SAMPLE, "w");
+    fputs("plain\n", fp);
+    fclose(fp);
+    fd = open(SAMPLE, O_RDONLY);
+    pretty_assert(decompress_init(fd) == NULL);
+    close(fd);
+
+#ifdef HAVE_LIBZ
+    Decompressor d;
+    gzFile gz;
+
+    // two members, as written by cat a.gz b.gz
+    gz = gzopen(SAMPLE, "w");
+    gzputs(gz, "first\nsecond\n");
+    gzclose(gz);
+    gz = gzopen(SAMPLE, "a");
+    gzputs(gz, "third\n");
+    gzclose(gz);
+
+    fd = open(SAMPLE, O_RDONLY);
+    d = decompress_init(fd);
+    pretty_assert(d != NULL);
+    if (d != NULL)
+    {
+        pretty_assert(strcmp(decompress_name(d), "gzip") == 0);
+        pretty_assert(read_all(d, buf, sizeof(buf)) == 19);
+        pretty_assert(memcmp(buf, "first\nsecond\nthird\n", 19) == 0);
+        decompress_free(&d);
+    }
+    close(fd);
+#endif
+
+    unlink(SAMPLE);
+    return 0;
+}
@@ -1,13 +1,232 @@
 #include "schaufel.h"
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "consumer.h"
+#include "producer.h"
 #include "queue.h"
 #include "test/test.h"
 #include "utils/config.h"
 #include "utils/helper.h"
 #include "utils/logger.h"
+#include "utils/metadata.h"
 #include "utils/options.h"
+#include "utils/scalloc.h"
+
+#define BLOCK (1 << 20)
+#define CHUNK (16 << 20)
+#define SPLIT_THREADS 3
+
+// lines of a split file in the order they were consumed
+static struct {
+    pthread_mutex_t mutex;
+    long           *lines;      // -1: a, -2: b, -3: end, else a number
+    size_t          n;
+} seen = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static config_setting_t *
+file_config(config_setting_t *croot, const char *name, const char *fname)
+{
+    config_setting_t *file, *setting;
+
+    file = config_setting_add(croot, name, CONFIG_TYPE_GROUP);
+    setting = config_setting_add(file, "file", CONFIG_TYPE_STRING);
+    config_setting_set_string(setting, fname);
+    return file;
+}
+
+// the data of the next message, NULL if there is none
+static char *
+consume(Consumer c, size_t *len)
+{
+    Message msg = message_init();
+    char *data;
+
+    if (consumer_consume(c, msg) != 0)
+        message_set_data(msg, NULL);
+    data = message_get_data(msg);
+    *len = message_get_len(msg);
+    metadata_free(message_get_metadata(msg));
+    message_free(&msg);
+    return data;
+}
+
+// the message of the next line, its callback not yet run
+static Message
+consume_msg(Consumer c)
+{
+    Message msg = message_init();
+
+    consumer_consume(c, msg);
+    return msg;
+}
+
+static void
+msg_free(Message msg)
+{
+    free(message_get_data(msg));
+    metadata_free(message_get_metadata(msg));
+    message_free(&msg);
+}
+
+static bool
+checkpoint_is(const char *path, const char *file, unsigned long offset)
+{
+    unsigned long ino = 0, off = 0;
+    struct stat st;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+        return false;
+    if (fscanf(fp, "%lu %lu", &ino, &off) != 2)
+        ino = 0;
+    fclose(fp);
+    return stat(file, &st) == 0 && ino == st.st_ino && off == offset;
+}
+
+static void
+write_file(const char *path, const char *mode, const char *data)
+{
+    FILE *fp = fopen(path, mode);
+
+    fputs(data, fp);
+    fclose(fp);
+}
+
+static void
+produce(Producer p, const char *data, size_t len)
+{
+    Message msg = message_init();
+
+    message_set_data(msg, (void *) data);
+    message_set_len(msg, len);
+    producer_produce(p, msg);
+    message_free(&msg);
+}
+
+static bool
+record_is(Consumer c, const char *data, size_t len)
+{
+    size_t got;
+    char *rec = consume(c, &got);
+    bool ok = rec != NULL && got == len && memcmp(rec, data, len) == 0;
+
+    free(rec);
+    return ok;
+}
+
+/*
+ * framed
+ *      Records written by the producer are read back by the consumer,
+ *      then with the last record cut short, then with a record whose
+ *      CRC does not match.
+ */
+static void
+framed(config_setting_t *croot, const char *framing)
+{
+    config_setting_t *producer, *consumer, *setting;
+    char name[32], big[300], byte;
+    struct stat st;
+    Producer p;
+    Consumer c;
+    int fd;
+
+    memset(big, 'x', sizeof(big));
+    unlink("sample/dummy_framed");
+    for (int i = 0; i < 2; i++)
+    {
+        snprintf(name, sizeof(name), "%s_%s", i ? "consumer" : "producer",
+            framing);
+        setting = file_config(croot, name, "sample/dummy_framed");
+        *(i ? &consumer : &producer) = setting;
+        setting = config_setting_add(setting, "framing", CONFIG_TYPE_STRING);
+        config_setting_set_string(setting, framing);
+        setting = config_setting_add(i ? consumer : producer, "crc",
+            CONFIG_TYPE_BOOL);
+        config_setting_set_bool(setting, 1);
+    }
+
+    // records may hold newlines, be empty or need a longer varint
+    p = producer_init('f', producer);
+    produce(p, "one\ntwo", 7);
+    produce(p, "", 0);
+    produce(p, big, sizeof(big));
+    produce(p, "last", 4);
+    producer_free(&p);
+
+    c = consumer_init('f', consumer);
+    pretty_assert(record_is(c, "one\ntwo", 7));
+    pretty_assert(record_is(c, "", 0));
+    pretty_assert(record_is(c, big, sizeof(big)));
+    pretty_assert(record_is(c, "last", 4));
+    pretty_assert(!record_is(c, NULL, 0));
+    consumer_free(&c);
+
+    // a truncated record is dropped
+    stat("sample/dummy_framed", &st);
+    pretty_assert(truncate("sample/dummy_framed", st.st_size - 1) == 0);
+    c = consumer_init('f', consumer);
+    pretty_assert(record_is(c, "one\ntwo", 7));
+    pretty_assert(record_is(c, "", 0));
+    pretty_assert(record_is(c, big, sizeof(big)));
+    pretty_assert(!record_is(c, NULL, 0));
+    consumer_free(&c);
+
+    // a flipped bit in the big record (the middle of the file)
+    fd = open("sample/dummy_framed", O_RDWR);
+    pread(fd, &byte, 1, st.st_size / 2);
+    byte ^= 1;
+    pwrite(fd, &byte, 1, st.st_size / 2);
+    close(fd);
+    c = consumer_init('f', consumer);
+    pretty_assert(record_is(c, "one\ntwo", 7));
+    pretty_assert(record_is(c, "", 0));
+    pretty_assert(!record_is(c, big, sizeof(big)));
+    pretty_assert(!record_is(c, NULL, 0));
+    consumer_free(&c);
+
+    unlink("sample/dummy_framed");
+}
+
+static bool
+line_is(char *line, size_t len, char c, size_t n)
+{
+    bool ok = line != NULL && len == n + 1 && line[n] == '\n';
+
+    for (size_t i = 0; ok && i < n; i++)
+        ok = line[i] == c;
+    free(line);
+    return ok;
+}
+
+static void *
+split_worker(void *consumer)
+{
+    Consumer c = (Consumer) consumer;
+    char *line;
+    size_t len;
+    long what;
+
+    while ((line = consume(c, &len)) != NULL)
+    {
+        if (line[0] == 'a')
+            what = len == CHUNK ? -1 : -9;
+        else if (line[0] == 'b')
+            what = len == CHUNK + CHUNK / 2 + 1 ? -2 : -9;
+        else if (len == 3 && !memcmp(line, "end", 3))
+            what = -3;
+        else
+            what = strtol(line, NULL, 10);
+        pthread_mutex_lock(&seen.mutex);
+        seen.lines[seen.n++] = what;
+        pthread_mutex_unlock(&seen.mutex);
+        free(line);
+    }
+    return NULL;
+}
 
 int
 main(void)
@@ -16,6 +235,9 @@ main(void)
     config_setting_t *croot, *logger, *file, *setting;
     config_init(&config);
     croot = config_root_setting(&config);
+    char *line, seg[64];
+    size_t len;
+    FILE *fp;
 
     //logger
     logger = config_setting_add(croot,"logger",CONFIG_TYPE_GROUP);
@@ -24,9 +246,7 @@ main(void)
     setting = config_setting_add(logger, "file", CONFIG_TYPE_STRING);
     config_setting_set_string(setting, "sample/dummy_log");
     //file
-    file = config_setting_add(croot,"file",CONFIG_TYPE_GROUP);
-    setting = config_setting_add(file, "file", CONFIG_TYPE_STRING);
-    config_setting_set_string(setting, "sample/dummy_file");
+    file = file_config(croot, "file", "sample/dummy_file");
 
     logger_init(logger);
     Message msg = message_init();
@@ -54,6 +274,189 @@ main(void)
 
     message_free(&msg);
     consumer_free(&c);
+
+    // a line filling a whole block, a line spanning blocks
+    fp = fopen("sample/dummy_block", "w");
+    for (size_t i = 0; i < BLOCK - 1; i++)
+        fputc('a', fp);
+    fputc('\n', fp);
+    for (size_t i = 0; i < 2 * BLOCK + 5; i++)
+        fputc('b', fp);
+    fputs("\nc\n", fp);
+    fclose(fp);
+
+    c = consumer_init('f', file_config(croot, "block", "sample/dummy_block"));
+    line = consume(c, &len);
+    pretty_assert(line_is(line, len, 'a', BLOCK - 1));
+    line = consume(c, &len);
+    pretty_assert(line_is(line, len, 'b', 2 * BLOCK + 5));
+    line = consume(c, &len);
+    pretty_assert(line_is(line, len, 'c', 1));
+    pretty_assert(consume(c, &len) == NULL);
+    consumer_free(&c);
+    unlink("sample/dummy_block");
+
+    /* a split file: a line ending at the end of the first chunk, one
+     * running over the next chunk, numbered lines over two more and a
+     * last line without newline */
+    char *big = SCALLOC(CHUNK + CHUNK / 2, 1);
+    long lines = (2 * CHUNK - CHUNK / 2) / 8, i;
+    bool ordered = true;
+
+    fp = fopen("sample/dummy_split", "w");
+    memset(big, 'a', CHUNK - 1);
+    fwrite(big, CHUNK - 1, 1, fp);
+    fputc('\n', fp);
+    memset(big, 'b', CHUNK + CHUNK / 2);
+    fwrite(big, CHUNK + CHUNK / 2, 1, fp);
+    fputc('\n', fp);
+    for (i = 0; i < lines; i++)
+        fprintf(fp, "%07ld\n", i);
+    fputs("end", fp);
+    fclose(fp);
+    free(big);
+
+    file = file_config(croot, "split", "sample/dummy_split");
+    setting = config_setting_add(file, "split", CONFIG_TYPE_STRING);
+    config_setting_set_string(setting, "ordered");
+    setting = config_setting_add(file, "threads", CONFIG_TYPE_INT);
+    config_setting_set_int(setting, SPLIT_THREADS);
+
+    Consumer split[SPLIT_THREADS];
+    pthread_t workers[SPLIT_THREADS];
+    seen.lines = SCALLOC(lines + 8, sizeof(*seen.lines));
+    for (i = 0; i < SPLIT_THREADS; i++)
+        split[i] = consumer_init('f', file);
+    for (i = 0; i < SPLIT_THREADS; i++)
+        pthread_create(&workers[i], NULL, split_worker, split[i]);
+    for (i = 0; i < SPLIT_THREADS; i++)
+    {
+        pthread_join(workers[i], NULL);
+        consumer_free(&split[i]);
+    }
+
+    // every line once, in the order of the file
+    pretty_assert(seen.n == (size_t) lines + 3);
+    pretty_assert(seen.lines[0] == -1 && seen.lines[1] == -2);
+    for (i = 0; i < lines; i++)
+        ordered &= seen.lines[i + 2] == i;
+    pretty_assert(ordered);
+    pretty_assert(seen.lines[lines + 2] == -3);
+    free(seen.lines);
+    unlink("sample/dummy_split");
+
+    /* lines handled out of order: the checkpoint stays in front of the
+     * first line until it is handled (dropped, here) */
+    Message held;
+    write_file("sample/dummy_ack", "w", "one\ntwo\nthree\n");
+    unlink("sample/dummy_ack.ckpt");
+    file = file_config(croot, "ack", "sample/dummy_ack");
+    setting = config_setting_add(file, "checkpoint", CONFIG_TYPE_STRING);
+    config_setting_set_string(setting, "sample/dummy_ack.ckpt");
+
+    c = consumer_init('f', file);
+    held = consume_msg(c);
+    msg_free(consume_msg(c));
+    consumer_free(&c);
+    pretty_assert(access("sample/dummy_ack.ckpt", F_OK) != 0);
+    msg_free(held);
+    pretty_assert(checkpoint_is("sample/dummy_ack.ckpt", "sample/dummy_ack",
+        8));
+
+    // resuming behind the checkpoint
+    c = consumer_init('f', file);
+    line = consume(c, &len);
+    pretty_assert(line && len == 6 && !memcmp(line, "three\n", 6));
+    free(line);
+    consumer_free(&c);
+    pretty_assert(checkpoint_is("sample/dummy_ack.ckpt", "sample/dummy_ack",
+        14));
+    unlink("sample/dummy_ack");
+    unlink("sample/dummy_ack.ckpt");
+
+    /* following a file truncated, then rotated: lines of the file
+     * before are no longer checkpointed */
+    write_file("sample/dummy_follow", "w", "one\ntwo\n");
+    unlink("sample/dummy_follow.ckpt");
+    file = file_config(croot, "follow", "sample/dummy_follow");
+    setting = config_setting_add(file, "checkpoint", CONFIG_TYPE_STRING);
+    config_setting_set_string(setting, "sample/dummy_follow.ckpt");
+    setting = config_setting_add(file, "follow", CONFIG_TYPE_BOOL);
+    config_setting_set_bool(setting, 1);
+
+    c = consumer_init('f', file);
+    held = consume_msg(c);
+    line = consume(c, &len);
+    pretty_assert(line && len == 4 && !memcmp(line, "two\n", 4));
+    free(line);
+
+    pretty_assert(truncate("sample/dummy_follow", 0) == 0);
+    pretty_assert(consume(c, &len) == NULL);
+    write_file("sample/dummy_follow", "a", "three\n");
+    line = consume(c, &len);
+    pretty_assert(line && len == 6 && !memcmp(line, "three\n", 6));
+    free(line);
+    msg_free(held);
+
+    pretty_assert(rename("sample/dummy_follow", "sample/dummy_follow.1")
+        == 0);
+    write_file("sample/dummy_follow", "w", "four\n");
+    pretty_assert(consume(c, &len) == NULL);
+    held = consume_msg(c);
+    pretty_assert(message_get_len(held) == 5
+        && !memcmp(message_get_data(held), "four\n", 5));
+    consumer_free(&c);
+    msg_free(held);
+    pretty_assert(checkpoint_is("sample/dummy_follow.ckpt",
+        "sample/dummy_follow", 5));
+    unlink("sample/dummy_follow");
+    unlink("sample/dummy_follow.1");
+    unlink("sample/dummy_follow.ckpt");
+
+    /* a glob: files whose lines were all handled (dropped, here) go to
+     * the manifest, a file not read to its end is read again */
+    mkdir("sample/dummy_glob", 0755);
+    write_file("sample/dummy_glob/a", "w", "a1\na2\n");
+    write_file("sample/dummy_glob/b", "w", "b1\nb2\n");
+    unlink("sample/dummy_glob.manifest");
+    file = config_setting_add(croot, "glob", CONFIG_TYPE_GROUP);
+    setting = config_setting_add(file, "glob", CONFIG_TYPE_STRING);
+    config_setting_set_string(setting, "sample/dummy_glob");
+    setting = config_setting_add(file, "manifest", CONFIG_TYPE_STRING);
+    config_setting_set_string(setting, "sample/dummy_glob.manifest");
+
+    c = consumer_init('f', file);
+    for (int i = 0; i < 3; i++)
+        free(consume(c, &len));
+    consumer_free(&c);
+    fp = fopen("sample/dummy_glob.manifest", "r");
+    pretty_assert(fp != NULL && fgets(seg, sizeof(seg), fp)
+        && !strcmp(seg, "sample/dummy_glob/a\n")
+        && !fgets(seg, sizeof(seg), fp));
+    if (fp)
+        fclose(fp);
+
+    c = consumer_init('f', file);
+    line = consume(c, &len);
+    pretty_assert(line && len == 3 && !memcmp(line, "b1\n", 3));
+    free(line);
+    free(consume(c, &len));
+    pretty_assert(consume(c, &len) == NULL);
+    consumer_free(&c);
+    fp = fopen("sample/dummy_glob.manifest", "r");
+    pretty_assert(fp != NULL && fgets(seg, sizeof(seg), fp)
+        && fgets(seg, sizeof(seg), fp)
+        && !strcmp(seg, "sample/dummy_glob/b\n"));
+    if (fp)
+        fclose(fp);
+    unlink("sample/dummy_glob/a");
+    unlink("sample/dummy_glob/b");
+    rmdir("sample/dummy_glob");
+    unlink("sample/dummy_glob.manifest");
+
+    framed(croot, "u32");
+    framed(croot, "varint");
+
     config_destroy(&config);
     logger_free();
     return 0;
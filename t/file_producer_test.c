@@ -0,0 +1,179 @@
+#include "schaufel.h"
+#include <glob.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "producer.h"
+#include "queue.h"
+#include "test/test.h"
+#include "utils/config.h"
+#include "utils/fnv.h"
+#include "utils/logger.h"
+#include "utils/metadata.h"
+#include "utils/pgcopy.h"
+
+#define SEGMENTS "sample/dummy_copy.*"
+
+static void
+produce(Producer p, const char *data, size_t len)
+{
+    Message msg = message_init();
+    message_set_data(msg, (void *) data);
+    message_set_len(msg, len);
+    producer_produce(p, msg);
+    message_free(&msg);
+}
+
+// a message with a shard key
+static void
+produce_key(Producer p, const char *key)
+{
+    Message msg = message_init();
+    Datum value = {.string = strdup(key)};
+
+    metadata_insert(message_get_metadata(msg), "key",
+        mdatum_init(MTYPE_STRING, value, strlen(key) + 1));
+    message_set_data(msg, (void *) key);
+    message_set_len(msg, strlen(key));
+    producer_produce(p, msg);
+    metadata_free(message_get_metadata(msg));
+    message_free(&msg);
+}
+
+// the segment of a shard and thread holds the keys, nothing else
+static bool
+segment_is(int shard, int thread, const char *keys)
+{
+    char pattern[64], data[64];
+    size_t len = 0;
+    glob_t g;
+    FILE *fp;
+
+    snprintf(pattern, sizeof(pattern), "sample/dummy_shard.%d.%d.*Z.0",
+        shard, thread);
+    if (glob(pattern, 0, NULL, &g) != 0)
+        return *keys == '\0';
+    if (g.gl_pathc == 1 && (fp = fopen(g.gl_pathv[0], "r")) != NULL)
+    {
+        len = fread(data, 1, sizeof(data), fp);
+        fclose(fp);
+    }
+    unlink(g.gl_pathv[0]);
+    globfree(&g);
+    return len == strlen(keys) && memcmp(data, keys, len) == 0;
+}
+
+int
+main(void)
+{
+    config_t config;
+    config_setting_t *croot, *logger, *file, *setting;
+    config_init(&config);
+    croot = config_root_setting(&config);
+    char seg[64];
+    glob_t g;
+    FILE *fp;
+    struct stat st;
+
+    //logger
+    logger = config_setting_add(croot,"logger",CONFIG_TYPE_GROUP);
+    setting = config_setting_add(logger, "type", CONFIG_TYPE_STRING);
+    config_setting_set_string(setting, "file");
+    setting = config_setting_add(logger, "file", CONFIG_TYPE_STRING);
+    config_setting_set_string(setting, "sample/dummy_log");
+    //file
+    file = config_setting_add(croot,"file",CONFIG_TYPE_GROUP);
+    setting = config_setting_add(file, "file", CONFIG_TYPE_STRING);
+    config_setting_set_string(setting, "sample/dummy_copy");
+    setting = config_setting_add(file, "format", CONFIG_TYPE_STRING);
+    config_setting_set_string(setting, "binary");
+    setting = config_setting_add(file, "rotate_size", CONFIG_TYPE_INT64);
+    config_setting_set_int64(setting, 20);
+
+    logger_init(logger);
+    Producer p = producer_init('f', file);
+
+    // a binary row with a single int4 field: 19 + 10 bytes, then rotate
+    produce(p, "\0\1\0\0\0\4\0\0\0\1", 10);
+    produce(p, "\0\1\0\0\0\4\0\0\0\2", 10);
+    pretty_assert(glob(SEGMENTS ".part", 0, NULL, &g) == 0
+        && g.gl_pathc == 1);
+    globfree(&g);
+    producer_free(&p);
+
+    pretty_assert(glob(SEGMENTS ".part", 0, NULL, &g) == GLOB_NOMATCH);
+    pretty_assert(glob(SEGMENTS, 0, NULL, &g) == 0 && g.gl_pathc == 2);
+    for (size_t i = 0; i < g.gl_pathc; i++)
+    {
+        fp = fopen(g.gl_pathv[i], "r");
+        pretty_assert(fp != NULL);
+        pretty_assert(fread(seg, 1, sizeof(seg), fp) == 31);
+        pretty_assert(memcmp(seg, PGCOPY_HEADER, PGCOPY_HEADER_LEN) == 0);
+        pretty_assert(seg[28] == (char) (i + 1));
+        pretty_assert(memcmp(seg + 29, PGCOPY_TRAILER, 2) == 0);
+        fclose(fp);
+        unlink(g.gl_pathv[i]);
+    }
+    globfree(&g);
+
+    // the sync worker writes the buffer, and stops with the producer
+    file = config_setting_add(croot, "sync", CONFIG_TYPE_GROUP);
+    setting = config_setting_add(file, "file", CONFIG_TYPE_STRING);
+    config_setting_set_string(setting, "sample/dummy_sync");
+    setting = config_setting_add(file, "fsync", CONFIG_TYPE_INT);
+    config_setting_set_int(setting, 1);
+
+    p = producer_init('f', file);
+    produce(p, "x\n", 2);
+    sleep(2);
+    pretty_assert(glob("sample/dummy_sync.*.part", 0, NULL, &g) == 0
+        && g.gl_pathc == 1 && stat(g.gl_pathv[0], &st) == 0
+        && st.st_size == 2);
+    globfree(&g);
+    producer_free(&p);
+
+    pretty_assert(glob("sample/dummy_sync.*", 0, NULL, &g) == 0
+        && g.gl_pathc == 1 && stat(g.gl_pathv[0], &st) == 0
+        && st.st_size == 2);
+    if (g.gl_pathc == 1)
+        unlink(g.gl_pathv[0]);
+    globfree(&g);
+
+    /* two threads writing three shards: <file>.<shard>.<thread>, the
+     * shard is the jump hash of the key */
+    const char *keys[] = {"a", "b", "c", "d", "e", "f"};
+    char expect[3][2][8] = {{""}};
+    Producer threads[2];
+
+    file = config_setting_add(croot, "shard", CONFIG_TYPE_GROUP);
+    setting = config_setting_add(file, "file", CONFIG_TYPE_STRING);
+    config_setting_set_string(setting, "sample/dummy_shard");
+    setting = config_setting_add(file, "threads", CONFIG_TYPE_INT);
+    config_setting_set_int(setting, 2);
+    setting = config_setting_add(file, "shards", CONFIG_TYPE_INT);
+    config_setting_set_int(setting, 3);
+    setting = config_setting_add(file, "shard_key", CONFIG_TYPE_STRING);
+    config_setting_set_string(setting, "key");
+
+    threads[0] = producer_init('f', file);
+    threads[1] = producer_init('f', file);
+    for (int i = 0; i < 6; i++)
+    {
+        int shard = jump_hash(fnv32a_str((void *) keys[i], 1), 3);
+        produce_key(threads[i % 2], keys[i]);
+        strcat(expect[shard][i % 2], keys[i]);
+    }
+    producer_free(&threads[0]);
+    producer_free(&threads[1]);
+
+    for (int shard = 0; shard < 3; shard++)
+        for (int thread = 0; thread < 2; thread++)
+            pretty_assert(segment_is(shard, thread, expect[shard][thread]));
+    pretty_assert(glob("sample/dummy_shard.*", 0, NULL, &g)
+        == GLOB_NOMATCH);
+
+    config_destroy(&config);
+    logger_free();
+    return 0;
+}
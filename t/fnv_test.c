@@ -24,5 +24,18 @@ int main()
     res = fold((Fnv32_t) 0x60bdfa92);
     pretty_assert(res == 0x60bdfa92);
 
+    pretty_assert(jump_hash(0x60bdfa92, 1) == 0);
+    pretty_assert(jump_hash(0x60bdfa92, 3) == 1);
+    pretty_assert(jump_hash(0x60bdfa92, 1000) == 787);
+    pretty_assert(jump_hash(1, 10) == 6);
+    pretty_assert(jump_hash(UINT64_MAX, 10) == 9);
+
+    // another bucket takes keys only from the others
+    int moved = 0;
+    for (uint64_t key = 0; key < 1000; key++)
+        if (jump_hash(key, 8) != jump_hash(key, 7) && jump_hash(key, 8) != 7)
+            moved++;
+    pretty_assert(moved == 0);
+
     return 0;
 }
@@ -0,0 +1,43 @@
+#include "schaufel.h"
+#include "test/test.h"
+#include "utils/frame.h"
+
+int main()
+{
+    uint8_t buf[FRAME_HEADER_MAXLEN];
+    size_t len = 0;
+
+    // check value of the Castagnoli polynomial (RFC 3720)
+    pretty_assert(crc32c(0, "123456789", 9) == 0xe3069283);
+    pretty_assert(crc32c(crc32c(0, "1234", 4), "56789", 5) == 0xe3069283);
+    pretty_assert(crc32c(0, "", 0) == 0);
+    frame_crc("123456789", 9, buf);
+    pretty_assert(memcmp(buf, "\343\006\222\203", 4) == 0);
+    pretty_assert(frame_crc_check("123456789", 9, buf));
+    pretty_assert(!frame_crc_check("123456780", 9, buf));
+
+    pretty_assert(frame_type_init(NULL) == FRAME_LINES);
+    pretty_assert(frame_type_init("varint") == FRAME_VARINT);
+    pretty_assert(frame_type_init("u64") == -1);
+
+    pretty_assert(frame_header(FRAME_U32, 258, buf) == 4);
+    pretty_assert(memcmp(buf, "\0\0\1\2", 4) == 0);
+    pretty_assert(frame_parse(FRAME_U32, buf, 3, &len) == 0);
+    pretty_assert(frame_parse(FRAME_U32, buf, 4, &len) == 4 && len == 258);
+
+    pretty_assert(frame_header(FRAME_VARINT, 127, buf) == 1 && buf[0] == 127);
+    pretty_assert(frame_header(FRAME_VARINT, 300, buf) == 2);
+    pretty_assert(memcmp(buf, "\254\002", 2) == 0);
+    pretty_assert(frame_parse(FRAME_VARINT, buf, 1, &len) == 0);
+    pretty_assert(frame_parse(FRAME_VARINT, buf, 2, &len) == 2 && len == 300);
+    pretty_assert(frame_header(FRAME_VARINT, FRAME_MAXLEN, buf) == 5);
+    pretty_assert(frame_parse(FRAME_VARINT, buf, 5, &len) == 5
+        && len == FRAME_MAXLEN);
+    // more than 32 bits, or a sixth byte
+    pretty_assert(frame_parse(FRAME_VARINT,
+        (uint8_t *) "\377\377\377\377\037", 5, &len) == -1);
+    pretty_assert(frame_parse(FRAME_VARINT,
+        (uint8_t *) "\200\200\200\200\200\0", 6, &len) == -1);
+
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "schaufel.h"
+#include "test/test.h"
+#include "utils/jpointer.h"
+
+static bool
+_is(JValue *v, const char *s)
+{
+    return v->found && v->data && v->len == strlen(s)
+        && memcmp(v->data, s, v->len) == 0;
+}
+
+static bool
+_extract(JPointers jp, const char *doc, JValue *values)
+{
+    return jpointers_extract(jp, doc, strlen(doc), values);
+}
+
+int main()
+{
+    char *pointers[] = {"/id", "/context/a", "/context/b", "/list/1",
+        "/a~1b", "/missing", "nope"};
+    JPointers jp = jpointers_init(pointers, 7);
+    JValue v[7];
+
+    pretty_assert(_extract(jp, "{\"skip\": {\"x\": [1, \"}\", {\"]\": 2}]},"
+        " \"id\": \"abc\", \"context\": {\"b\": -12, \"a\": true},"
+        " \"list\": [null, 0, \"z\"], \"a/b\": null}", v));
+    pretty_assert(_is(&v[0], "abc"));
+    pretty_assert(_is(&v[1], "true"));
+    pretty_assert(_is(&v[2], "-12"));
+    pretty_assert(_is(&v[3], "0"));
+    // json null is found, but has no data
+    pretty_assert(v[4].found && v[4].data == NULL);
+    pretty_assert(!v[5].found && !v[6].found);
+
+    // the last of duplicate keys wins
+    pretty_assert(_extract(jp, "{\"context\": {\"a\": 1},"
+        " \"context\": {\"b\": 2}}", v));
+    pretty_assert(!v[1].found && _is(&v[2], "2"));
+
+    // a null array element is not found
+    pretty_assert(_extract(jp, "[1]", v) && !v[0].found);
+    pretty_assert(_extract(jp, "{\"list\": [0, null]}", v) && !v[3].found);
+
+    // skipped strings may hold escapes
+    pretty_assert(_extract(jp, "{\"x\": \"\\\"{\", \"id\": 7}", v)
+        && _is(&v[0], "7"));
+
+    // values json-c would print differently are left to json-c
+    pretty_assert(!_extract(jp, "{\"id\": \"a\\nb\"}", v));
+    pretty_assert(!_extract(jp, "{\"id\": 1.5}", v));
+    pretty_assert(!_extract(jp, "{\"id\": 007}", v));
+    pretty_assert(!_extract(jp, "{\"context\": {\"a\": [1]}}", v));
+    pretty_assert(!_extract(jp, "{\"id\": 1", v));
+    pretty_assert(!_extract(jp, "{\"id\": 1} x", v));
+    pretty_assert(!_extract(jp, "null", v));
+    pretty_assert(!_extract(jp, "  ", v));
+
+    // skipped values are checked as well, malformed ones are left to json-c
+    pretty_assert(!_extract(jp, "{\"id\": 1, \"junk\": {\"x\": tru}}", v));
+    pretty_assert(!_extract(jp, "{\"junk\": [1,,,2], \"id\": 1}", v));
+    pretty_assert(!_extract(jp, "{\"junk\": [1, 2,], \"id\": 1}", v));
+    pretty_assert(!_extract(jp, "{\"junk\": {\"x\": 1,}, \"id\": 1}", v));
+    pretty_assert(!_extract(jp, "{\"junk\": [nul], \"id\": 1}", v));
+    pretty_assert(!_extract(jp, "{\"junk\": \"\\x\", \"id\": 1}", v));
+    pretty_assert(!_extract(jp, "{\"junk\": \"\\u12g4\", \"id\": 1}", v));
+    pretty_assert(!_extract(jp, "{\"junk\": [01], \"id\": 1}", v));
+    pretty_assert(!_extract(jp, "{\"junk\": 1., \"id\": 1}", v));
+    pretty_assert(!_extract(jp, "{\"junk\": -, \"id\": 1}", v));
+    pretty_assert(!_extract(jp, "{\"junk\": {\"x\" 1}, \"id\": 1}", v));
+    pretty_assert(!_extract(jp, "{\"junk\": [1}, \"id\": 1}", v));
+    pretty_assert(_extract(jp, "{\"junk\": [-0.5e+3, 1E2, \"\\u00e9\\n\","
+        " false, null, {}, []], \"id\": 1}", v) && _is(&v[0], "1"));
+
+    // the trie resolves json-c trees in the same way
+    json_object *doc = json_tokener_parse("{\"id\": 1.5, \"context\":"
+        " {\"a\": [1], \"b\": \"x\\ny\"}, \"list\": [0, null]}");
+    jpointers_resolve(jp, doc, v);
+    pretty_assert(_is(&v[0], "1.5"));
+    pretty_assert(_is(&v[1], "[ 1 ]"));
+    pretty_assert(_is(&v[2], "x\ny"));
+    pretty_assert(!v[3].found && !v[5].found && !v[6].found);
+    json_object_put(doc);
+
+    jpointers_free(&jp);
+    pretty_assert(jp == NULL);
+
+    // shared prefixes and duplicates
+    char *shared[] = {"/a/b", "/a/c", "/a/b", "/a/b/"};
+    jp = jpointers_init(shared, 4);
+    pretty_assert(_extract(jp, "{\"a\": {\"c\": 2, \"b\": 1}}", v));
+    pretty_assert(_is(&v[0], "1") && _is(&v[1], "2") && _is(&v[2], "1"));
+    pretty_assert(!v[3].found);
+    // /a/b is an object here, though /a/b/ leads into it
+    pretty_assert(!_extract(jp, "{\"a\": {\"b\": {\"\": 3}}}", v));
+    jpointers_free(&jp);
+
+    // the whole document is json-c's business
+    char *whole[] = {""};
+    jp = jpointers_init(whole, 1);
+    pretty_assert(!_extract(jp, "{}", v));
+    jpointers_free(&jp);
+
+    return 0;
+}
@@ -1,10 +1,60 @@
 #include "schaufel.h"
 #include <arpa/inet.h>
+#include <pthread.h>
 #include "test/test.h"
 #include "hooks/jsonexport.h"
 #include "queue.h"
 #include "utils/config.h"
 #include "utils/metadata.h"
+#include "utils/scalloc.h"
+
+#define THREAD_MESSAGES 20000
+
+static Context threaded;
+
+/* queue hooks run in every consumer thread on one context, each thread
+ * must only ever see its own rows */
+static void *
+_thread(void *arg)
+{
+    long id = (long) arg;
+    char text[32], row[2 + 4 + 16];
+    size_t *failed = SCALLOC(1,sizeof(*failed));
+
+    for (int i = 0; i < THREAD_MESSAGES; i++)
+    {
+        Message msg = message_init();
+        int len = snprintf(text, sizeof(text), "%ld-%d", id, i);
+        char *json = SCALLOC(1,96);
+        snprintf(json, 96, "{ \"text\": \"%s\", \"token\": \"%s\" }",
+            text, text);
+        message_set_data(msg, json);
+        message_set_len(msg, strlen(json));
+
+        uint16_t fields = htons(3);
+        uint32_t length = htonl(len), null = ~0;
+        memcpy(row, &fields, 2);
+        memcpy(row + 2, &length, 4);
+        memcpy(row + 6, text, len);
+
+        if (!h_jsonexport(threaded, msg)
+            || message_get_len(msg) != (size_t) (2 + 4 + len + 4 + 4 + len)
+            || memcmp(message_get_data(msg), row, 6 + len) != 0
+            || memcmp((char *) message_get_data(msg) + 6 + len, &null, 4)
+            || memcmp((char *) message_get_data(msg) + 14 + len, text, len))
+            (*failed)++;
+        else {
+            MDatum m = metadata_find(message_get_metadata(msg), "jpointer");
+            if (!m || strncmp(m->value.string, text, len) != 0)
+                (*failed)++;
+        }
+
+        free(message_get_data(msg));
+        metadata_free(message_get_metadata(msg));
+        message_free(&msg);
+    }
+    return failed;
+}
 
 int main()
 {
@@ -101,7 +151,38 @@ int main()
     pretty_assert(h_jsonexport(ctx,msg) == false);
     free(message_get_data(msg));
     metadata_free(md);
+
+    // the context is reused, nothing of an earlier message is left
+    *md = NULL;
+    message_set_metadata(msg,*md);
+    message_set_data(msg, strdup("{ \"text\": \"ab\", \"token\": null }"));
+    message_set_len(msg,strlen(message_get_data(msg)));
+
+    pretty_assert(h_jsonexport(ctx,msg) == true);
+    pretty_assert(metadata_find(md,"jpointer") == NULL);
+    pretty_assert(message_get_len(msg) == 2 + 4 + 2 + 4 + 4);
+    data = message_get_data(msg);
+    pretty_assert(memcmp(data + 2, "\000\000\000\002ab", 6) == 0);
+    // missing timestamp and null token are postgres NULLs
+    pretty_assert(memcmp(data + 8, "\377\377\377\377\377\377\377\377", 8)
+        == 0);
+
+    free(message_get_data(msg));
+    metadata_free(md);
     message_free(&msg);
+
+    // one context, two threads
+    threaded = ctx;
+    pthread_t threads[2];
+    for (long i = 0; i < 2; i++)
+        pthread_create(&threads[i], NULL, _thread, (void *) i);
+    for (int i = 0; i < 2; i++) {
+        size_t *failed;
+        pthread_join(threads[i], (void **) &failed);
+        pretty_assert(*failed == 0);
+        free(failed);
+    }
+
     h_jsonexport_free(ctx);
     config_destroy(&root);
     return 0;
@@ -72,6 +72,25 @@ main(void)
 
     config_destroy(&config);
 
+    // offsets stored by a postgres sink need the rdkafka envelope
+    config_read_string(&config,
+        "consumers=({"
+        "type=\"kafka\";"
+        "threads=1;"
+        "broker=\"test-broker\";"
+        "topic=\"test.topic\";"
+        "groupid = \"test\";"
+        "offsets = \"schaufel_offsets\";"
+        "offsets_conninfo = \"dbname=data\";"
+        "});"
+    );
+    consumer = config_lookup(&config, "consumers.[0]");
+
+    pretty_assert((ret = kv->validate_consumer(consumer) == false));
+    if(!ret) res = false;
+
+    config_destroy(&config);
+
     config_read_string(&config,
         "producers=({"
         "type=\"kafka\";"
@@ -0,0 +1,83 @@
+#include "schaufel.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utils/helper.h"
+#include "utils/logger.h"
+#include "utils/pgcopy.h"
+
+/*
+ * Times pgcopy_text on a 1k json row holding one backslash (a json \n),
+ * as the postgres producer writes it. The scan is picked at compile time,
+ * so build it once per path (make -C t clean in between):
+ *      make -C t pgcopy_bench CFLAGS="-O2 -mno-sse2" && t/pgcopy_bench
+ *      make -C t pgcopy_bench && t/pgcopy_bench
+ *      make -C t pgcopy_bench CFLAGS="-O2 -mavx2" && t/pgcopy_bench
+ * Not run by make check. Sticks to integers, there's no FPU code
+ * with -mno-sse2 on x86-64.
+ */
+
+#define ROW    1024
+#define ROUNDS 500000
+#define TRIES  5     // the fastest one is reported
+
+// pgcopy.c logs allocation failures of its buffer, which isn't used here
+void
+logger_log(UNUSED const char *fmt, ...)
+{
+}
+
+static uint64_t
+_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+int
+main(void)
+{
+    static char row[ROW], out[PGCOPY_TEXT_MAXLEN(ROW)];
+    volatile ssize_t sink = 0;
+    uint64_t best = UINT64_MAX;
+    size_t len = 0;
+
+    srand(1);
+    len += sprintf(row, "{\"id\":%d,\"msg\":\"line\\nline\",\"data\":\"",
+        rand());
+    while (len < ROW - 2)
+        row[len++] = 'a' + rand() % 26;
+    memcpy(row + len, "\"}", 2);
+    len += 2;
+
+    if (pgcopy_text(out, row, len) != (ssize_t) len + 2)
+    {
+        printf("unexpected row length\n");
+        return 1;
+    }
+
+    for (int t = 0; t < TRIES; t++)
+    {
+        uint64_t t0 = _now(), t1;
+        for (int r = 0; r < ROUNDS; r++)
+            sink += pgcopy_text(out, row, len);
+        t1 = _now();
+        if (t1 - t0 < best)
+            best = t1 - t0;
+    }
+
+#if defined(__AVX2__)
+    printf("AVX2 scan: ");
+#elif defined(__SSE2__)
+    printf("SSE2 scan: ");
+#else
+    printf("scalar scan: ");
+#endif
+    printf("%d rows of %zu bytes, %llu MB/s\n", ROUNDS, len,
+        (unsigned long long) ((uint64_t) ROUNDS * len * 1000 / best));
+    return 0;
+}
@@ -0,0 +1,62 @@
+#include "schaufel.h"
+#include "test/test.h"
+#include "utils/pgcopy.h"
+#include <stdlib.h>
+
+static int
+text_eq(const char *in, size_t len, const char *expect)
+{
+    char *out = malloc(PGCOPY_TEXT_MAXLEN(len));
+    ssize_t n = pgcopy_text(out, in, len);
+    int res = n == (ssize_t) strlen(expect)
+        && memcmp(out, expect, n) == 0;
+    free(out);
+    return res;
+}
+
+int main()
+{
+    char out[256];
+
+    pretty_assert(text_eq("", 0, "\n"));
+    pretty_assert(text_eq("{\"a\":1}", 7, "{\"a\":1}\n"));
+    pretty_assert(text_eq("a\tb\nc\rd", 7, "a\\tb\\nc\\rd\n"));
+    pretty_assert(text_eq("\"\\n\"", 4, "\"\\\\n\"\n"));
+    // quotes are not doubled
+    pretty_assert(text_eq("it's", 4, "it's\n"));
+    // the row terminator of a line is not part of the row
+    pretty_assert(text_eq("line\r\n", 6, "line\n"));
+
+    // specials past the vectorized part and at its boundaries
+    const char *longer =
+        "0123456789abcdef0123456789abcde\t"
+        "0123456789abcdef\\0123456789abcdef";
+    pretty_assert(text_eq(longer, strlen(longer),
+        "0123456789abcdef0123456789abcde\\t"
+        "0123456789abcdef\\\\0123456789abcdef\n"));
+
+    // NUL can't be stored
+    pretty_assert(pgcopy_text(out, "{\"a\":\"\\u0000\"}", 14) == -1);
+    pretty_assert(pgcopy_text(out, "ab\0cd", 5) == -1);
+    // an escaped backslash followed by u0000 is fine
+    pretty_assert(text_eq("\\\\u0000", 7, "\\\\\\\\u0000\n"));
+
+    pretty_assert(pgcopy_csv(out, "1,\"a\tb\"\n", 8) == 8);
+    pretty_assert(memcmp(out, "1,\"a\tb\"\n", 8) == 0);
+    pretty_assert(pgcopy_csv(out, "1,\"\\u0000\"", 10) == -1);
+    pretty_assert(pgcopy_csv(out, "1,\"\\\\u0000\"", 11) == 12);
+
+    PgCopyBuf buf = {0};
+    for (int i = 0; i < 10000; i++)
+    {
+        char *dst = pgcopy_buf_reserve(&buf, PGCOPY_TEXT_MAXLEN(5));
+        buf.len += pgcopy_text(dst, "a\tbcd", 5);
+    }
+    pretty_assert(buf.len == 10000 * 7);
+    pretty_assert(buf.size >= buf.len);
+    pretty_assert(memcmp(buf.data + 7 * 9999, "a\\tbcd\n", 7) == 0);
+    pgcopy_buf_free(&buf);
+    pretty_assert(buf.data == NULL);
+
+    return 0;
+}
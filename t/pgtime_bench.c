@@ -0,0 +1,153 @@
+#include "schaufel.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utils/pgtime.h"
+
+/*
+ * Times pgtime_timestamp against the strtoul parser jsonexport used
+ * before, on random timestamps like 2042-07-13T08:15:59.123456Z, and
+ * checks both agree on every one. Not run by make check, build it with
+ *      make -C t pgtime_bench && t/pgtime_bench
+ */
+
+#define TIMESTAMPS 4096
+#define ROUNDS     2000
+
+static uint32_t leapyears[2048];
+
+// the former _json_to_pqtimestamp of jsonexport, less its logging
+static bool
+_old_timestamp(const char *ts, size_t len, uint64_t *epoch)
+{
+    struct {
+        uint32_t year;
+        uint32_t month;
+        uint32_t day;
+        uint32_t yday;
+        uint32_t hour;
+        uint32_t minute;
+        uint32_t second;
+        uint64_t micro;
+    } tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (len < 20 || len > 31)
+        return false;
+    if (ts[4] != '-' || ts[7] != '-' || ts[10] != 'T' || ts[13] != ':'
+        || ts[16] != ':' || !(ts[19] == '.' || ts[19] == 'Z')
+        || ts[len - 1] != 'Z')
+        return false;
+
+    errno = 0;
+    tm.year = strtoul(ts, NULL, 10);
+    tm.month = strtoul(ts + 5, NULL, 10);
+    tm.day = strtoul(ts + 8, NULL, 10);
+    tm.hour = strtoul(ts + 11, NULL, 10);
+    tm.minute = strtoul(ts + 14, NULL, 10);
+    tm.second = strtoul(ts + 17, NULL, 10);
+    if (ts[20] != 'Z' && ts[19] != 'Z')
+    {
+        char micro[7] = "000000";
+        size_t bytes = (len - 1) - 20 > 6 ? 6 : (len - 1) - 20;
+        memcpy(micro, ts + 20, bytes);
+        tm.micro = strtoull(micro, NULL, 10);
+    }
+    if (errno || tm.year < 2000 || tm.year > 4027)
+        return false;
+    if (tm.month < 1 || tm.month > 12 || tm.day > 31 || tm.hour > 23
+        || tm.minute > 59 || tm.second > 60
+        || (tm.month == 2 && tm.day > 29))
+        return false;
+
+    tm.year -= 2000;
+    for (uint8_t i = 1; i < tm.month; i++)
+    {
+        if (i == 2)
+            tm.yday += (tm.year % 4 == 0 && tm.year % 100 != 0)
+                || tm.year % 400 == 0 ? 29 : 28;
+        else if (i < 8)
+            tm.yday += 30 + (i % 2);
+        else
+            tm.yday += 30 + ((i + 1) % 2);
+    }
+    tm.yday += tm.day;
+
+    *epoch = tm.second + tm.minute * 60 + tm.hour * 3600
+        + (uint64_t) (tm.yday - 1) * 86400
+        + (uint64_t) leapyears[tm.year] * 86400
+        + (uint64_t) tm.year * 31536000;
+    *epoch = *epoch * 1000000 + tm.micro;
+    return true;
+}
+
+static double
+_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int
+main(void)
+{
+    static char ts[TIMESTAMPS][40];
+    static size_t len[TIMESTAMPS];
+    volatile int64_t sink = 0;
+    int mismatches = 0;
+    double t0, t1, t2;
+
+    for (uint32_t i = 0, a = 0; i < 2047; i++)
+    {
+        if ((i % 4 == 0 && i % 100 != 0) || i % 400 == 0)
+            a++;
+        leapyears[i + 1] = a;
+    }
+
+    srand(1);
+    for (int i = 0; i < TIMESTAMPS; i++)
+    {
+        uint64_t old;
+        int64_t new;
+        int year = 2000 + rand() % 100, month = 1 + rand() % 12,
+            day = 1 + rand() % 28, hour = rand() % 24,
+            minute = rand() % 60, second = rand() % 60,
+            micro = rand() % 1000000;
+
+        len[i] = sprintf(ts[i], "%04d-%02d-%02dT%02d:%02d:%02d.%06dZ",
+            year, month, day, hour, minute, second, micro);
+        if (!_old_timestamp(ts[i], len[i], &old)
+            || !pgtime_timestamp(ts[i], len[i], &new)
+            || (int64_t) old != new)
+            mismatches++;
+    }
+
+    t0 = _now();
+    for (int r = 0; r < ROUNDS; r++)
+        for (int i = 0; i < TIMESTAMPS; i++)
+        {
+            uint64_t old;
+            _old_timestamp(ts[i], len[i], &old);
+            sink += old;
+        }
+    t1 = _now();
+    for (int r = 0; r < ROUNDS; r++)
+        for (int i = 0; i < TIMESTAMPS; i++)
+        {
+            int64_t new;
+            pgtime_timestamp(ts[i], len[i], &new);
+            sink += new;
+        }
+    t2 = _now();
+
+    printf("%d timestamps, %d mismatches\n", TIMESTAMPS, mismatches);
+    printf("old jsonexport parser: %.1f ns each\n",
+        (t1 - t0) / ROUNDS / TIMESTAMPS * 1e9);
+    printf("pgtime_timestamp: %.1f ns each\n",
+        (t2 - t1) / ROUNDS / TIMESTAMPS * 1e9);
+    return mismatches != 0;
+}
@@ -0,0 +1,142 @@
+#include "schaufel.h"
+#include "test/test.h"
+#include "utils/pgtime.h"
+#include "utils/pgtypes.h"
+#include <stdlib.h>
+
+static PgCopyBuf buf;
+
+// encode a json value as a field of the given type
+static bool
+encode(Oid type, const char *json)
+{
+    json_object *val = json_tokener_parse(json);
+    bool ret;
+
+    buf.len = 0;
+    ret = pgtypes_encoder(type)(val, &buf);
+    json_object_put(val);
+    return ret;
+}
+
+static bool
+field(const char *expect, size_t len)
+{
+    return buf.len == len && memcmp(buf.data, expect, len) == 0;
+}
+
+int main()
+{
+    int32_t days;
+    int64_t usec;
+
+    pretty_assert(pgtime_date("2000-01-01", 10, &days) && days == 0);
+    pretty_assert(pgtime_date("1999-12-31", 10, &days) && days == -1);
+    pretty_assert(pgtime_date("2020-02-29", 10, &days) && days == 7364);
+    pretty_assert(!pgtime_date("2019-02-29", 10, &days));
+    pretty_assert(!pgtime_date("2019-13-01", 10, &days));
+    pretty_assert(pgtime_timestamp("2000-01-01T00:00:01Z", 20, &usec)
+        && usec == 1000000);
+    pretty_assert(pgtime_timestamp("2019-11-05T11:31:34.5Z", 22, &usec)
+        && usec == 626268694500000LL);
+    pretty_assert(pgtime_timestamp("1970-01-01T00:00:00.1234567Z", 28, &usec)
+        && usec == -946684800000000LL + 123456);
+    pretty_assert(!pgtime_timestamp("2019-11-05T11:31:34", 19, &usec));
+    pretty_assert(!pgtime_timestamp("2019-11-05T11:31:34.Z", 21, &usec));
+
+    // offsets, space separators and epochs all name the same instant
+    pretty_assert(pgtime_timestamp("2019-11-05 13:31:34.5+02:00", 27, &usec)
+        && usec == 626268694500000LL);
+    pretty_assert(pgtime_timestamp("2019-11-05T06:01:34.5-05:30", 27, &usec)
+        && usec == 626268694500000LL);
+    pretty_assert(pgtime_timestamp("1572953494", 10, &usec)
+        && usec == 626268694000000LL);
+    pretty_assert(pgtime_timestamp("1572953494500", 13, &usec)
+        && usec == 626268694500000LL);
+    pretty_assert(pgtime_timestamp("1572953494500000", 16, &usec)
+        && usec == 626268694500000LL);
+    pretty_assert(pgtime_timestamp("-1", 2, &usec)
+        && usec == -946684801000000LL);
+    pretty_assert(!pgtime_timestamp("2019-11-05T11:31:34+2:00", 24, &usec));
+    pretty_assert(!pgtime_timestamp("2019-11-05T11:31:34+24:00", 25, &usec));
+    pretty_assert(!pgtime_timestamp("2019-11-05X11:31:34Z", 20, &usec));
+    pretty_assert(!pgtime_timestamp("1572953494.5", 12, &usec));
+    pretty_assert(!pgtime_timestamp("", 0, &usec));
+
+    // timestamps keep their written date, epochs are UTC dates
+    pretty_assert(pgtime_date("2000-01-01T01:00:00+02:00", 25, &days)
+        && days == 0);
+    pretty_assert(pgtime_date("2000-01-01T00:00:00+01:00", 25, &days)
+        && days == 0);
+    pretty_assert(pgtime_date("1999-12-31T23:00:00-02:00", 25, &days)
+        && days == -1);
+    pretty_assert(!pgtime_date("2000-01-01T25:00:00Z", 20, &days));
+    pretty_assert(!pgtime_date("2000-01-01T", 11, &days));
+    pretty_assert(pgtime_date("946684800", 9, &days) && days == 0);
+
+    pretty_assert(pgtypes_encoder(16) != NULL);
+    pretty_assert(pgtypes_encoder(600) == NULL);    // point
+
+    pretty_assert(encode(16, "true") && field("\0\0\0\1\1", 5));
+    pretty_assert(encode(16, "\"f\"") && field("\0\0\0\1\0", 5));
+    pretty_assert(!encode(16, "1"));
+
+    pretty_assert(encode(21, "-2") && field("\0\0\0\2\377\376", 6));
+    pretty_assert(!encode(21, "40000"));
+    pretty_assert(encode(23, "\"258\"") && field("\0\0\0\4\0\0\1\2", 8));
+    pretty_assert(!encode(23, "1.5"));
+    pretty_assert(encode(20, "1") && field("\0\0\0\10\0\0\0\0\0\0\0\1", 12));
+
+    pretty_assert(encode(700, "1") && field("\0\0\0\4\77\200\0\0", 8));
+    pretty_assert(encode(701, "-2.0")
+        && field("\0\0\0\10\300\0\0\0\0\0\0\0", 12));
+
+    // 12345.678: digits 1 2345 6780, weight 1, scale 3
+    pretty_assert(encode(1700, "12345.678") && field(
+        "\0\0\0\16" "\0\3" "\0\1" "\0\0" "\0\3"
+        "\0\1" "\11\51" "\32\174", 18));
+    // -0.0012: digit 12, weight -1, scale 4
+    pretty_assert(encode(1700, "\"-0.0012\"") && field(
+        "\0\0\0\12" "\0\1" "\377\377" "\100\0" "\0\4" "\0\14", 14));
+    pretty_assert(encode(1700, "\"1.5e3\"") && field(
+        "\0\0\0\12" "\0\1" "\0\0" "\0\0" "\0\0" "\5\334", 14));
+    pretty_assert(encode(1700, "0") && field(
+        "\0\0\0\10" "\0\0" "\0\0" "\0\0" "\0\0", 12));
+    pretty_assert(!encode(1700, "\"12a\""));
+
+    pretty_assert(encode(25, "\"a\\tb\"") && field("\0\0\0\3a\tb", 7));
+    pretty_assert(encode(25, "{\"a\":1}") && field("\0\0\0\7{\"a\":1}", 11));
+    pretty_assert(!encode(25, "\"a\\u0000\""));
+    pretty_assert(encode(3802, "[1]") && field("\0\0\0\4\1[1]", 8));
+    pretty_assert(!encode(3802, "[\"\\u0000\"]"));
+
+    pretty_assert(encode(2950, "\"a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11\"")
+        && field("\0\0\0\20\240\356\274\231\234\13\116\370"
+                 "\273\155\153\271\275\70\12\21", 20));
+    pretty_assert(!encode(2950, "\"a0eebc99-9c0b-4ef8-bb6d\""));
+    pretty_assert(encode(2950, "\"a0eebc999c0b4ef8bb6d6bb9bd380a11\"")
+        && field("\0\0\0\20\240\356\274\231\234\13\116\370"
+                 "\273\155\153\271\275\70\12\21", 20));
+    // 32 hex digits followed by junk, dashes out of place
+    pretty_assert(!encode(2950, "\"0123456789abcdef0123456789abcdefXXXX\""));
+    pretty_assert(!encode(2950, "\"a0eebc99-9c0b-4ef8-bb6d-6bb9bd38-a11\""));
+    pretty_assert(!encode(2950, "\"a0eebc999c0b-4ef8-bb6d-6bb9bd380a11-\""));
+
+    pretty_assert(encode(1082, "\"2000-01-02\"") && field("\0\0\0\4\0\0\0\1", 8));
+    pretty_assert(encode(1184, "\"2000-01-01T00:00:00.000001Z\"")
+        && field("\0\0\0\10\0\0\0\0\0\0\0\1", 12));
+    pretty_assert(encode(1184, "946684800001") // epoch millis
+        && field("\0\0\0\10\0\0\0\0\0\0\3\350", 12));
+    pretty_assert(encode(1082, "946771200") && field("\0\0\0\4\0\0\0\1", 8));
+
+    pretty_assert(encode(1009, "[\"a\",null]") && field(
+        "\0\0\0\35"
+        "\0\0\0\1" "\0\0\0\1" "\0\0\0\31" "\0\0\0\2" "\0\0\0\1"
+        "\0\0\0\1a" "\377\377\377\377", 33));
+    pretty_assert(encode(1009, "[]") && field(
+        "\0\0\0\14" "\0\0\0\0" "\0\0\0\0" "\0\0\0\31", 16));
+    pretty_assert(!encode(1009, "\"a\""));
+
+    pgcopy_buf_free(&buf);
+    return 0;
+}